@@ -0,0 +1,638 @@
+#include "Bench.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+
+#include "Bencode.hpp"
+#include "RingBuffer.hpp"
+#include "Utp.hpp"
+
+namespace {
+
+// Linux never retransmits a lost segment sooner than this.
+constexpr auto kRetransmitTimeout = std::chrono::milliseconds(200);
+constexpr size_t kHandshakeSize = 68;
+
+int listenLoopback() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::runtime_error("Error creating bench socket");
+  }
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+      listen(fd, 128) == -1) {
+    close(fd);
+    throw std::runtime_error("Error listening on loopback");
+  }
+  return fd;
+}
+
+int bindLoopbackUdp() {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::runtime_error("Error creating bench socket");
+  }
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+    close(fd);
+    throw std::runtime_error("Error binding on loopback");
+  }
+  return fd;
+}
+
+uint16_t localPort(int fd) {
+  sockaddr_in address{};
+  socklen_t length = sizeof(address);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+  return ntohs(address.sin_port);
+}
+
+bool sendAll(int fd, const void* data, size_t size, int flags = 0) {
+  const auto* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL | flags);
+    if (sent <= 0) {
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool recvAll(int fd, void* data, size_t size) {
+  auto* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t got = recv(fd, bytes, size, 0);
+    if (got <= 0) {
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += got;
+    size -= got;
+  }
+  return true;
+}
+
+struct Swarm {
+  std::string_view payload;
+  std::string info_hash;
+  size_t piece_length;
+  size_t piece_num;
+};
+
+// Outgoing half of a seed connection: responses wait here until their
+// latency has passed and the bandwidth budget allows them out.
+class ResponseQueue {
+ public:
+  struct Response {
+    std::chrono::steady_clock::time_point due;
+    std::string header;
+    std::string_view body;
+  };
+
+  void push(Response response) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(response));
+    cv_.notify_one();
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    cv_.notify_one();
+  }
+
+  void run(int fd, const PeerProfile& profile) {
+    auto next_send = std::chrono::steady_clock::now();
+    while (true) {
+      Response response;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return closed_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        response = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      std::this_thread::sleep_until(std::max(response.due, next_send));
+      // MSG_MORE keeps Nagle from holding the body back behind the header.
+      if (!sendAll(fd, response.header.data(), response.header.size(),
+                   response.body.empty() ? 0 : MSG_MORE) ||
+          !sendAll(fd, response.body.data(), response.body.size())) {
+        return;
+      }
+      if (profile.bandwidth > 0) {
+        size_t size = response.header.size() + response.body.size();
+        next_send = std::max(next_send, std::chrono::steady_clock::now()) +
+                    std::chrono::nanoseconds(size * 1000000000ull /
+                                             profile.bandwidth);
+      }
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Response> queue_;
+  bool closed_ = false;
+};
+
+std::string messageHeader(uint32_t length, uint8_t id) {
+  std::string header(5, '\0');
+  uint32_t net_length = htonl(length);
+  std::memcpy(header.data(), &net_length, 4);
+  header[4] = static_cast<char>(id);
+  return header;
+}
+
+// Our handshake and a full bitfield, in answer to the peer's handshake.
+std::string seedGreeting(const char* handshake, const Swarm& swarm,
+                         uint64_t seed) {
+  std::string reply(handshake, 28);
+  std::memset(reply.data() + 20, 0, 8);
+  reply += swarm.info_hash;
+  reply += "-BENCH0-";
+  reply += std::to_string(1000000000000ull + seed % 1000000000000ull).substr(1);
+  std::string bitfield((swarm.piece_num + 7) / 8, '\0');
+  for (size_t i = 0; i < swarm.piece_num; ++i) {
+    bitfield[i / 8] |= static_cast<char>(0x80 >> (i % 8));
+  }
+  return reply + messageHeader(1 + bitfield.size(), 5) + bitfield;
+}
+
+void serveSeed(int fd, const Swarm& swarm, const PeerProfile& profile,
+               uint64_t seed) {
+  std::array<char, kHandshakeSize> handshake{};
+  if (!recvAll(fd, handshake.data(), handshake.size()) ||
+      std::memcmp(handshake.data() + 28, swarm.info_hash.data(), 20) != 0) {
+    close(fd);
+    return;
+  }
+  std::string reply = seedGreeting(handshake.data(), swarm, seed);
+  if (!sendAll(fd, reply.data(), reply.size())) {
+    close(fd);
+    return;
+  }
+  ResponseQueue responses;
+  std::thread writer([&] { responses.run(fd, profile); });
+  std::mt19937_64 rng(seed);
+  std::bernoulli_distribution lost(profile.loss);
+  std::string message;
+  while (true) {
+    uint32_t length;
+    if (!recvAll(fd, &length, 4)) {
+      break;
+    }
+    length = ntohl(length);
+    if (length == 0) {
+      continue;
+    }
+    message.resize(length);
+    if (!recvAll(fd, message.data(), length)) {
+      break;
+    }
+    auto due = std::chrono::steady_clock::now() + profile.latency;
+    if (message[0] == 2) {
+      responses.push({due, messageHeader(1, 1), {}});
+    } else if (message[0] == 6 && length == 13) {
+      uint32_t fields[3];
+      std::memcpy(fields, message.data() + 1, sizeof(fields));
+      size_t offset = size_t(ntohl(fields[0])) * swarm.piece_length +
+                      ntohl(fields[1]);
+      size_t size = ntohl(fields[2]);
+      if (offset + size > swarm.payload.size()) {
+        break;
+      }
+      std::string header = messageHeader(9 + size, 7);
+      header.append(message.data() + 1, 8);
+      if (profile.loss > 0 && lost(rng)) {
+        due += kRetransmitTimeout;
+      }
+      responses.push(
+          {due, std::move(header),
+           swarm.payload.substr(offset, size)});
+    }
+  }
+  shutdown(fd, SHUT_RDWR);
+  responses.close();
+  writer.join();
+  close(fd);
+}
+
+// A seed connection over uTP. It answers like serveSeed, but on the
+// thread of its UtpSocket: input is parsed as it arrives and pump() sends
+// whatever responses are due and fit.
+class UtpSeedSession : public Reactor::Handler {
+ public:
+  UtpSeedSession(std::unique_ptr<UtpStream> stream, const Swarm& swarm,
+                 const PeerProfile& profile, uint64_t seed)
+      : stream_(std::move(stream)),
+        swarm_(swarm),
+        profile_(profile),
+        seed_(seed),
+        rng_(seed),
+        lost_(profile.loss) {
+    stream_->attach(in_, this);
+  }
+
+  bool closed() const { return closed_; }
+
+  void onWritable() override {}
+
+  void onReceived(ssize_t result) override {
+    if (result <= 0) {
+      closed_ = true;
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    while (!closed_) {
+      if (!greeted_) {
+        if (in_->size() < kHandshakeSize) {
+          return;
+        }
+        const char* handshake = reinterpret_cast<const char*>(in_->data());
+        if (std::memcmp(handshake + 28, swarm_.info_hash.data(), 20) != 0) {
+          closed_ = true;
+          return;
+        }
+        responses_.push_back({now, seedGreeting(handshake, swarm_, seed_), {}});
+        in_->consume(kHandshakeSize);
+        greeted_ = true;
+        continue;
+      }
+      if (in_->size() < 4) {
+        return;
+      }
+      uint32_t length;
+      std::memcpy(&length, in_->data(), 4);
+      length = ntohl(length);
+      if (in_->size() < 4 + size_t(length)) {
+        return;
+      }
+      const char* message = reinterpret_cast<const char*>(in_->data()) + 4;
+      handle(message, length, now);
+      in_->consume(4 + size_t(length));
+    }
+  }
+
+  void pump(std::chrono::steady_clock::time_point now) {
+    while (!closed_ && !responses_.empty() && responses_.front().due <= now &&
+           next_send_ <= now) {
+      auto& response = responses_.front();
+      std::string_view header = response.header;
+      std::string_view body = response.body;
+      size_t size = header.size() + body.size();
+      std::array<iovec, 2> iov{};
+      size_t count = 0;
+      if (sent_ < header.size()) {
+        iov[count++] = {const_cast<char*>(header.data()) + sent_,
+                        header.size() - sent_};
+      }
+      size_t body_sent = std::max(sent_, header.size()) - header.size();
+      if (body_sent < body.size()) {
+        iov[count++] = {const_cast<char*>(body.data()) + body_sent,
+                        body.size() - body_sent};
+      }
+      ssize_t n = stream_->send(iov.data(), count);
+      if (n < 0) {
+        closed_ = true;
+        return;
+      }
+      sent_ += n;
+      if (sent_ < size) {
+        return;
+      }
+      sent_ = 0;
+      responses_.pop_front();
+      if (profile_.bandwidth > 0) {
+        next_send_ = std::max(next_send_, now) +
+                     std::chrono::nanoseconds(size * 1000000000ull /
+                                              profile_.bandwidth);
+      }
+    }
+  }
+
+ private:
+  void handle(const char* message, uint32_t length,
+              std::chrono::steady_clock::time_point now) {
+    if (length == 0) {
+      return;
+    }
+    auto due = now + profile_.latency;
+    if (message[0] == 2) {
+      responses_.push_back({due, messageHeader(1, 1), {}});
+    } else if (message[0] == 6 && length == 13) {
+      uint32_t fields[3];
+      std::memcpy(fields, message + 1, sizeof(fields));
+      size_t offset = size_t(ntohl(fields[0])) * swarm_.piece_length +
+                      ntohl(fields[1]);
+      size_t size = ntohl(fields[2]);
+      if (offset + size > swarm_.payload.size()) {
+        closed_ = true;
+        return;
+      }
+      std::string header = messageHeader(9 + size, 7);
+      header.append(message + 1, 8);
+      if (profile_.loss > 0 && lost_(rng_)) {
+        due += kRetransmitTimeout;
+      }
+      responses_.push_back(
+          {due, std::move(header), swarm_.payload.substr(offset, size)});
+    }
+  }
+
+  std::unique_ptr<UtpStream> stream_;
+  const Swarm& swarm_;
+  const PeerProfile& profile_;
+  uint64_t seed_;
+  std::mt19937_64 rng_;
+  std::bernoulli_distribution lost_;
+  std::shared_ptr<RingBuffer> in_ = std::make_shared<RingBuffer>(1 << 20);
+  bool greeted_ = false;
+  bool closed_ = false;
+  std::deque<ResponseQueue::Response> responses_;
+  // Bytes of the front response already sent.
+  size_t sent_ = 0;
+  std::chrono::steady_clock::time_point next_send_;
+};
+
+// Serves every uTP connection to one seed on the calling thread.
+[[noreturn]] void serveUtpSeed(UtpSocket& socket, const Swarm& swarm,
+                               const PeerProfile& profile, uint64_t seed) {
+  std::vector<std::unique_ptr<UtpSeedSession>> sessions;
+  uint64_t connection = 0;
+  socket.setAcceptor([&](std::unique_ptr<UtpStream> stream) {
+    sessions.push_back(std::make_unique<UtpSeedSession>(
+        std::move(stream), swarm, profile, seed + connection++));
+  });
+  while (true) {
+    pollfd fd{socket.fd(), POLLIN, 0};
+    poll(&fd, 1, 1);
+    socket.onReadable();
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& session : sessions) {
+      session->pump(now);
+    }
+    std::erase_if(sessions, [](const auto& session) {
+      return session->closed();
+    });
+    socket.tick();
+  }
+}
+
+void serveTracker(int listen_fd, const std::string& body) {
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                         std::to_string(body.size()) +
+                         "\r\nConnection: close\r\n\r\n" + body;
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd == -1) {
+      continue;
+    }
+    std::string request;
+    char buffer[4096];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+      if (got <= 0) {
+        break;
+      }
+      request.append(buffer, got);
+    }
+    sendAll(fd, response.data(), response.size());
+    close(fd);
+  }
+}
+
+// Answers BEP 15 connect and announce requests with every seed. Connection
+// ids are checked, so a client that skips or botches the connect step gets
+// an error instead of peers.
+void serveUdpTracker(int fd, const std::string& compact_peers, uint64_t seed) {
+  constexpr uint64_t kProtocolId = 0x41727101980;
+  std::mt19937_64 rng(seed);
+  uint64_t connection_id = rng();
+  auto put32 = [](std::string& out, uint32_t value) {
+    value = htonl(value);
+    out.append(reinterpret_cast<char*>(&value), 4);
+  };
+  auto get32 = [](const unsigned char* in) {
+    uint32_t value;
+    std::memcpy(&value, in, 4);
+    return ntohl(value);
+  };
+  auto get64 = [&](const unsigned char* in) {
+    return uint64_t{get32(in)} << 32 | get32(in + 4);
+  };
+  unsigned char request[1500];
+  while (true) {
+    sockaddr_storage from{};
+    socklen_t from_len = sizeof(from);
+    ssize_t size = recvfrom(fd, request, sizeof(request), 0,
+                            reinterpret_cast<sockaddr*>(&from), &from_len);
+    if (size < 16) {
+      continue;
+    }
+    uint64_t id = get64(request);
+    uint32_t action = get32(request + 8);
+    std::string reply;
+    if (action == 0 && id == kProtocolId) {
+      put32(reply, 0);
+      reply.append(reinterpret_cast<char*>(request + 12), 4);
+      put32(reply, connection_id >> 32);
+      put32(reply, connection_id & 0xffffffff);
+    } else if (action == 1 && size >= 98 && id == connection_id) {
+      put32(reply, 1);
+      reply.append(reinterpret_cast<char*>(request + 12), 4);
+      put32(reply, 1800);
+      put32(reply, 0);
+      put32(reply, compact_peers.size() / 6);
+      reply += compact_peers;
+    } else {
+      put32(reply, 3);
+      reply.append(reinterpret_cast<char*>(request + 12), 4);
+      reply += "Unknown connection id";
+    }
+    sendto(fd, reply.data(), reply.size(), 0,
+           reinterpret_cast<sockaddr*>(&from), from_len);
+  }
+}
+
+[[noreturn]] void runServers(const Swarm& swarm, const SwarmConfig& config,
+                             int tracker_fd, const std::vector<int>& seed_fds,
+                             std::vector<std::unique_ptr<UtpSocket>>& utp,
+                             const std::string& compact_peers) {
+  for (size_t i = 0; i < seed_fds.size(); ++i) {
+    std::thread(serveUtpSeed, std::ref(*utp[i]), std::cref(swarm),
+                std::cref(config.peers[i]), config.seed * 1000003 + i * 1009)
+        .detach();
+    std::thread([&, i] {
+      uint64_t connection = 0;
+      while (true) {
+        int fd = accept(seed_fds[i], nullptr, nullptr);
+        if (fd == -1) {
+          continue;
+        }
+        uint64_t seed = config.seed * 1000003 + i * 1009 + connection++;
+        std::thread(serveSeed, fd, std::cref(swarm),
+                    std::cref(config.peers[i]), seed)
+            .detach();
+      }
+    }).detach();
+  }
+  if (config.udp_tracker) {
+    serveUdpTracker(tracker_fd, compact_peers, config.seed);
+  } else {
+    serveTracker(tracker_fd, bencodeTheString({{"interval", 1800},
+                                               {"peers", compact_peers}}));
+  }
+  _exit(0);
+}
+
+}  // namespace
+
+LocalSwarm::LocalSwarm(const SwarmConfig& config) {
+  if (config.peers.empty() || config.piece_length == 0 ||
+      config.payload_size == 0) {
+    throw std::runtime_error("Bench swarm needs peers and a payload");
+  }
+  char dir_template[] = "/tmp/bittorrent-bench-XXXXXX";
+  if (mkdtemp(dir_template) == nullptr) {
+    throw std::runtime_error("Cannot create bench directory");
+  }
+  directory_ = dir_template;
+  torrent_path_ = directory_ + "/bench.torrent";
+
+  payload_.resize(config.payload_size);
+  std::mt19937_64 rng(config.seed);
+  for (size_t i = 0; i < payload_.size(); i += 8) {
+    uint64_t word = rng();
+    std::memcpy(payload_.data() + i, &word,
+                std::min<size_t>(8, payload_.size() - i));
+  }
+  Swarm swarm{payload_, "", config.piece_length,
+              (payload_.size() + config.piece_length - 1) /
+                  config.piece_length};
+  std::string pieces;
+  for (size_t i = 0; i < payload_.size(); i += config.piece_length) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    size_t size = std::min(config.piece_length, payload_.size() - i);
+    SHA1(reinterpret_cast<const unsigned char*>(payload_.data() + i), size,
+         hash);
+    pieces.append(reinterpret_cast<char*>(hash), SHA_DIGEST_LENGTH);
+  }
+  json info = {{"length", payload_.size()},
+               {"name", "bench.bin"},
+               {"piece length", config.piece_length},
+               {"pieces", pieces},
+               {"private", 1}};
+  std::string encoded_info = bencodeTheString(info);
+  unsigned char info_hash[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const unsigned char*>(encoded_info.data()),
+       encoded_info.size(), info_hash);
+  swarm.info_hash.assign(reinterpret_cast<char*>(info_hash),
+                         SHA_DIGEST_LENGTH);
+
+  // Sockets are bound before forking so the ports are known up front. Each
+  // seed takes uTP connections on the UDP port of its TCP one.
+  int tracker_fd =
+      config.udp_tracker ? bindLoopbackUdp() : listenLoopback();
+  std::vector<int> seed_fds;
+  std::vector<std::unique_ptr<UtpSocket>> utp;
+  std::string compact_peers;
+  for (size_t i = 0; i < config.peers.size(); ++i) {
+    seed_fds.push_back(listenLoopback());
+    utp.push_back(std::make_unique<UtpSocket>(localPort(seed_fds.back())));
+    uint32_t ip = htonl(INADDR_LOOPBACK);
+    uint16_t port = htons(localPort(seed_fds.back()));
+    compact_peers.append(reinterpret_cast<char*>(&ip), 4);
+    compact_peers.append(reinterpret_cast<char*>(&port), 2);
+  }
+  std::string announce = (config.udp_tracker ? "udp" : "http") +
+                         std::string("://127.0.0.1:") +
+                         std::to_string(localPort(tracker_fd)) + "/announce";
+  std::ofstream torrent(torrent_path_, std::ios::out | std::ios::binary);
+  torrent << bencodeTheString({{"announce", announce}, {"info", info}});
+  torrent.close();
+
+  child_ = fork();
+  if (child_ == -1) {
+    throw std::runtime_error("Cannot fork bench servers");
+  }
+  if (child_ == 0) {
+    runServers(swarm, config, tracker_fd, seed_fds, utp, compact_peers);
+  }
+  close(tracker_fd);
+  for (int fd : seed_fds) {
+    close(fd);
+  }
+}
+
+LocalSwarm::~LocalSwarm() {
+  if (child_ > 0) {
+    kill(child_, SIGKILL);
+    waitpid(child_, nullptr, 0);
+  }
+  std::error_code ec;
+  std::filesystem::remove_all(directory_, ec);
+}
+
+bool LocalSwarm::verify(const std::string& path) const {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  std::istreambuf_iterator<char> it{in}, end;
+  return std::string(it, end) == payload_;
+}
+
+LocalDht::LocalDht(size_t nodes) {
+  DhtConfig config;
+  config.bind_address = "127.0.0.1";
+  config.port = 0;
+  config.bootstrap.clear();
+  for (size_t i = 0; i < nodes; ++i) {
+    nodes_.push_back(std::make_unique<Dht>(config));
+    if (i == 0) {
+      config.bootstrap = {"127.0.0.1:" + std::to_string(nodes_[0]->port())};
+    }
+  }
+}
+
+bool LocalDht::waitForRoutes(std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (std::any_of(nodes_.begin(), nodes_.end(),
+                     [](const auto& node) { return node->nodeCount() == 0; })) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return true;
+}
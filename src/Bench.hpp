@@ -0,0 +1,74 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Dht.hpp"
+
+// Network conditions one stand-in seed imposes on its uploads.
+struct PeerProfile {
+  // Added to every response, measured from when its request was read.
+  std::chrono::milliseconds latency{0};
+  // Upload rate cap in bytes per second; 0 means unlimited.
+  uint64_t bandwidth = 0;
+  // Probability that a response is "lost". TCP hides loss behind
+  // retransmission, so a lost response is delayed by one retransmission
+  // timeout instead of being dropped.
+  double loss = 0;
+};
+
+struct SwarmConfig {
+  size_t payload_size = 64 << 20;
+  size_t piece_length = 256 << 10;
+  std::vector<PeerProfile> peers;
+  uint64_t seed = 1;
+  // Announce to a UDP tracker (BEP 15) instead of an HTTP one.
+  bool udp_tracker = false;
+};
+
+// A loopback swarm for offline benchmarks: a tracker and one seed per
+// profile, all serving a synthetic payload described by a generated
+// .torrent file. The servers run in a forked child process so the CPU time
+// they use is not charged to the downloader being measured.
+class LocalSwarm {
+ public:
+  explicit LocalSwarm(const SwarmConfig& config);
+  LocalSwarm(const LocalSwarm&) = delete;
+  LocalSwarm& operator=(const LocalSwarm&) = delete;
+  ~LocalSwarm();
+
+  // Scratch directory holding the .torrent; removed on destruction.
+  const std::string& directory() const { return directory_; }
+  const std::string& torrentPath() const { return torrent_path_; }
+  size_t payloadSize() const { return payload_.size(); }
+  // True if the file at path holds exactly the synthetic payload.
+  bool verify(const std::string& path) const;
+
+ private:
+  std::string directory_;
+  std::string torrent_path_;
+  std::string payload_;
+  pid_t child_ = -1;
+};
+
+// A DHT of nodes on 127.0.0.1 that all bootstrap from the first one, for
+// checking lookups and announces without the public network. Nothing is
+// persisted.
+class LocalDht {
+ public:
+  explicit LocalDht(size_t nodes);
+
+  Dht& node(size_t index) { return *nodes_[index]; }
+  size_t size() const { return nodes_.size(); }
+  // Waits until every node has another in its routing table; false if that
+  // takes longer than timeout.
+  bool waitForRoutes(std::chrono::milliseconds timeout);
+
+ private:
+  std::vector<std::unique_ptr<Dht>> nodes_;
+};
@@ -0,0 +1,157 @@
+#include "Bencode.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+bool isEncodedNum(const std::string& encoded_value) {
+  if (encoded_value[0] != 'i') {
+    return false;
+  }
+  if (encoded_value[encoded_value.size() - 1] != 'e') {
+    return false;
+  }
+  return encoded_value.size() > 2;
+}
+
+bool isEncodedList(const std::string& encoded_value) {
+  return encoded_value[0] == 'l' &&
+         encoded_value[encoded_value.size() - 1] == 'e';
+}
+
+bool isEncodedDict(const std::string& encoded_value) {
+  return encoded_value[0] == 'd' &&
+         encoded_value[encoded_value.size() - 1] == 'e';
+}
+
+json decodeBencodedString(const std::string& encoded_value, uint& index) {
+  size_t colon_index = encoded_value.find(':', index);
+  if (colon_index != std::string::npos) {
+    std::string number_string =
+        encoded_value.substr(index, colon_index - index);
+    int64_t number = std::atoll(number_string.c_str());
+    std::string str = encoded_value.substr(colon_index + 1, number);
+    index = colon_index + str.size() + 1;
+    return json(str);
+  } else {
+    throw std::runtime_error("Invalid encoded value: " + encoded_value);
+  }
+}
+
+json decodeBencodedNum(const std::string& encoded_value, uint& index) {
+  uint last = encoded_value.find('e', index);
+  const std::string number_str =
+      encoded_value.substr(index + 1, last - index - 1);
+  index = last + 1;
+  const long long number = std::stoll(number_str);
+  return json(number);
+}
+
+json decodeBencodedList(const std::string& encoded_value, uint& index) {
+  json arr = json::array();
+  while (index < encoded_value.size() && encoded_value[index] != 'e') {
+    json ans;
+    if (encoded_value[index] == 'i') {
+      ans = decodeBencodedNum(encoded_value, index);
+    } else if (encoded_value[index] != 'l') {
+      ans = decodeBencodedString(encoded_value, index);
+    } else {
+      std::string encoded_substr = encoded_value.substr(index);
+      uint tmp_index = 1;
+      ans = decodeBencodedList(encoded_substr, tmp_index);
+      index += tmp_index;
+    }
+    arr.push_back(ans);
+  }
+  ++index;
+  return arr;
+}
+
+json decodeBencodedDict(const std::string& encoded_value, uint& index) {
+  json dict = json::object();
+  bool done = false;
+  json first_val;
+  json second_val;
+  while (index < encoded_value.size() && encoded_value[index] != 'e') {
+    if (encoded_value[index] == 'i') {
+      second_val = decodeBencodedNum(encoded_value, index);
+      dict[first_val] = second_val;
+      done = false;
+    } else if (encoded_value[index] == 'l') {
+      ++index;
+      second_val = decodeBencodedList(encoded_value, index);
+      json tmp = second_val;
+      auto got = tmp.dump();
+      dict[first_val] = second_val;
+      done = false;
+    } else if (encoded_value[index] == 'd') {
+      ++index;
+      second_val = decodeBencodedDict(encoded_value, index);
+      dict[first_val] = second_val;
+      done = false;
+    } else {
+      if (done) {
+        second_val = decodeBencodedString(encoded_value, index);
+        dict[first_val] = second_val;
+        done = false;
+      } else {
+        first_val = decodeBencodedString(encoded_value, index);
+        done = true;
+      }
+    }
+  }
+  ++index;
+  return dict;
+}
+
+json decodeBencodedValue(const std::string& encoded_value) {
+  uint index = 1;
+  if (std::isdigit(encoded_value[0])) {
+    --index;
+    return decodeBencodedString(encoded_value, index);
+  } else if (isEncodedNum(encoded_value)) {
+    index = 0;
+    return decodeBencodedNum(encoded_value, index);
+  } else if (isEncodedList(encoded_value)) {
+    return decodeBencodedList(encoded_value, index);
+  } else if (isEncodedDict(encoded_value)) {
+    return decodeBencodedDict(encoded_value, index);
+  } else {
+    throw std::runtime_error("Unhandled encoded value: " + encoded_value);
+  }
+}
+
+std::string bencodeTheString(const json& info) {
+  std::string ans;
+  if (info.is_object()) {
+    std::map<std::string, json> data = info;
+    ans += 'd';
+    for (auto& [key, value] : data) {
+      ans += bencodeTheString(key);
+      ans += bencodeTheString(value);
+    }
+    ans += 'e';
+  } else if (info.is_array()) {
+    std::vector<json> data = info;
+    ans += 'l';
+    for (auto& item : data) {
+      ans += bencodeTheString(item);
+    }
+    ans += 'e';
+  } else if (info.is_number()) {
+    long long data = info;
+    ans += 'i';
+    ans += std::to_string(data);
+    ans += 'e';
+  } else if (info.is_string()) {
+    std::string data = info;
+    ans += std::to_string(data.size());
+    ans += ':';
+    ans += data;
+  } else {
+    throw std::runtime_error("JSON type not handled");
+  }
+  return ans;
+}
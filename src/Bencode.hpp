@@ -0,0 +1,19 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "lib/nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+bool isEncodedNum(const std::string& encoded_value);
+bool isEncodedList(const std::string& encoded_value);
+bool isEncodedDict(const std::string& encoded_value);
+json decodeBencodedString(const std::string& encoded_value, uint& index);
+json decodeBencodedNum(const std::string& encoded_value, uint& index);
+json decodeBencodedList(const std::string& encoded_value, uint& index);
+json decodeBencodedDict(const std::string& encoded_value, uint& index);
+json decodeBencodedValue(const std::string& encoded_value);
+std::string bencodeTheString(const json& info);
@@ -0,0 +1,886 @@
+#include "Dht.hpp"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "Hex.hpp"
+
+namespace {
+
+constexpr size_t kAlpha = 3;
+constexpr size_t kCompactNodeSize = 26;
+constexpr size_t kCompactPeerSize = 6;
+constexpr size_t kMaxCandidates = 64;
+constexpr size_t kMaxValues = 50;
+constexpr size_t kMaxStoredPeers = 200;
+constexpr int kMaxFailures = 2;
+constexpr auto kQueryTimeout = std::chrono::seconds(2);
+constexpr auto kSecretLifetime = std::chrono::minutes(5);
+constexpr auto kPeerLifetime = std::chrono::minutes(30);
+constexpr auto kRefreshInterval = std::chrono::minutes(15);
+constexpr auto kMaintenanceInterval = std::chrono::milliseconds(500);
+
+std::string randomBytes(size_t size) {
+  static thread_local std::mt19937 engine{std::random_device{}()};
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::string bytes(size, '\0');
+  for (auto& c : bytes) {
+    c = static_cast<char>(byte(engine));
+  }
+  return bytes;
+}
+
+// True when a is closer to target than b by XOR distance. Unknown (empty)
+// ids sort after every known one.
+bool closer(const std::string& a, const std::string& b,
+            const std::string& target) {
+  if (a.size() != target.size() || b.size() != target.size()) {
+    return a.size() == target.size() && b.size() != target.size();
+  }
+  for (size_t i = 0; i < target.size(); ++i) {
+    auto da = static_cast<unsigned char>(a[i] ^ target[i]);
+    auto db = static_cast<unsigned char>(b[i] ^ target[i]);
+    if (da != db) {
+      return da < db;
+    }
+  }
+  return false;
+}
+
+bool sameAddress(const sockaddr_in& a, const sockaddr_in& b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+std::string compactAddress(const sockaddr_in& address) {
+  std::string compact(kCompactPeerSize, '\0');
+  std::memcpy(compact.data(), &address.sin_addr, 4);
+  std::memcpy(compact.data() + 4, &address.sin_port, 2);
+  return compact;
+}
+
+sockaddr_in decodeAddress(const char* compact) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  std::memcpy(&address.sin_addr, compact, 4);
+  std::memcpy(&address.sin_port, compact + 4, 2);
+  return address;
+}
+
+std::string unhex(const std::string& text) {
+  std::string bytes;
+  for (size_t i = 0; i + 1 < text.size(); i += 2) {
+    bytes += static_cast<char>(std::stoi(text.substr(i, 2), nullptr, 16));
+  }
+  return bytes;
+}
+
+std::string stringField(const json& dict, const char* key) {
+  auto it = dict.find(key);
+  if (it == dict.end() || !it->is_string()) {
+    return {};
+  }
+  return it->get<std::string>();
+}
+
+bool resolveIPv4(const std::string& host, uint16_t port, sockaddr_in& out) {
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* result = nullptr;
+  std::string service = std::to_string(port);
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0 ||
+      result == nullptr) {
+    return false;
+  }
+  std::memcpy(&out, result->ai_addr, sizeof(out));
+  freeaddrinfo(result);
+  return true;
+}
+
+}  // namespace
+
+Dht::Dht(DhtConfig config) : config_(std::move(config)) {
+  socket_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (socket_ == -1) {
+    throw std::runtime_error("Error creating DHT socket");
+  }
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  if (inet_pton(AF_INET, config_.bind_address.c_str(), &address.sin_addr) !=
+      1) {
+    close(socket_);
+    throw std::runtime_error("Invalid DHT bind address: " +
+                             config_.bind_address);
+  }
+  // Another client may already own the well-known port; any port works for
+  // outgoing lookups.
+  address.sin_port = htons(config_.port);
+  if (bind(socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+      0) {
+    address.sin_port = 0;
+    if (bind(socket_, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) != 0) {
+      close(socket_);
+      throw std::runtime_error("Error binding DHT socket");
+    }
+  }
+  socklen_t length = sizeof(address);
+  getsockname(socket_, reinterpret_cast<sockaddr*>(&address), &length);
+  port_ = ntohs(address.sin_port);
+  wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_ == -1) {
+    close(socket_);
+    throw std::runtime_error("Error creating DHT wakeup descriptor");
+  }
+
+  load();
+  if (id_.size() != 20) {
+    id_ = randomBytes(20);
+  }
+  secret_ = randomBytes(16);
+  previous_secret_ = secret_;
+  auto now = std::chrono::steady_clock::now();
+  next_secret_rotation_ = now + kSecretLifetime;
+  next_refresh_ = now + kRefreshInterval;
+  if (nodeCount() < kBucketSize) {
+    for (const auto& router : config_.bootstrap) {
+      size_t colon = router.rfind(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      pending_hosts_.emplace_back(
+          router.substr(0, colon),
+          static_cast<uint16_t>(std::atoi(router.c_str() + colon + 1)));
+    }
+  }
+  thread_ = std::thread(&Dht::run, this);
+}
+
+Dht::~Dht() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = write(wakeup_, &one, sizeof(one));
+  thread_.join();
+  save();
+  close(wakeup_);
+  close(socket_);
+}
+
+void Dht::getPeers(const std::string& info_hash, uint16_t announce_port) {
+  {
+    std::lock_guard lock(mutex_);
+    results_[info_hash].announce_port = announce_port;
+    startLookup(info_hash, true, announce_port, bootstrap_nodes_);
+  }
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = write(wakeup_, &one, sizeof(one));
+}
+
+std::vector<sockaddr_storage> Dht::takePeers(const std::string& info_hash) {
+  std::lock_guard lock(mutex_);
+  auto it = results_.find(info_hash);
+  if (it == results_.end()) {
+    return {};
+  }
+  return std::exchange(it->second.fresh, {});
+}
+
+bool Dht::searching(const std::string& info_hash) {
+  std::lock_guard lock(mutex_);
+  // Hosts still waiting to be resolved may seed the lookup once they are.
+  if (!pending_hosts_.empty() || resolving_) {
+    return true;
+  }
+  return std::any_of(lookups_.begin(), lookups_.end(), [&](const auto& entry) {
+    return entry.second.get_peers && entry.second.target == info_hash &&
+           !entry.second.candidates.empty();
+  });
+}
+
+void Dht::addNode(const std::string& host, uint16_t port) {
+  {
+    std::lock_guard lock(mutex_);
+    pending_hosts_.emplace_back(host, port);
+  }
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = write(wakeup_, &one, sizeof(one));
+}
+
+size_t Dht::nodeCount() {
+  std::lock_guard lock(mutex_);
+  size_t count = 0;
+  for (const auto& bucket : buckets_) {
+    count += bucket.size();
+  }
+  return count;
+}
+
+void Dht::run() {
+  while (true) {
+    {
+      std::lock_guard lock(mutex_);
+      if (stopping_) {
+        return;
+      }
+    }
+    resolvePendingHosts();
+    std::array<pollfd, 2> fds{pollfd{socket_, POLLIN, 0},
+                              pollfd{wakeup_, POLLIN, 0}};
+    int ready = poll(fds.data(), fds.size(),
+                     static_cast<int>(kMaintenanceInterval.count()));
+    if (ready < 0 && errno != EINTR) {
+      std::cerr << "Error polling DHT socket" << std::endl;
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      [[maybe_unused]] auto got = read(wakeup_, &value, sizeof(value));
+    }
+    std::lock_guard lock(mutex_);
+    if (fds[0].revents & POLLIN) {
+      receive();
+    }
+    expireQueries();
+    maintain();
+  }
+}
+
+void Dht::resolvePendingHosts() {
+  std::vector<std::pair<std::string, uint16_t>> hosts;
+  {
+    std::lock_guard lock(mutex_);
+    hosts.swap(pending_hosts_);
+    resolving_ = !hosts.empty();
+  }
+  if (hosts.empty()) {
+    return;
+  }
+  // Resolution can block on DNS, so it runs without holding the lock.
+  std::vector<sockaddr_in> resolved;
+  for (const auto& [host, port] : hosts) {
+    sockaddr_in address{};
+    if (resolveIPv4(host, port, address)) {
+      resolved.push_back(address);
+    }
+  }
+  std::lock_guard lock(mutex_);
+  resolving_ = false;
+  for (const auto& address : resolved) {
+    if (std::none_of(bootstrap_nodes_.begin(), bootstrap_nodes_.end(),
+                     [&](const auto& known) {
+                       return sameAddress(known, address);
+                     })) {
+      bootstrap_nodes_.push_back(address);
+    }
+  }
+  // Joining the network is a lookup for our own id. Searches that ran dry
+  // before the hosts resolved start over with them.
+  startLookup(id_, false, 0, resolved);
+  for (const auto& [info_hash, results] : results_) {
+    bool running = std::any_of(
+        lookups_.begin(), lookups_.end(), [&](const auto& entry) {
+          return entry.second.get_peers && entry.second.target == info_hash &&
+                 !entry.second.candidates.empty();
+        });
+    if (!running) {
+      startLookup(info_hash, true, results.announce_port, resolved);
+    }
+  }
+}
+
+void Dht::receive() {
+  std::array<char, 65536> buffer;
+  while (true) {
+    sockaddr_in from{};
+    socklen_t from_len = sizeof(from);
+    ssize_t size = recvfrom(socket_, buffer.data(), buffer.size(), 0,
+                            reinterpret_cast<sockaddr*>(&from), &from_len);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (size == 0 || from.sin_family != AF_INET) {
+      continue;
+    }
+    handlePacket(std::string(buffer.data(), size), from);
+  }
+}
+
+void Dht::handlePacket(const std::string& packet, const sockaddr_in& from) {
+  json message;
+  try {
+    if (!isEncodedDict(packet)) {
+      return;
+    }
+    message = decodeBencodedValue(packet);
+  } catch (const std::exception&) {
+    return;
+  }
+  if (!message.is_object()) {
+    return;
+  }
+  std::string type = stringField(message, "y");
+  std::string transaction = stringField(message, "t");
+  if (type == "q") {
+    auto args = message.find("a");
+    if (args == message.end() || !args->is_object()) {
+      return;
+    }
+    std::string sender_id = stringField(*args, "id");
+    if (sender_id.size() != 20) {
+      return;
+    }
+    handleQuery(stringField(message, "q"), transaction, sender_id, *args,
+                from);
+    return;
+  }
+  if (transaction.size() != 2) {
+    return;
+  }
+  uint16_t key = (static_cast<unsigned char>(transaction[0]) << 8) |
+                 static_cast<unsigned char>(transaction[1]);
+  auto it = queries_.find(key);
+  if (it == queries_.end() || !sameAddress(it->second.address, from)) {
+    return;
+  }
+  Query query = it->second;
+  queries_.erase(it);
+  auto body = message.find("r");
+  if (type == "r" && body != message.end() && body->is_object()) {
+    handleResponse(query, *body, from);
+    return;
+  }
+  // An error reply still ends the query; the node just could not help.
+  nodeFailed(from);
+  auto lookup = lookups_.find(query.lookup);
+  if (lookup != lookups_.end()) {
+    for (auto& candidate : lookup->second.candidates) {
+      if (sameAddress(candidate.address, from) &&
+          candidate.state == Candidate::State::kQueried) {
+        candidate.state = Candidate::State::kFailed;
+        --lookup->second.in_flight;
+      }
+    }
+    stepLookup(query.lookup);
+  }
+}
+
+void Dht::handleQuery(const std::string& method, const std::string& transaction,
+                      const std::string& sender_id, const json& args,
+                      const sockaddr_in& from) {
+  touchNode(sender_id, from);
+  json reply = json::object();
+  json body = json::object();
+  body["id"] = id_;
+  if (method == "ping") {
+  } else if (method == "find_node") {
+    std::string target = stringField(args, "target");
+    if (target.size() != 20) {
+      return;
+    }
+    body["nodes"] = compactNodes(target);
+  } else if (method == "get_peers") {
+    std::string info_hash = stringField(args, "info_hash");
+    if (info_hash.size() != 20) {
+      return;
+    }
+    body["token"] = makeToken(from, secret_);
+    auto stored = stored_peers_.find(info_hash);
+    if (stored != stored_peers_.end() && !stored->second.empty()) {
+      json values = json::array();
+      for (const auto& peer : stored->second) {
+        if (values.size() == kMaxValues) {
+          break;
+        }
+        values.push_back(peer.compact);
+      }
+      body["values"] = values;
+    } else {
+      body["nodes"] = compactNodes(info_hash);
+    }
+  } else if (method == "announce_peer") {
+    std::string info_hash = stringField(args, "info_hash");
+    if (info_hash.size() != 20 ||
+        !validToken(stringField(args, "token"), from)) {
+      reply["y"] = "e";
+      reply["e"] = json::array({203, "Bad token"});
+      reply["t"] = transaction;
+      send(bencodeTheString(reply), from);
+      return;
+    }
+    sockaddr_in peer = from;
+    auto implied = args.find("implied_port");
+    auto port = args.find("port");
+    bool use_source_port = implied != args.end() && implied->is_number() &&
+                           implied->get<long long>() != 0;
+    if (!use_source_port && port != args.end() && port->is_number()) {
+      peer.sin_port = htons(static_cast<uint16_t>(port->get<long long>()));
+    }
+    auto& peers = stored_peers_[info_hash];
+    std::string compact = compactAddress(peer);
+    std::erase_if(peers,
+                  [&](const auto& stored) { return stored.compact == compact; });
+    if (peers.size() < kMaxStoredPeers) {
+      peers.push_back({compact, std::chrono::steady_clock::now()});
+    }
+  } else {
+    reply["y"] = "e";
+    reply["e"] = json::array({204, "Method Unknown"});
+    reply["t"] = transaction;
+    send(bencodeTheString(reply), from);
+    return;
+  }
+  reply["y"] = "r";
+  reply["r"] = body;
+  reply["t"] = transaction;
+  send(bencodeTheString(reply), from);
+}
+
+void Dht::handleResponse(const Query& query, const json& body,
+                         const sockaddr_in& from) {
+  std::string node_id = stringField(body, "id");
+  if (node_id.size() != 20) {
+    return;
+  }
+  touchNode(node_id, from);
+  auto it = lookups_.find(query.lookup);
+  if (it == lookups_.end()) {
+    return;
+  }
+  Lookup& lookup = it->second;
+  if (query.method == "announce_peer") {
+    return;
+  }
+  for (auto& candidate : lookup.candidates) {
+    if (sameAddress(candidate.address, from) &&
+        candidate.state == Candidate::State::kQueried) {
+      candidate.id = node_id;
+      candidate.state = Candidate::State::kResponded;
+      candidate.token = stringField(body, "token");
+      --lookup.in_flight;
+      break;
+    }
+  }
+  std::string nodes = stringField(body, "nodes");
+  for (size_t offset = 0; offset + kCompactNodeSize <= nodes.size();
+       offset += kCompactNodeSize) {
+    std::string id = nodes.substr(offset, 20);
+    sockaddr_in address = decodeAddress(nodes.data() + offset + 20);
+    if (id == id_ || address.sin_port == 0) {
+      continue;
+    }
+    bool known = std::any_of(
+        lookup.candidates.begin(), lookup.candidates.end(),
+        [&](const auto& candidate) {
+          return candidate.id == id || sameAddress(candidate.address, address);
+        });
+    if (!known) {
+      Candidate candidate;
+      candidate.id = std::move(id);
+      candidate.address = address;
+      lookup.candidates.push_back(std::move(candidate));
+    }
+  }
+  auto values = body.find("values");
+  if (lookup.get_peers && values != body.end() && values->is_array()) {
+    auto& results = results_[lookup.target];
+    for (const auto& value : *values) {
+      if (!value.is_string()) {
+        continue;
+      }
+      const auto& compact = value.get_ref<const std::string&>();
+      if (compact.size() != kCompactPeerSize ||
+          !results.seen.insert(compact).second) {
+        continue;
+      }
+      sockaddr_in peer = decodeAddress(compact.data());
+      sockaddr_storage storage{};
+      std::memcpy(&storage, &peer, sizeof(peer));
+      results.fresh.push_back(storage);
+    }
+  }
+  stepLookup(query.lookup);
+}
+
+void Dht::expireQueries() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<int> touched;
+  for (auto it = queries_.begin(); it != queries_.end();) {
+    if (now - it->second.sent < kQueryTimeout) {
+      ++it;
+      continue;
+    }
+    const Query& query = it->second;
+    nodeFailed(query.address);
+    auto lookup = lookups_.find(query.lookup);
+    if (lookup != lookups_.end() && query.method != "announce_peer") {
+      for (auto& candidate : lookup->second.candidates) {
+        if (sameAddress(candidate.address, query.address) &&
+            candidate.state == Candidate::State::kQueried) {
+          candidate.state = Candidate::State::kFailed;
+          --lookup->second.in_flight;
+        }
+      }
+      touched.push_back(query.lookup);
+    }
+    it = queries_.erase(it);
+  }
+  for (int id : touched) {
+    stepLookup(id);
+  }
+}
+
+void Dht::maintain() {
+  auto now = std::chrono::steady_clock::now();
+  if (now >= next_secret_rotation_) {
+    previous_secret_ = std::exchange(secret_, randomBytes(16));
+    next_secret_rotation_ = now + kSecretLifetime;
+    for (auto it = stored_peers_.begin(); it != stored_peers_.end();) {
+      std::erase_if(it->second, [&](const auto& peer) {
+        return now - peer.added > kPeerLifetime;
+      });
+      it = it->second.empty() ? stored_peers_.erase(it) : std::next(it);
+    }
+  }
+  if (now >= next_refresh_) {
+    next_refresh_ = now + kRefreshInterval;
+    startLookup(id_, false, 0, {});
+  }
+  // A lookup that has sent its announces is kept until their replies are in
+  // so the responses are not mistaken for stray packets.
+  std::erase_if(lookups_, [&](const auto& entry) {
+    return entry.second.candidates.empty() &&
+           std::none_of(queries_.begin(), queries_.end(), [&](const auto& q) {
+             return q.second.lookup == entry.first;
+           });
+  });
+}
+
+int Dht::startLookup(const std::string& target, bool get_peers,
+                     uint16_t announce_port,
+                     const std::vector<sockaddr_in>& extra_seeds) {
+  int id = next_lookup_++;
+  Lookup& lookup = lookups_[id];
+  lookup.target = target;
+  lookup.get_peers = get_peers;
+  lookup.announce_port = announce_port;
+  for (const Node* node : closestNodes(target, kBucketSize * 2)) {
+    Candidate candidate;
+    candidate.id = node->id;
+    candidate.address = node->address;
+    lookup.candidates.push_back(std::move(candidate));
+  }
+  for (const auto& address : extra_seeds) {
+    if (std::none_of(lookup.candidates.begin(), lookup.candidates.end(),
+                     [&](const auto& candidate) {
+                       return sameAddress(candidate.address, address);
+                     })) {
+      Candidate candidate;
+      candidate.address = address;
+      lookup.candidates.push_back(std::move(candidate));
+    }
+  }
+  stepLookup(id);
+  return id;
+}
+
+void Dht::stepLookup(int id) {
+  auto it = lookups_.find(id);
+  if (it == lookups_.end()) {
+    return;
+  }
+  Lookup& lookup = it->second;
+  std::stable_sort(lookup.candidates.begin(), lookup.candidates.end(),
+                   [&](const auto& a, const auto& b) {
+                     return closer(a.id, b.id, lookup.target);
+                   });
+  // Candidates past the cut are dropped unless a query to them is still out:
+  // its reply or timeout has to find the candidate to release in_flight.
+  if (lookup.candidates.size() > kMaxCandidates) {
+    lookup.candidates.erase(
+        std::remove_if(lookup.candidates.begin() + kMaxCandidates,
+                       lookup.candidates.end(),
+                       [](const auto& candidate) {
+                         return candidate.state != Candidate::State::kQueried;
+                       }),
+        lookup.candidates.end());
+  }
+  // The lookup has converged once the k closest live candidates have all
+  // answered; until then keep alpha queries outstanding among them.
+  size_t considered = 0;
+  bool pending = false;
+  for (auto& candidate : lookup.candidates) {
+    if (considered == kBucketSize) {
+      break;
+    }
+    if (candidate.state == Candidate::State::kFailed) {
+      continue;
+    }
+    ++considered;
+    if (candidate.state == Candidate::State::kQueried) {
+      pending = true;
+    } else if (candidate.state == Candidate::State::kFresh) {
+      pending = true;
+      if (lookup.in_flight < kAlpha) {
+        json args = json::object();
+        args["id"] = id_;
+        if (lookup.get_peers) {
+          args["info_hash"] = lookup.target;
+        } else {
+          args["target"] = lookup.target;
+        }
+        candidate.state = Candidate::State::kQueried;
+        ++lookup.in_flight;
+        sendQuery(lookup.get_peers ? "get_peers" : "find_node",
+                  std::move(args), candidate.address, id);
+      }
+    }
+  }
+  if (!pending) {
+    finishLookup(id);
+  }
+}
+
+void Dht::finishLookup(int id) {
+  Lookup& lookup = lookups_.at(id);
+  if (lookup.get_peers && lookup.announce_port != 0) {
+    size_t announced = 0;
+    for (const auto& candidate : lookup.candidates) {
+      if (announced == kBucketSize) {
+        break;
+      }
+      if (candidate.state != Candidate::State::kResponded ||
+          candidate.token.empty()) {
+        continue;
+      }
+      json args = json::object();
+      args["id"] = id_;
+      args["info_hash"] = lookup.target;
+      args["port"] = lookup.announce_port;
+      args["token"] = candidate.token;
+      sendQuery("announce_peer", std::move(args), candidate.address, id);
+      ++announced;
+    }
+    lookup.announce_port = 0;
+    lookup.candidates.clear();
+    return;
+  }
+  lookups_.erase(id);
+}
+
+void Dht::sendQuery(const std::string& method, json args,
+                    const sockaddr_in& to, int lookup) {
+  uint16_t key = next_transaction_++;
+  while (queries_.count(key)) {
+    key = next_transaction_++;
+  }
+  std::string transaction{static_cast<char>(key >> 8),
+                          static_cast<char>(key & 0xff)};
+  json message = json::object();
+  message["t"] = transaction;
+  message["y"] = "q";
+  message["q"] = method;
+  message["a"] = std::move(args);
+  queries_[key] = {method, to, lookup, std::chrono::steady_clock::now()};
+  send(bencodeTheString(message), to);
+}
+
+void Dht::send(const std::string& packet, const sockaddr_in& to) {
+  // A failed send is treated like a lost datagram and expires as a timeout.
+  sendto(socket_, packet.data(), packet.size(), 0,
+         reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+}
+
+void Dht::touchNode(const std::string& id, const sockaddr_in& address) {
+  if (id == id_) {
+    return;
+  }
+  auto& bucket = buckets_[bucketIndex(id)];
+  auto now = std::chrono::steady_clock::now();
+  auto it = std::find_if(bucket.begin(), bucket.end(),
+                         [&](const auto& node) { return node.id == id; });
+  if (it != bucket.end()) {
+    it->address = address;
+    it->last_seen = now;
+    it->failures = 0;
+    return;
+  }
+  Node node{id, address, now, 0};
+  if (bucket.size() < kBucketSize) {
+    bucket.push_back(std::move(node));
+    return;
+  }
+  // Full buckets only give up nodes that stopped answering.
+  auto bad = std::find_if(bucket.begin(), bucket.end(), [](const auto& n) {
+    return n.failures >= kMaxFailures;
+  });
+  if (bad != bucket.end()) {
+    *bad = std::move(node);
+  }
+}
+
+void Dht::nodeFailed(const sockaddr_in& address) {
+  for (auto& bucket : buckets_) {
+    for (auto& node : bucket) {
+      if (sameAddress(node.address, address)) {
+        ++node.failures;
+        return;
+      }
+    }
+  }
+}
+
+std::vector<const Dht::Node*> Dht::closestNodes(const std::string& target,
+                                                size_t count) const {
+  std::vector<const Node*> nodes;
+  for (const auto& bucket : buckets_) {
+    for (const auto& node : bucket) {
+      if (node.failures < kMaxFailures) {
+        nodes.push_back(&node);
+      }
+    }
+  }
+  count = std::min(count, nodes.size());
+  std::partial_sort(nodes.begin(), nodes.begin() + count, nodes.end(),
+                    [&](const Node* a, const Node* b) {
+                      return closer(a->id, b->id, target);
+                    });
+  nodes.resize(count);
+  return nodes;
+}
+
+std::string Dht::compactNodes(const std::string& target) const {
+  std::string compact;
+  for (const Node* node : closestNodes(target, kBucketSize)) {
+    compact += node->id;
+    compact += compactAddress(node->address);
+  }
+  return compact;
+}
+
+size_t Dht::bucketIndex(const std::string& id) const {
+  for (size_t i = 0; i < id_.size(); ++i) {
+    auto diff = static_cast<unsigned char>(id[i] ^ id_[i]);
+    if (diff != 0) {
+      return i * 8 + __builtin_clz(diff) - 24;
+    }
+  }
+  return kIdBits - 1;
+}
+
+std::string Dht::makeToken(const sockaddr_in& address,
+                           const std::string& secret) const {
+  std::string data = secret;
+  data.append(reinterpret_cast<const char*>(&address.sin_addr), 4);
+  std::string token(SHA_DIGEST_LENGTH, '\0');
+  SHA1(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+       reinterpret_cast<unsigned char*>(token.data()));
+  token.resize(8);
+  return token;
+}
+
+bool Dht::validToken(const std::string& token,
+                     const sockaddr_in& address) const {
+  return token == makeToken(address, secret_) ||
+         token == makeToken(address, previous_secret_);
+}
+
+void Dht::load() {
+  if (config_.state_path.empty()) {
+    return;
+  }
+  std::ifstream in(config_.state_path);
+  std::string line;
+  if (!in || !std::getline(in, line)) {
+    return;
+  }
+  try {
+    id_ = unhex(line);
+    auto now = std::chrono::steady_clock::now();
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string endpoint;
+      std::string node_id;
+      if (!(fields >> endpoint >> node_id)) {
+        continue;
+      }
+      size_t colon = endpoint.rfind(':');
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      if (colon == std::string::npos ||
+          inet_pton(AF_INET, endpoint.substr(0, colon).c_str(),
+                    &address.sin_addr) != 1) {
+        continue;
+      }
+      address.sin_port = htons(std::stoi(endpoint.substr(colon + 1)));
+      node_id = unhex(node_id);
+      if (id_.size() != 20 || node_id.size() != 20 || node_id == id_) {
+        continue;
+      }
+      auto& bucket = buckets_[bucketIndex(node_id)];
+      if (bucket.size() < kBucketSize) {
+        bucket.push_back({node_id, address, now, 0});
+      }
+    }
+  } catch (const std::exception&) {
+    // A damaged state file just means bootstrapping from the routers.
+  }
+}
+
+void Dht::save() {
+  if (config_.state_path.empty()) {
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::path path = config_.state_path;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  std::string tmp = config_.state_path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!out) {
+      return;
+    }
+    out << toHex(id_) << '\n';
+    for (const auto& bucket : buckets_) {
+      for (const auto& node : bucket) {
+        if (node.failures != 0) {
+          continue;
+        }
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &node.address.sin_addr, ip, sizeof(ip));
+        out << ip << ':' << ntohs(node.address.sin_port) << ' '
+            << toHex(node.id) << '\n';
+      }
+    }
+    // A short write (say a full disk) must not replace the last good state.
+    out.flush();
+    if (!out.good()) {
+      std::cerr << "Error writing DHT state " << tmp << std::endl;
+      out.close();
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+  }
+  std::rename(tmp.c_str(), config_.state_path.c_str());
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bencode.hpp"
+
+struct DhtConfig {
+  std::string bind_address = "0.0.0.0";
+  uint16_t port = 6881;
+  // The node id and routing table are loaded from and saved to this file so
+  // a restart can skip bootstrapping. Empty disables persistence.
+  std::string state_path;
+  // host:port of routers used to join the network when no saved node is
+  // known.
+  std::vector<std::string> bootstrap = {"router.bittorrent.com:6881",
+                                        "dht.transmissionbt.com:6881",
+                                        "router.utorrent.com:6881"};
+};
+
+// Mainline DHT node (BEP 5). It keeps a Kademlia routing table of 160
+// buckets of up to 8 nodes, answers ping/find_node/get_peers/announce_peer
+// with rotating tokens, and runs iterative get_peers lookups with up to
+// three queries in flight. All network work happens on an internal thread;
+// the public methods are safe to call from any thread.
+class Dht {
+ public:
+  explicit Dht(DhtConfig config);
+  Dht(const Dht&) = delete;
+  Dht& operator=(const Dht&) = delete;
+  ~Dht();
+
+  // Starts a lookup for peers of info_hash. Found peers are queued for
+  // takePeers(). With a non-zero announce_port the closest nodes are told
+  // we serve the torrent on that port once the lookup converges.
+  void getPeers(const std::string& info_hash, uint16_t announce_port = 0);
+  // Peers found for info_hash since the last call, each reported once.
+  std::vector<sockaddr_storage> takePeers(const std::string& info_hash);
+  bool searching(const std::string& info_hash);
+  // Adds a node hint (e.g. from a torrent's "nodes" key); resolved and
+  // pinged on the DHT thread.
+  void addNode(const std::string& host, uint16_t port);
+  size_t nodeCount();
+  uint16_t port() const { return port_; }
+
+ private:
+  static constexpr size_t kBucketSize = 8;
+  static constexpr size_t kIdBits = 160;
+
+  struct Node {
+    std::string id;
+    sockaddr_in address{};
+    std::chrono::steady_clock::time_point last_seen;
+    int failures = 0;
+  };
+
+  struct Candidate {
+    enum class State { kFresh, kQueried, kResponded, kFailed };
+    std::string id;
+    sockaddr_in address{};
+    State state = State::kFresh;
+    std::string token;
+  };
+
+  struct Lookup {
+    std::string target;
+    bool get_peers = false;
+    uint16_t announce_port = 0;
+    std::vector<Candidate> candidates;
+    size_t in_flight = 0;
+  };
+
+  struct Query {
+    std::string method;
+    sockaddr_in address{};
+    int lookup = -1;
+    std::chrono::steady_clock::time_point sent;
+  };
+
+  struct StoredPeer {
+    std::string compact;
+    std::chrono::steady_clock::time_point added;
+  };
+
+  struct Results {
+    uint16_t announce_port = 0;
+    std::set<std::string> seen;
+    std::vector<sockaddr_storage> fresh;
+  };
+
+  void run();
+  void receive();
+  void handlePacket(const std::string& packet, const sockaddr_in& from);
+  void handleQuery(const std::string& method, const std::string& transaction,
+                   const std::string& sender_id, const json& args,
+                   const sockaddr_in& from);
+  void handleResponse(const Query& query, const json& body,
+                      const sockaddr_in& from);
+  void expireQueries();
+  void maintain();
+  void resolvePendingHosts();
+
+  int startLookup(const std::string& target, bool get_peers,
+                  uint16_t announce_port,
+                  const std::vector<sockaddr_in>& extra_seeds);
+  void stepLookup(int id);
+  void finishLookup(int id);
+  void sendQuery(const std::string& method, json args, const sockaddr_in& to,
+                 int lookup);
+  void send(const std::string& packet, const sockaddr_in& to);
+
+  void touchNode(const std::string& id, const sockaddr_in& address);
+  void nodeFailed(const sockaddr_in& address);
+  std::vector<const Node*> closestNodes(const std::string& target,
+                                        size_t count) const;
+  std::string compactNodes(const std::string& target) const;
+  size_t bucketIndex(const std::string& id) const;
+  std::string makeToken(const sockaddr_in& address,
+                        const std::string& secret) const;
+  bool validToken(const std::string& token, const sockaddr_in& address) const;
+
+  void load();
+  void save();
+
+  DhtConfig config_;
+  int socket_ = -1;
+  int wakeup_ = -1;
+  uint16_t port_ = 0;
+  std::string id_;
+  std::string secret_;
+  std::string previous_secret_;
+  std::array<std::vector<Node>, kIdBits> buckets_;
+  std::map<uint16_t, Query> queries_;
+  uint16_t next_transaction_ = 0;
+  std::map<int, Lookup> lookups_;
+  int next_lookup_ = 0;
+  std::map<std::string, Results> results_;
+  std::map<std::string, std::vector<StoredPeer>> stored_peers_;
+  std::vector<std::pair<std::string, uint16_t>> pending_hosts_;
+  bool resolving_ = false;
+  std::vector<sockaddr_in> bootstrap_nodes_;
+  std::chrono::steady_clock::time_point next_secret_rotation_;
+  std::chrono::steady_clock::time_point next_refresh_;
+  std::mutex mutex_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
@@ -0,0 +1,22 @@
+#include "Hex.hpp"
+
+#include <cstring>
+
+char* hexEncode(const unsigned char* data, size_t size, char* out) {
+  for (size_t i = 0; i < size; ++i) {
+    std::memcpy(out, kHexTable[data[i]].data(), 2);
+    out += 2;
+  }
+  return out;
+}
+
+std::string toHex(const unsigned char* data, size_t size) {
+  std::string ans(size * 2, '\0');
+  hexEncode(data, size, ans.data());
+  return ans;
+}
+
+std::string toHex(std::string_view bytes) {
+  return toHex(reinterpret_cast<const unsigned char*>(bytes.data()),
+               bytes.size());
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// The two lowercase hex digits of every byte value, so encoding is one
+// table lookup and a two-byte copy per byte.
+inline constexpr std::array<std::array<char, 2>, 256> kHexTable = [] {
+  constexpr char digits[] = "0123456789abcdef";
+  std::array<std::array<char, 2>, 256> table{};
+  for (size_t i = 0; i < table.size(); ++i) {
+    table[i] = {digits[i >> 4], digits[i & 15]};
+  }
+  return table;
+}();
+
+// Writes the 2 * size hex digits of data to out and returns the end.
+char* hexEncode(const unsigned char* data, size_t size, char* out);
+std::string toHex(const unsigned char* data, size_t size);
+std::string toHex(std::string_view bytes);
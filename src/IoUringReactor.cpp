@@ -0,0 +1,430 @@
+#include "Reactor.hpp"
+
+#if __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+constexpr unsigned kRingEntries = 256;
+
+// Submission and completion queues shared with the kernel, set up with the
+// raw syscalls (the part of liburing this needs).
+class Ring {
+ public:
+  // Throws if io_uring is unavailable or lacks what the reactor relies on.
+  Ring() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    fd_ = syscall(__NR_io_uring_setup, kRingEntries, &params);
+    if (fd_ == -1 && errno == EINVAL) {
+      // Older kernels reject flags they do not know; both are only hints.
+      params = {};
+      fd_ = syscall(__NR_io_uring_setup, kRingEntries, &params);
+    }
+    if (fd_ == -1) {
+      throw std::runtime_error("io_uring_setup failed");
+    }
+    constexpr unsigned kRequired =
+        IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & kRequired) != kRequired) {
+      close(fd_);
+      throw std::runtime_error("io_uring is too old");
+    }
+    ring_size_ = std::max<size_t>(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+      if (ring_ != MAP_FAILED) {
+        munmap(ring_, ring_size_);
+      }
+      close(fd_);
+      throw std::runtime_error("Error mapping io_uring queues");
+    }
+    auto* base = static_cast<char*>(ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    local_tail_ = *sq_tail_;
+  }
+
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  ~Ring() {
+    munmap(sqes_, sqes_size_);
+    munmap(ring_, ring_size_);
+    close(fd_);
+  }
+
+  // A zeroed submission entry, submitted with the next enter(). Submits
+  // early if the queue is full.
+  io_uring_sqe* next() {
+    if (local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >=
+        sq_entries_) {
+      enter(0, nullptr);
+    }
+    unsigned index = local_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++local_tail_;
+    return sqe;
+  }
+
+  // Submits the queued entries and, if timeout is set, waits up to that
+  // long for at least one completion.
+  void enter(unsigned wait, const __kernel_timespec* timeout) {
+    __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+    unsigned pending =
+        local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(timeout);
+    int result = syscall(__NR_io_uring_enter, fd_, pending, wait,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg));
+    if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY &&
+        errno != EAGAIN) {
+      throw std::runtime_error("io_uring_enter failed");
+    }
+  }
+
+  bool hasCompletion() const {
+    return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  }
+
+  // Takes the oldest completion; only valid if hasCompletion().
+  io_uring_cqe take() {
+    unsigned head = *cq_head_;
+    io_uring_cqe cqe = cqes_[head & cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return cqe;
+  }
+
+ private:
+  int fd_ = -1;
+  void* ring_ = nullptr;
+  size_t ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_entries_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  // Entries filled in but not yet published to the kernel.
+  unsigned local_tail_ = 0;
+};
+
+// Completion-based engine: each socket always has a receive into the free
+// space of its buffer in flight, writability and the readability of
+// watch()ed descriptors are one-shot polls and output file writes are
+// plain io_uring writes. Everything a round submits and
+// every completion it reaps share one io_uring_enter.
+class IoUringReactor : public Reactor {
+ public:
+  ~IoUringReactor() override {
+    // The kernel may still write into receive buffers and read from write
+    // buffers, so wait until every operation has completed.
+    for (auto& [fd, watch] : watches_) {
+      watch->handler = nullptr;
+      cancel(*watch);
+      retired_.push_back(std::move(watch));
+    }
+    watches_.clear();
+    __kernel_timespec timeout{1, 0};
+    try {
+      while (busy()) {
+        ring_.enter(1, &timeout);
+        reap();
+        std::erase_if(retired_, [](const auto& w) { return !w->inFlight(); });
+      }
+    } catch (const std::exception&) {
+      // Closing the ring cancels whatever is left.
+    }
+  }
+
+  void add(int fd, std::shared_ptr<RingBuffer> in, Handler* handler) override {
+    auto watch = std::make_unique<Watch>();
+    watch->fd = fd;
+    watch->in = std::move(in);
+    watch->handler = handler;
+    watch->receive.watch = watch.get();
+    watch->writable.watch = watch.get();
+    watch->readable.watch = watch.get();
+    armReceive(*watch);
+    watches_[fd] = std::move(watch);
+  }
+
+  void watch(int fd, Handler* handler) override {
+    auto watch = std::make_unique<Watch>();
+    watch->fd = fd;
+    watch->handler = handler;
+    watch->readable.watch = watch.get();
+    armReadable(*watch);
+    watches_[fd] = std::move(watch);
+  }
+
+  void remove(int fd) override {
+    auto it = watches_.find(fd);
+    if (it == watches_.end()) {
+      return;
+    }
+    it->second->handler = nullptr;
+    cancel(*it->second);
+    retired_.push_back(std::move(it->second));
+    watches_.erase(it);
+  }
+
+  void wantWrite(int fd) override {
+    auto it = watches_.find(fd);
+    if (it == watches_.end() || it->second->polling) {
+      return;
+    }
+    Watch& watch = *it->second;
+    io_uring_sqe* sqe = ring_.next();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = reinterpret_cast<uint64_t>(&watch.writable);
+    watch.polling = true;
+  }
+
+  void write(int fd, std::vector<unsigned char> data,
+             uint64_t offset) override {
+    auto op = std::make_unique<WriteOp>();
+    op->fd = fd;
+    op->data = std::move(data);
+    op->offset = offset;
+    submitWrite(*op);
+    WriteOp* key = op.get();
+    writes_[key] = std::move(op);
+  }
+
+  size_t pendingWrites() const override { return writes_.size(); }
+
+  int poll(std::chrono::milliseconds timeout) override {
+    if (ring_.hasCompletion()) {
+      ring_.enter(0, nullptr);
+    } else {
+      __kernel_timespec ts{};
+      ts.tv_sec = timeout.count() / 1000;
+      ts.tv_nsec = timeout.count() % 1000 * 1000000;
+      ring_.enter(1, &ts);
+    }
+    int handled = reap();
+    std::erase_if(retired_, [](const auto& w) { return !w->inFlight(); });
+    return handled;
+  }
+
+ private:
+  struct Watch;
+
+  struct Operation {
+    enum class Kind { kReceive, kWritable, kReadable, kWrite };
+    explicit Operation(Kind k) : kind(k) {}
+    Kind kind;
+    Watch* watch = nullptr;
+  };
+
+  struct Watch {
+    int fd = -1;
+    std::shared_ptr<RingBuffer> in;
+    Handler* handler = nullptr;
+    Operation receive{Operation::Kind::kReceive};
+    Operation writable{Operation::Kind::kWritable};
+    Operation readable{Operation::Kind::kReadable};
+    bool receiving = false;
+    bool polling = false;
+    bool reading = false;
+    bool inFlight() const { return receiving || polling || reading; }
+  };
+
+  struct WriteOp : Operation {
+    WriteOp() : Operation(Kind::kWrite) {}
+    int fd = -1;
+    std::vector<unsigned char> data;
+    size_t written = 0;
+    uint64_t offset = 0;
+  };
+
+  bool busy() const {
+    if (!writes_.empty()) {
+      return true;
+    }
+    for (const auto& watch : retired_) {
+      if (watch->inFlight()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void armReceive(Watch& watch) {
+    if (watch.in->space() == 0) {
+      watch.handler->onReceived(-ENOBUFS);
+      return;
+    }
+    io_uring_sqe* sqe = ring_.next();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = watch.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(watch.in->freeSpace());
+    sqe->len = watch.in->space();
+    sqe->user_data = reinterpret_cast<uint64_t>(&watch.receive);
+    watch.receiving = true;
+  }
+
+  void armReadable(Watch& watch) {
+    io_uring_sqe* sqe = ring_.next();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watch.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = reinterpret_cast<uint64_t>(&watch.readable);
+    watch.reading = true;
+  }
+
+  void submitWrite(WriteOp& op) {
+    io_uring_sqe* sqe = ring_.next();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = op.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(op.data.data() + op.written);
+    sqe->len = op.data.size() - op.written;
+    sqe->off = op.offset + op.written;
+    sqe->user_data = reinterpret_cast<uint64_t>(&op);
+  }
+
+  // Cancellations complete with user_data 0 and are not looked at.
+  void cancel(Watch& watch) {
+    std::pair<Operation*, bool> ops[] = {{&watch.receive, watch.receiving},
+                                         {&watch.writable, watch.polling},
+                                         {&watch.readable, watch.reading}};
+    for (auto [op, in_flight] : ops) {
+      if (in_flight) {
+        io_uring_sqe* sqe = ring_.next();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<uint64_t>(op);
+      }
+    }
+  }
+
+  int reap() {
+    int handled = 0;
+    while (ring_.hasCompletion()) {
+      io_uring_cqe cqe = ring_.take();
+      if (cqe.user_data != 0) {
+        complete(*reinterpret_cast<Operation*>(cqe.user_data), cqe.res);
+        ++handled;
+      }
+    }
+    return handled;
+  }
+
+  void complete(Operation& op, int result) {
+    if (op.kind == Operation::Kind::kWrite) {
+      completeWrite(static_cast<WriteOp&>(op), result);
+      return;
+    }
+    Watch& watch = *op.watch;
+    if (op.kind == Operation::Kind::kWritable) {
+      watch.polling = false;
+      if (watch.handler != nullptr) {
+        watch.handler->onWritable();
+      }
+      return;
+    }
+    if (op.kind == Operation::Kind::kReadable) {
+      watch.reading = false;
+      if (watch.handler != nullptr) {
+        watch.handler->onReadable();
+      }
+      // The handler may have removed the watch.
+      if (watch.handler != nullptr) {
+        armReadable(watch);
+      }
+      return;
+    }
+    watch.receiving = false;
+    if (watch.handler == nullptr) {
+      return;
+    }
+    if (result == -EINTR || result == -EAGAIN) {
+      armReceive(watch);
+      return;
+    }
+    if (result > 0) {
+      watch.in->produce(result);
+    }
+    watch.handler->onReceived(result);
+    if (result > 0 && watch.handler != nullptr) {
+      armReceive(watch);
+    }
+  }
+
+  void completeWrite(WriteOp& op, int result) {
+    if (result == -EINTR || result == -EAGAIN) {
+      submitWrite(op);
+      return;
+    }
+    if (result <= 0) {
+      writes_.erase(&op);
+      throw std::runtime_error("Error writing output file");
+    }
+    op.written += result;
+    if (op.written < op.data.size()) {
+      submitWrite(op);
+      return;
+    }
+    writes_.erase(&op);
+  }
+
+  Ring ring_;
+  std::unordered_map<int, std::unique_ptr<Watch>> watches_;
+  // Removed watches whose operations the kernel has not finished yet.
+  std::vector<std::unique_ptr<Watch>> retired_;
+  std::unordered_map<WriteOp*, std::unique_ptr<WriteOp>> writes_;
+};
+
+}  // namespace
+
+std::unique_ptr<Reactor> makeIoUringReactor() {
+  try {
+    return std::make_unique<IoUringReactor>();
+  } catch (const std::runtime_error&) {
+    return nullptr;
+  }
+}
+
+#else
+
+std::unique_ptr<Reactor> makeIoUringReactor() { return nullptr; }
+
+#endif
@@ -0,0 +1,159 @@
+#include "LocalDiscovery.hpp"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "Hex.hpp"
+
+namespace {
+
+std::string lower(std::string text) {
+  std::transform(text.begin(), text.end(), text.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return text;
+}
+
+std::string trim(const std::string& text) {
+  size_t begin = text.find_first_not_of(" \t");
+  size_t end = text.find_last_not_of(" \t\r");
+  if (begin == std::string::npos) {
+    return {};
+  }
+  return text.substr(begin, end - begin + 1);
+}
+
+}  // namespace
+
+LocalDiscovery::LocalDiscovery(std::string info_hash, LsdConfig config)
+    : config_(std::move(config)), info_hash_hex_(toHex(info_hash)) {
+  group_.sin_family = AF_INET;
+  group_.sin_port = htons(config_.port);
+  in_addr interface{};
+  if (inet_pton(AF_INET, config_.group.c_str(), &group_.sin_addr) != 1 ||
+      inet_pton(AF_INET, config_.interface.c_str(), &interface) != 1) {
+    throw std::runtime_error("Invalid LSD address");
+  }
+  socket_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (socket_ == -1) {
+    throw std::runtime_error("Error creating LSD socket");
+  }
+  // Every client on the host listens on the same well-known port.
+  int on = 1;
+  setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(socket_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = group_.sin_port;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  ip_mreq membership{};
+  membership.imr_multiaddr = group_.sin_addr;
+  membership.imr_interface = interface;
+  if (bind(socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+          0 ||
+      setsockopt(socket_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) != 0) {
+    close(socket_);
+    throw std::runtime_error("Error joining LSD multicast group");
+  }
+  setsockopt(socket_, IPPROTO_IP, IP_MULTICAST_IF, &interface,
+             sizeof(interface));
+  setsockopt(socket_, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on));
+  std::random_device rd;
+  cookie_ = std::to_string(rd()) + std::to_string(rd());
+  next_announce_ = std::chrono::steady_clock::now();
+}
+
+LocalDiscovery::~LocalDiscovery() { close(socket_); }
+
+std::vector<sockaddr_storage> LocalDiscovery::poll() {
+  if (config_.announce_port != 0 &&
+      std::chrono::steady_clock::now() >= next_announce_) {
+    announce();
+  }
+  std::vector<sockaddr_storage> peers;
+  std::array<char, 1500> buffer;
+  while (true) {
+    sockaddr_in from{};
+    socklen_t from_len = sizeof(from);
+    ssize_t size = recvfrom(socket_, buffer.data(), buffer.size(), 0,
+                            reinterpret_cast<sockaddr*>(&from), &from_len);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    handleMessage(std::string(buffer.data(), size), from, peers);
+  }
+  return peers;
+}
+
+bool LocalDiscovery::discovered(const sockaddr_storage& peer) const {
+  if (peer.ss_family != AF_INET) {
+    return false;
+  }
+  const auto& addr4 = reinterpret_cast<const sockaddr_in&>(peer);
+  return heard_.contains({addr4.sin_addr.s_addr, addr4.sin_port});
+}
+
+void LocalDiscovery::announce() {
+  std::string message = "BT-SEARCH * HTTP/1.1\r\nHost: " + config_.group +
+                        ':' + std::to_string(config_.port) +
+                        "\r\nPort: " + std::to_string(config_.announce_port) +
+                        "\r\nInfohash: " + info_hash_hex_ +
+                        "\r\ncookie: " + cookie_ + "\r\n\r\n\r\n";
+  // A failed send is retried with the next announce.
+  sendto(socket_, message.data(), message.size(), 0,
+         reinterpret_cast<const sockaddr*>(&group_), sizeof(group_));
+  next_announce_ = std::chrono::steady_clock::now() + config_.interval;
+}
+
+void LocalDiscovery::handleMessage(const std::string& message,
+                                   const sockaddr_in& from,
+                                   std::vector<sockaddr_storage>& peers) {
+  std::istringstream lines(message);
+  std::string line;
+  if (!std::getline(lines, line) ||
+      trim(line) != "BT-SEARCH * HTTP/1.1") {
+    return;
+  }
+  int port = 0;
+  bool wanted = false;
+  while (std::getline(lines, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = lower(trim(line.substr(0, colon)));
+    std::string value = trim(line.substr(colon + 1));
+    // Multicast loops back, so our own announces come back to us.
+    if (name == "cookie" && value == cookie_) {
+      return;
+    }
+    if (name == "port") {
+      port = std::atoi(value.c_str());
+    } else if (name == "infohash" && lower(value) == info_hash_hex_) {
+      wanted = true;
+    }
+  }
+  if (!wanted || port <= 0 || port > 65535) {
+    return;
+  }
+  sockaddr_storage peer{};
+  auto& addr4 = reinterpret_cast<sockaddr_in&>(peer);
+  addr4.sin_family = AF_INET;
+  addr4.sin_addr = from.sin_addr;
+  addr4.sin_port = htons(port);
+  if (heard_.insert({addr4.sin_addr.s_addr, addr4.sin_port}).second) {
+    peers.push_back(peer);
+  }
+}
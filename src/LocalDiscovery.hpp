@@ -0,0 +1,55 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct LsdConfig {
+  std::string group = "239.192.152.143";
+  uint16_t port = 6771;
+  // Address of the interface to announce and listen on; 0.0.0.0 lets the
+  // kernel pick one (127.0.0.1 keeps the traffic on loopback).
+  std::string interface = "0.0.0.0";
+  // Port announced to the group every interval; 0 only listens. Downloads
+  // accept no incoming connections, so they leave it at 0.
+  uint16_t announce_port = 0;
+  std::chrono::seconds interval{300};
+};
+
+// Local Service Discovery (BEP 14) for one torrent: collects the peers
+// announcing the same info hash to the LAN multicast group and, given an
+// announce port, announces it there too. Non-blocking; poll() is meant to
+// be called from the discovery loop.
+class LocalDiscovery {
+ public:
+  explicit LocalDiscovery(std::string info_hash, LsdConfig config = {});
+  LocalDiscovery(const LocalDiscovery&) = delete;
+  LocalDiscovery& operator=(const LocalDiscovery&) = delete;
+  ~LocalDiscovery();
+
+  // Announces when the interval has passed and returns the peers heard
+  // since the last call.
+  std::vector<sockaddr_storage> poll();
+  // Whether peer was heard announcing on the LAN.
+  bool discovered(const sockaddr_storage& peer) const;
+
+ private:
+  void announce();
+  void handleMessage(const std::string& message, const sockaddr_in& from,
+                     std::vector<sockaddr_storage>& peers);
+
+  LsdConfig config_;
+  std::string info_hash_hex_;
+  std::string cookie_;
+  sockaddr_in group_{};
+  int socket_ = -1;
+  // Address and port (network order) of every peer heard so far.
+  std::set<std::pair<uint32_t, uint16_t>> heard_;
+  std::chrono::steady_clock::time_point next_announce_;
+};
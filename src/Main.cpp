@@ -1,758 +1,3177 @@
 #include <arpa/inet.h>
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
-#include <future>
+#include <functional>
 #include <iostream>
 #include <map>
-#include <queue>
-#include <span>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "Bench.hpp"
+#include "Bencode.hpp"
+#include "Dht.hpp"
+#include "Hex.hpp"
+#include "LocalDiscovery.hpp"
+#include "PieceSet.hpp"
+#include "RateLimit.hpp"
+#include "Reactor.hpp"
+#include "RingBuffer.hpp"
+#include "SendQueue.hpp"
+#include "Session.hpp"
+#include "Transport.hpp"
+#include "UdpTracker.hpp"
+#include "Utp.hpp"
 #include "lib/nlohmann/json.hpp"
 
 using json = nlohmann::json;
 
-unsigned int getNum(unsigned char c) {
-  unsigned int ans;
-  std::stringstream ss;
-  ss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(c);
-  ss >> ans;
-  return ans;
+// Accumulates output in one contiguous buffer and hands it to write(2) in a
+// single call on flush, so large listings cost no per-line stream overhead.
+class OutputBuffer {
+ public:
+  explicit OutputBuffer(int fd) : fd_(fd) {}
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+  ~OutputBuffer() { flush(); }
+
+  void reserve(size_t size) { buffer_.reserve(buffer_.size() + size); }
+
+  void append(std::string_view data) { buffer_.append(data); }
+
+  void append(char c) { buffer_.push_back(c); }
+
+  void appendNumber(long long num) {
+    std::array<char, 24> tmp{};
+    auto [end, ec] = std::to_chars(tmp.data(), tmp.data() + tmp.size(), num);
+    buffer_.append(tmp.data(), end);
+  }
+
+  void appendHex(const unsigned char* data, size_t size) {
+    size_t old_size = buffer_.size();
+    buffer_.resize(old_size + size * 2);
+    hexEncode(data, size, buffer_.data() + old_size);
+  }
+
+  void appendJsonString(std::string_view data) {
+    buffer_.push_back('"');
+    for (unsigned char c : data) {
+      if (c == '"' || c == '\\') {
+        buffer_.push_back('\\');
+        buffer_.push_back(static_cast<char>(c));
+      } else if (c < 0x20) {
+        buffer_.append("\\u00");
+        buffer_.append(kHexTable[c].data(), 2);
+      } else {
+        buffer_.push_back(static_cast<char>(c));
+      }
+    }
+    buffer_.push_back('"');
+  }
+
+  bool flush() {
+    size_t done = 0;
+    while (done < buffer_.size()) {
+      ssize_t written =
+          write(fd_, buffer_.data() + done, buffer_.size() - done);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        buffer_.clear();
+        return false;
+      }
+      done += written;
+    }
+    buffer_.clear();
+    return true;
+  }
+
+ private:
+  int fd_;
+  std::string buffer_;
+};
+
+void stringToSHA1(const std::string& data,
+                  std::array<unsigned char, SHA_DIGEST_LENGTH>& hash) {
+  SHA1(reinterpret_cast<const unsigned char*>(data.c_str()), data.size(),
+       hash.data());
+}
+
+void writeInfo(const std::string& buffer, OutputBuffer& out, bool as_json) {
+  std::array<unsigned char, SHA_DIGEST_LENGTH> info_hash{};
+  auto torrent = decodeBencodedValue(buffer);
+  const std::string& announce =
+      torrent["announce"].get_ref<const std::string&>();
+  const auto& info = torrent["info"];
+  auto length = info["length"].template get<long long>();
+  auto piece_length = info["piece length"].template get<long long>();
+  stringToSHA1(bencodeTheString(info), info_hash);
+  const auto& pieces_string = info["pieces"].get_ref<const std::string&>();
+  if (pieces_string.size() % SHA_DIGEST_LENGTH != 0) {
+    throw std::runtime_error("Wrong pieces length: " +
+                             std::to_string(pieces_string.size()));
+  }
+  const auto* pieces =
+      reinterpret_cast<const unsigned char*>(pieces_string.data());
+  size_t piece_num = pieces_string.size() / SHA_DIGEST_LENGTH;
+  // Each hash is 40 hex digits plus a separator (newline, or quotes and comma).
+  out.reserve(announce.size() + 256 + piece_num * (SHA_DIGEST_LENGTH * 2 + 4));
+  if (as_json) {
+    out.append("{\"announce\":");
+    out.appendJsonString(announce);
+    out.append(",\"length\":");
+    out.appendNumber(length);
+    out.append(",\"info_hash\":\"");
+    out.appendHex(info_hash.data(), info_hash.size());
+    out.append("\",\"piece_length\":");
+    out.appendNumber(piece_length);
+    out.append(",\"piece_hashes\":[");
+    for (size_t i = 0; i < piece_num; ++i) {
+      out.append(i == 0 ? "\"" : ",\"");
+      out.appendHex(pieces + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+      out.append('"');
+    }
+    out.append("]}\n");
+    return;
+  }
+  out.append("Tracker URL: ");
+  out.append(announce);
+  out.append("\nLength: ");
+  out.appendNumber(length);
+  out.append("\nInfo Hash: ");
+  out.appendHex(info_hash.data(), info_hash.size());
+  out.append("\nPiece Length: ");
+  out.appendNumber(piece_length);
+  out.append("\nPieces Hashes:\n");
+  for (size_t i = 0; i < piece_num; ++i) {
+    out.appendHex(pieces + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+    out.append('\n');
+  }
+}
+
+std::string readTorrentFile(const std::string& filename) {
+  std::fstream fs;
+  fs.open(filename, std::ios::in | std::ios::binary);
+  if (!fs.is_open()) {
+    throw std::runtime_error("Cannot open file: " + filename);
+  }
+  std::istreambuf_iterator<char> it{fs}, end;
+  return {it, end};
+}
+
+json openTorrentFile(const std::string& filename) {
+  return decodeBencodedValue(readTorrentFile(filename));
+}
+
+constexpr size_t kCompactPeerSize = 6;
+constexpr size_t kCompactPeer6Size = 18;
+
+// Decodes one compact peer entry (BEP 23 for IPv4, BEP 7 for IPv6): the
+// address in network order followed by a big-endian port.
+sockaddr_storage decodeCompactPeer(const unsigned char* data, int family) {
+  sockaddr_storage address{};
+  if (family == AF_INET) {
+    auto& addr4 = reinterpret_cast<sockaddr_in&>(address);
+    addr4.sin_family = AF_INET;
+    std::memcpy(&addr4.sin_addr, data, 4);
+    std::memcpy(&addr4.sin_port, data + 4, 2);
+  } else {
+    auto& addr6 = reinterpret_cast<sockaddr_in6&>(address);
+    addr6.sin6_family = AF_INET6;
+    std::memcpy(&addr6.sin6_addr, data, 16);
+    std::memcpy(&addr6.sin6_port, data + 16, 2);
+  }
+  return address;
+}
+
+// Inverse of decodeCompactPeer: 6 bytes for IPv4, 18 for IPv6.
+std::string encodeCompactPeer(const sockaddr_storage& address) {
+  std::string compact;
+  if (address.ss_family == AF_INET) {
+    const auto& addr4 = reinterpret_cast<const sockaddr_in&>(address);
+    compact.append(reinterpret_cast<const char*>(&addr4.sin_addr), 4);
+    compact.append(reinterpret_cast<const char*>(&addr4.sin_port), 2);
+  } else {
+    const auto& addr6 = reinterpret_cast<const sockaddr_in6&>(address);
+    compact.append(reinterpret_cast<const char*>(&addr6.sin6_addr), 16);
+    compact.append(reinterpret_cast<const char*>(&addr6.sin6_port), 2);
+  }
+  return compact;
+}
+
+socklen_t peerAddressLength(const sockaddr_storage& address) {
+  return address.ss_family == AF_INET ? sizeof(sockaddr_in)
+                                      : sizeof(sockaddr_in6);
+}
+
+// Raw address and port bytes of a peer, used to hash and compare it.
+std::string_view peerAddressBytes(const sockaddr_storage& address) {
+  if (address.ss_family == AF_INET) {
+    const auto& addr4 = reinterpret_cast<const sockaddr_in&>(address);
+    return {reinterpret_cast<const char*>(&addr4.sin_port),
+            sizeof(addr4.sin_port) + sizeof(addr4.sin_addr)};
+  }
+  const auto& addr6 = reinterpret_cast<const sockaddr_in6&>(address);
+  return {reinterpret_cast<const char*>(&addr6.sin6_port),
+          sizeof(addr6.sin6_port) + sizeof(addr6.sin6_flowinfo) +
+              sizeof(addr6.sin6_addr)};
+}
+
+struct PeerAddressHash {
+  size_t operator()(const sockaddr_storage& address) const {
+    return std::hash<std::string_view>()(peerAddressBytes(address));
+  }
+};
+
+struct PeerAddressEqual {
+  bool operator()(const sockaddr_storage& a, const sockaddr_storage& b) const {
+    return a.ss_family == b.ss_family &&
+           peerAddressBytes(a) == peerAddressBytes(b);
+  }
+};
+
+using PeerAddressSet =
+    std::unordered_set<sockaddr_storage, PeerAddressHash, PeerAddressEqual>;
+
+std::string formatPeer(const sockaddr_storage& address) {
+  std::array<char, INET6_ADDRSTRLEN> ip{};
+  if (address.ss_family == AF_INET) {
+    const auto& addr4 = reinterpret_cast<const sockaddr_in&>(address);
+    inet_ntop(AF_INET, &addr4.sin_addr, ip.data(), ip.size());
+    return std::string(ip.data()) + ':' + std::to_string(ntohs(addr4.sin_port));
+  }
+  const auto& addr6 = reinterpret_cast<const sockaddr_in6&>(address);
+  inet_ntop(AF_INET6, &addr6.sin6_addr, ip.data(), ip.size());
+  return '[' + std::string(ip.data()) + "]:" +
+         std::to_string(ntohs(addr6.sin6_port));
+}
+
+// Whether a peer is on our own network (loopback, private or link-local
+// ranges); such peers are usually far faster than ones across the internet.
+bool isLanPeer(const sockaddr_storage& address) {
+  if (address.ss_family == AF_INET) {
+    uint32_t ip =
+        ntohl(reinterpret_cast<const sockaddr_in&>(address).sin_addr.s_addr);
+    return (ip >> 24) == 127 || (ip >> 24) == 10 ||
+           (ip >> 20) == ((172 << 4) | 1) || (ip >> 16) == ((192 << 8) | 168) ||
+           (ip >> 16) == ((169 << 8) | 254);
+  }
+  const auto& addr6 = reinterpret_cast<const sockaddr_in6&>(address).sin6_addr;
+  return IN6_IS_ADDR_LOOPBACK(&addr6) || IN6_IS_ADDR_LINKLOCAL(&addr6) ||
+         (addr6.s6_addr[0] & 0xfe) == 0xfc;
+}
+
+// Parses "ip:port" or "[ipv6]:port" as given on the command line.
+bool parsePeer(const std::string& peer, sockaddr_storage& address) {
+  size_t delim = peer.rfind(':');
+  if (delim == std::string::npos) {
+    return false;
+  }
+  std::string host = peer.substr(0, delim);
+  int port = std::atoi(peer.c_str() + delim + 1);
+  if (port <= 0 || port > 65535) {
+    return false;
+  }
+  address = {};
+  if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+    auto& addr6 = reinterpret_cast<sockaddr_in6&>(address);
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = htons(port);
+    return inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(),
+                     &addr6.sin6_addr) == 1;
+  }
+  auto& addr4 = reinterpret_cast<sockaddr_in&>(address);
+  addr4.sin_family = AF_INET;
+  addr4.sin_port = htons(port);
+  return inet_pton(AF_INET, host.c_str(), &addr4.sin_addr) == 1;
+}
+
+const std::string kPeerId = "00112233445566778899";
+// Port we tell trackers and the LAN to reach us on.
+constexpr uint16_t kListenPort = 6881;
+
+// Process-wide curl share object. Every tracker handle attaches to it, so the
+// DNS cache, TLS sessions and pooled connections outlive individual requests.
+CURLSH* curlShare() {
+  static std::array<std::mutex, CURL_LOCK_DATA_LAST> locks;
+  static CURLSH* share = [] {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    CURLSH* sh = curl_share_init();
+    auto lock_callback = +[](CURL*, curl_lock_data data, curl_lock_access,
+                             void*) { locks[data].lock(); };
+    auto unlock_callback =
+        +[](CURL*, curl_lock_data data, void*) { locks[data].unlock(); };
+    curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, lock_callback);
+    curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    return sh;
+  }();
+  return share;
+}
+
+// Incremental scanner for an HTTP announce body. It is fed the response as it
+// grows and reports each compact "peers"/"peers6" entry as soon as its bytes
+// have arrived, without waiting for the rest of the body.
+class AnnounceStreamParser {
+ public:
+  using PeerCallback = std::function<void(const unsigned char*, int)>;
+
+  void reset() { *this = AnnounceStreamParser(); }
+
+  void feed(std::string_view data, const PeerCallback& on_peer) {
+    while (!done_) {
+      if (peer_family_ != 0) {
+        size_t entry_size =
+            peer_family_ == AF_INET ? kCompactPeerSize : kCompactPeer6Size;
+        const auto* bytes = reinterpret_cast<const unsigned char*>(data.data());
+        while (pos_ + entry_size <= std::min(peer_end_, data.size())) {
+          on_peer(bytes + pos_, peer_family_);
+          pos_ += entry_size;
+        }
+        if (pos_ + entry_size <= peer_end_) {
+          return;
+        }
+        pos_ = peer_end_;
+        peer_family_ = 0;
+        valueDone();
+        continue;
+      }
+      if (pos_ >= data.size()) {
+        return;
+      }
+      char c = data[pos_];
+      if (c == 'd' || c == 'l') {
+        stack_.push_back({c == 'd', true});
+        ++pos_;
+      } else if (c == 'e' && !stack_.empty()) {
+        stack_.pop_back();
+        ++pos_;
+        done_ = stack_.empty();
+        valueDone();
+      } else if (c == 'i') {
+        size_t end = data.find('e', pos_);
+        if (end == std::string_view::npos) {
+          return;
+        }
+        pos_ = end + 1;
+        valueDone();
+      } else if (std::isdigit(static_cast<unsigned char>(c))) {
+        size_t colon = data.find(':', pos_);
+        if (colon == std::string_view::npos) {
+          return;
+        }
+        size_t length = 0;
+        std::from_chars(data.data() + pos_, data.data() + colon, length);
+        size_t start = colon + 1;
+        if (!stack_.empty() && stack_.back().dict &&
+            stack_.back().expecting_key) {
+          if (start + length > data.size()) {
+            return;
+          }
+          key_ = data.substr(start, length);
+          stack_.back().expecting_key = false;
+          pos_ = start + length;
+        } else if (stack_.size() == 1 &&
+                   (key_ == "peers" || key_ == "peers6")) {
+          peer_family_ = key_ == "peers" ? AF_INET : AF_INET6;
+          pos_ = start;
+          peer_end_ = start + length;
+        } else {
+          // Skipped strings may end past the data received so far.
+          pos_ = start + length;
+          valueDone();
+        }
+      } else {
+        done_ = true;
+      }
+    }
+  }
+
+ private:
+  struct Frame {
+    bool dict;
+    bool expecting_key;
+  };
+
+  void valueDone() {
+    if (!stack_.empty() && stack_.back().dict) {
+      stack_.back().expecting_key = true;
+    }
+  }
+
+  size_t pos_ = 0;
+  size_t peer_end_ = 0;
+  int peer_family_ = 0;
+  bool done_ = false;
+  std::string key_;
+  std::vector<Frame> stack_;
+};
+
+// Long-lived announce client for one torrent. Every tracker from
+// announce-list (BEP 12), across all tiers, is announced to concurrently:
+// HTTP trackers through one curl multi handle with a persistent easy handle
+// each, UDP trackers through one shared UdpTracker socket. Peers are merged
+// and deduplicated as responses arrive, and every tracker is re-announced on
+// its own interval with the current transfer counters.
+class TrackerClient {
+ public:
+  explicit TrackerClient(const json& torrent) {
+    const auto& info = torrent["info"];
+    std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
+    stringToSHA1(bencodeTheString(info), hash);
+    info_hash_.assign(hash.begin(), hash.end());
+    left_ = info["length"].template get<size_t>();
+    multi_ = curl_multi_init();
+    if (!multi_) {
+      throw std::runtime_error("Failed to initialize cURL");
+    }
+    std::unordered_set<std::string> urls;
+    auto add_tracker = [&](const std::string& url, size_t tier) {
+      if (!urls.insert(url).second) {
+        return;
+      }
+      auto tracker = std::make_unique<Tracker>();
+      tracker->owner = this;
+      tracker->url = url;
+      tracker->tier = tier;
+      if (url.starts_with("udp://")) {
+        if (!udp_) {
+          udp_ = std::make_unique<UdpTracker>(kUdpTimeout, kUdpRetries);
+        }
+      } else {
+        tracker->curl = createEasyHandle(*tracker);
+      }
+      trackers_.push_back(std::move(tracker));
+    };
+    if (torrent.contains("announce-list")) {
+      const auto& tiers = torrent["announce-list"];
+      for (size_t tier = 0; tier < tiers.size(); ++tier) {
+        for (const auto& url : tiers[tier]) {
+          add_tracker(url.get<std::string>(), tier);
+        }
+      }
+    }
+    if (trackers_.empty() && torrent.contains("announce")) {
+      add_tracker(torrent["announce"].get<std::string>(), 0);
+    }
+  }
+
+  TrackerClient(const TrackerClient&) = delete;
+  TrackerClient& operator=(const TrackerClient&) = delete;
+
+  ~TrackerClient() {
+    try {
+      if (joined_) {
+        stop();
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Tracker stop failed: " << e.what() << std::endl;
+    }
+    for (auto& tracker : trackers_) {
+      if (tracker->curl) {
+        if (tracker->in_flight) {
+          curl_multi_remove_handle(multi_, tracker->curl);
+        }
+        curl_easy_cleanup(tracker->curl);
+      }
+    }
+    curl_multi_cleanup(multi_);
+  }
+
+  // Announces to every tracker with the given event ("started", "completed",
+  // "stopped" or empty for a regular update), waits for all of them and
+  // returns the peers that were not seen before.
+  std::vector<sockaddr_storage> announce(const std::string& event = "") {
+    startAnnounce(event);
+    std::vector<sockaddr_storage> peers;
+    while (busy()) {
+      auto fresh = poll(kRequestTimeout);
+      peers.insert(peers.end(), fresh.begin(), fresh.end());
+    }
+    return peers;
+  }
+
+  // Starts announces without waiting for them. Regular updates only go to
+  // trackers whose interval has elapsed; completed and stopped replace any
+  // request still in flight.
+  void startAnnounce(const std::string& event = "") {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& tracker : trackers_) {
+      std::string tracker_event = event;
+      if (event == "completed" || event == "stopped") {
+        if (!tracker->started) {
+          continue;
+        }
+        cancel(*tracker);
+      } else if (tracker->in_flight) {
+        continue;
+      } else if (event.empty() && now < tracker->next_announce) {
+        continue;
+      }
+      if (tracker_event.empty() && !tracker->started) {
+        tracker_event = "started";
+      } else if (tracker_event == "started" && tracker->started) {
+        tracker_event.clear();
+      }
+      start(*tracker, tracker_event);
+    }
+  }
+
+  // Drives in-flight announces for at most timeout and returns as soon as
+  // peers that were not seen before arrive, possibly while the response
+  // carrying them is still being received.
+  std::vector<sockaddr_storage> poll(std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      int running = 0;
+      curl_multi_perform(multi_, &running);
+      int queued = 0;
+      while (CURLMsg* msg = curl_multi_info_read(multi_, &queued)) {
+        if (msg->msg != CURLMSG_DONE) {
+          continue;
+        }
+        Tracker* tracker = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &tracker);
+        CURLcode status = msg->data.result;
+        curl_multi_remove_handle(multi_, tracker->curl);
+        tracker->in_flight = false;
+        if (status != CURLE_OK) {
+          std::cerr << tracker->url << ": " << curl_easy_strerror(status)
+                    << std::endl;
+          finish(*tracker, false);
+        } else {
+          finish(*tracker, parseHttpResponse(*tracker));
+        }
+      }
+      if (udp_) {
+        udp_->onReadable();
+        udp_->onTimeout();
+        for (auto& response : udp_->takeFinished()) {
+          handleUdpResponse(response);
+        }
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (!fresh_peers_.empty() || !busy() || now >= deadline) {
+        return std::exchange(fresh_peers_, {});
+      }
+      auto wait = std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+      std::vector<curl_waitfd> extra_fds;
+      if (udp_ && !udp_->idle()) {
+        wait = std::min(wait, udp_->nextTimeout());
+        extra_fds.push_back({udp_->fd(), CURL_WAIT_POLLIN, 0});
+      }
+      curl_multi_poll(multi_, extra_fds.data(),
+                      static_cast<unsigned int>(extra_fds.size()),
+                      static_cast<int>(wait.count()), nullptr);
+    }
+  }
+
+  const std::string& infoHash() const { return info_hash_; }
+
+  bool busy() const {
+    return std::any_of(trackers_.begin(), trackers_.end(),
+                       [](const auto& tracker) { return tracker->in_flight; });
+  }
+
+  // True once some idle tracker's interval has elapsed since its last
+  // announce.
+  bool announceDue() const {
+    auto now = std::chrono::steady_clock::now();
+    return std::any_of(trackers_.begin(), trackers_.end(), [&](const auto& t) {
+      return !t->in_flight && now >= t->next_announce;
+    });
+  }
+
+  // Lets outstanding announces (e.g. completed) finish, then tells every
+  // tracker we are leaving.
+  void stop() {
+    auto deadline = std::chrono::steady_clock::now() + kStopTimeout;
+    auto drain = [&] {
+      while (busy() && std::chrono::steady_clock::now() < deadline) {
+        poll(std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()));
+      }
+    };
+    drain();
+    startAnnounce("stopped");
+    drain();
+  }
+
+  // Marks this as a session that downloads or seeds, so the trackers are
+  // told "stopped" when it ends. A one-off peer listing never joins.
+  void join() { joined_ = true; }
+
+  void addUploaded(size_t bytes) { uploaded_ += bytes; }
+
+  void addDownloaded(size_t bytes) { downloaded_ += bytes; }
+
+  void pieceVerified(size_t bytes) {
+    left_ -= std::min(left_, bytes);
+    if (left_ == 0 && !completed_) {
+      completed_ = true;
+      startAnnounce("completed");
+    }
+  }
+
+ private:
+  struct Tracker {
+    TrackerClient* owner = nullptr;
+    std::string url;
+    size_t tier = 0;
+    CURL* curl = nullptr;
+    uint64_t udp_id = 0;
+    std::string response;
+    AnnounceStreamParser stream;
+    std::string event;
+    std::string tracker_id;
+    bool in_flight = false;
+    bool started = false;
+    std::chrono::steady_clock::time_point next_announce;
+  };
+
+  static constexpr size_t kPort = kListenPort;
+  static constexpr std::chrono::seconds kDefaultInterval{1800};
+  static constexpr std::chrono::seconds kRetryInterval{60};
+  static constexpr std::chrono::seconds kRequestTimeout{30};
+  static constexpr std::chrono::seconds kStopTimeout{5};
+  // BEP 15 suggests 15s * 2^n; a shorter schedule keeps a dead tracker from
+  // stalling startup for minutes.
+  static constexpr std::chrono::seconds kUdpTimeout{2};
+  static constexpr int kUdpRetries = 4;
+
+  CURL* createEasyHandle(Tracker& tracker) {
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+      throw std::runtime_error("Failed to initialize cURL");
+    }
+    // Peers are picked out of the body while it is still downloading.
+    auto write_callback =
+        +[](char* contents, size_t size, size_t nmemb, void* userp) -> size_t {
+      auto* tracker = static_cast<Tracker*>(userp);
+      tracker->response.append(contents, size * nmemb);
+      tracker->stream.feed(tracker->response,
+                           [&](const unsigned char* entry, int family) {
+                             tracker->owner->addPeer(entry, family);
+                           });
+      return size * nmemb;
+    };
+    curl_easy_setopt(curl, CURLOPT_SHARE, curlShare());
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &tracker);
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT,
+                     static_cast<long>(kRequestTimeout.count()));
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &tracker);
+    return curl;
+  }
+
+  void start(Tracker& tracker, const std::string& event) {
+    tracker.event = event;
+    tracker.in_flight = true;
+    if (tracker.curl) {
+      tracker.response.clear();
+      tracker.stream.reset();
+      std::string url = buildUrl(tracker, event);
+      curl_easy_setopt(tracker.curl, CURLOPT_URL, url.c_str());
+      curl_multi_add_handle(multi_, tracker.curl);
+      return;
+    }
+    UdpAnnounceRequest request;
+    request.url = tracker.url;
+    request.info_hash = info_hash_;
+    request.peer_id = kPeerId;
+    request.downloaded = downloaded_;
+    request.left = left_;
+    request.uploaded = uploaded_;
+    request.event = event;
+    request.port = kPort;
+    tracker.udp_id = udp_->submit(request);
+  }
+
+  void cancel(Tracker& tracker) {
+    if (!tracker.in_flight) {
+      return;
+    }
+    if (tracker.curl) {
+      curl_multi_remove_handle(multi_, tracker.curl);
+    } else {
+      udp_->cancel(tracker.udp_id);
+    }
+    tracker.in_flight = false;
+  }
+
+  void finish(Tracker& tracker, bool ok) {
+    if (!ok) {
+      tracker.next_announce = std::chrono::steady_clock::now() + kRetryInterval;
+      return;
+    }
+    if (tracker.event == "started") {
+      tracker.started = true;
+    } else if (tracker.event == "stopped") {
+      tracker.started = false;
+    }
+  }
+
+  void addPeer(const unsigned char* entry, int family) {
+    auto peer = decodeCompactPeer(entry, family);
+    if (known_peers_.insert(peer).second) {
+      fresh_peers_.push_back(peer);
+    }
+  }
+
+  void addPeers(std::string_view compact, int family) {
+    size_t entry_size =
+        family == AF_INET ? kCompactPeerSize : kCompactPeer6Size;
+    const auto* data = reinterpret_cast<const unsigned char*>(compact.data());
+    for (size_t i = 0; i + entry_size <= compact.size(); i += entry_size) {
+      addPeer(data + i, family);
+    }
+  }
+
+  void handleUdpResponse(const UdpAnnounceResponse& response) {
+    for (auto& tracker : trackers_) {
+      if (tracker->curl || !tracker->in_flight ||
+          tracker->udp_id != response.id) {
+        continue;
+      }
+      tracker->in_flight = false;
+      if (!response.ok) {
+        std::cerr << tracker->url << ": " << response.error << std::endl;
+        finish(*tracker, false);
+        return;
+      }
+      auto interval = response.interval > 0
+                          ? std::chrono::seconds(response.interval)
+                          : kDefaultInterval;
+      tracker->next_announce = std::chrono::steady_clock::now() + interval;
+      addPeers(response.peers, AF_INET);
+      addPeers(response.peers6, AF_INET6);
+      finish(*tracker, true);
+      return;
+    }
+  }
+
+  std::string buildUrl(const Tracker& tracker, const std::string& event) {
+    char* encoded_info_hash = curl_easy_escape(tracker.curl, info_hash_.data(),
+                                               info_hash_.size());
+    std::string url = tracker.url;
+    url += url.find('?') == std::string::npos ? '?' : '&';
+    url += "info_hash=";
+    url += encoded_info_hash;
+    curl_free(encoded_info_hash);
+    url += "&peer_id=";
+    url += kPeerId;
+    url += "&port=";
+    url += std::to_string(kPort);
+    url += "&uploaded=";
+    url += std::to_string(uploaded_);
+    url += "&downloaded=";
+    url += std::to_string(downloaded_);
+    url += "&left=";
+    url += std::to_string(left_);
+    url += "&compact=1";
+    if (!event.empty()) {
+      url += "&event=";
+      url += event;
+    }
+    if (!tracker.tracker_id.empty()) {
+      char* encoded_id =
+          curl_easy_escape(tracker.curl, tracker.tracker_id.data(),
+                           static_cast<int>(tracker.tracker_id.size()));
+      url += "&trackerid=";
+      url += encoded_id;
+      curl_free(encoded_id);
+    }
+    return url;
+  }
+
+  // Peers were already taken from the body while it streamed in; this only
+  // handles the announce metadata.
+  bool parseHttpResponse(Tracker& tracker) {
+    json data;
+    try {
+      data = decodeBencodedValue(tracker.response);
+    } catch (const std::exception& e) {
+      std::cerr << tracker.url << ": invalid response" << std::endl;
+      return false;
+    }
+    if (data.contains("failure reason")) {
+      std::cerr << tracker.url << ": "
+                << data["failure reason"].get<std::string>() << std::endl;
+      return false;
+    }
+    if (data.contains("warning message")) {
+      std::cerr << tracker.url << ": "
+                << data["warning message"].get<std::string>() << std::endl;
+    }
+    auto interval = kDefaultInterval;
+    if (data.contains("interval")) {
+      interval = std::chrono::seconds(data["interval"].get<long long>());
+    }
+    if (data.contains("min interval")) {
+      auto min_interval = data["min interval"].get<long long>();
+      interval = std::max(interval, std::chrono::seconds(min_interval));
+    }
+    tracker.next_announce = std::chrono::steady_clock::now() + interval;
+    if (data.contains("tracker id")) {
+      tracker.tracker_id = data["tracker id"].get<std::string>();
+    }
+    return true;
+  }
+
+  std::string info_hash_;
+  size_t uploaded_ = 0;
+  size_t downloaded_ = 0;
+  size_t left_ = 0;
+  bool completed_ = false;
+  bool joined_ = false;
+  CURLM* multi_ = nullptr;
+  std::unique_ptr<UdpTracker> udp_;
+  std::vector<std::unique_ptr<Tracker>> trackers_;
+  PeerAddressSet known_peers_;
+  std::vector<sockaddr_storage> fresh_peers_;
+};
+
+// Announces to every tracker and returns once all have answered.
+std::vector<sockaddr_storage> sendRequest(const std::string& filename) {
+  TrackerClient tracker(openTorrentFile(filename));
+  return tracker.announce("started");
+}
+
+// Reserved-byte flag announcing the extension protocol (BEP 10).
+constexpr size_t kExtensionByte = 5;
+constexpr unsigned char kExtensionBit = 0x10;
+// Reserved-byte flag announcing the fast extension (BEP 6).
+constexpr size_t kFastByte = 7;
+constexpr unsigned char kFastBit = 0x04;
+
+// How long a peer gets to accept the connection and answer our handshake,
+// instead of the kernel's connect timeout of two minutes and more.
+constexpr std::chrono::seconds kConnectTimeout{5};
+
+// Connects a blocking socket to peer, giving up after timeout. Later sends
+// and receives on the socket time out after the same interval.
+int connectWithTimeout(const sockaddr_storage& peer,
+                       std::chrono::milliseconds timeout) {
+  int fd = socket(peer.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&peer),
+              peerAddressLength(peer)) == -1) {
+    pollfd pfd{fd, POLLOUT, 0};
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (errno != EINPROGRESS || ::poll(&pfd, 1, timeout.count()) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 ||
+        error != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  timeval tv{};
+  tv.tv_sec = timeout.count() / 1000;
+  tv.tv_usec = timeout.count() % 1000 * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+// Peer wire message ids (BEP 3).
+constexpr uint8_t kMsgChoke = 0;
+constexpr uint8_t kMsgUnchoke = 1;
+constexpr uint8_t kMsgInterested = 2;
+constexpr uint8_t kMsgNotInterested = 3;
+constexpr uint8_t kMsgHave = 4;
+constexpr uint8_t kMsgBitfield = 5;
+constexpr uint8_t kMsgRequest = 6;
+constexpr uint8_t kMsgPiece = 7;
+constexpr uint8_t kMsgCancel = 8;
+// Fast extension messages (BEP 6), only valid if both sides announced it.
+constexpr uint8_t kMsgSuggestPiece = 13;
+constexpr uint8_t kMsgHaveAll = 14;
+constexpr uint8_t kMsgHaveNone = 15;
+constexpr uint8_t kMsgRejectRequest = 16;
+constexpr uint8_t kMsgAllowedFast = 17;
+// Extension protocol message (BEP 10); the first payload byte selects the
+// extension, 0 being the extension handshake.
+constexpr uint8_t kMsgExtended = 20;
+constexpr uint8_t kExtHandshake = 0;
+
+constexpr uint32_t kBlockSize = 16384;
+constexpr std::string_view kProtocol = "BitTorrent protocol";
+constexpr size_t kHandshakeSize = 68;
+// Where the info hash and the peer id sit in a handshake.
+constexpr size_t kHandshakeHashOffset = 28;
+constexpr size_t kHandshakePeerIdOffset = 48;
+
+void appendUint32(std::string& out, uint32_t value) {
+  uint32_t network = htonl(value);
+  out.append(reinterpret_cast<const char*>(&network), sizeof(network));
+}
+
+uint32_t readUint32(const unsigned char* in) {
+  uint32_t network;
+  std::memcpy(&network, in, sizeof(network));
+  return ntohl(network);
+}
+
+// Frames one peer wire message: length prefix, id and payload.
+std::string wireMessage(uint8_t id, std::string_view payload = {}) {
+  std::string message;
+  message.reserve(5 + payload.size());
+  appendUint32(message, payload.size() + 1);
+  message += static_cast<char>(id);
+  message.append(payload);
+  return message;
+}
+
+// Our handshake for the torrent with info_hash: protocol name, reserved
+// bits announcing the extension protocol and the fast extension, info hash
+// and peer id.
+std::string handshakeMessage(std::string_view info_hash) {
+  std::string message;
+  message.reserve(kHandshakeSize);
+  message += static_cast<char>(kProtocol.size());
+  message += kProtocol;
+  std::string reserved(8, '\0');
+  reserved[kExtensionByte] = static_cast<char>(kExtensionBit);
+  reserved[kFastByte] = static_cast<char>(kFastBit);
+  message += reserved;
+  message += info_hash;
+  message += kPeerId;
+  return message;
+}
+
+// Whether a peer's handshake speaks our protocol and is for the torrent
+// with info_hash.
+bool handshakeMatches(const unsigned char* handshake,
+                      std::string_view info_hash) {
+  return handshake[0] == kProtocol.size() &&
+         std::memcmp(handshake + 1, kProtocol.data(), kProtocol.size()) ==
+             0 &&
+         std::memcmp(handshake + kHandshakeHashOffset, info_hash.data(),
+                     info_hash.size()) == 0;
+}
+
+// Peer exchange (BEP 11) on top of the extension protocol. Merges the
+// added/dropped deltas that peers send into one set of peers to dial, and
+// builds for every ut_pex capable peer a delta of our own connections at
+// most once a minute. Peers are keyed by their connection's id.
+class PeerExchange {
+ public:
+  // Our id for ut_pex messages, advertised in the extension handshake.
+  static constexpr uint8_t kUtPexId = 1;
+
+  // The extension handshake advertising ut_pex, framed for the wire.
+  static std::string handshake() {
+    json handshake = json::object();
+    handshake["m"] = json::object();
+    handshake["m"]["ut_pex"] = kUtPexId;
+    return extendedMessage(kExtHandshake, bencodeTheString(handshake));
+  }
+
+  // Handles the payload of a message with id kMsgExtended from connection.
+  void onMessage(uint64_t connection, const unsigned char* payload,
+                 size_t size) {
+    if (size == 0) {
+      return;
+    }
+    json message;
+    try {
+      std::string encoded(reinterpret_cast<const char*>(payload) + 1,
+                          size - 1);
+      if (!isEncodedDict(encoded)) {
+        return;
+      }
+      message = decodeBencodedValue(encoded);
+    } catch (const std::exception&) {
+      return;
+    }
+    if (payload[0] == kExtHandshake) {
+      auto m = message.find("m");
+      if (m != message.end() && m->is_object() && m->contains("ut_pex") &&
+          (*m)["ut_pex"].is_number()) {
+        remotes_[connection].ut_pex_id = (*m)["ut_pex"].get<int>();
+      }
+    } else if (payload[0] == kUtPexId) {
+      merge(message, "added", AF_INET, true);
+      merge(message, "added6", AF_INET6, true);
+      merge(message, "dropped", AF_INET, false);
+      merge(message, "dropped6", AF_INET6, false);
+    }
+  }
+
+  // Peers reported as added (and not dropped since) by any peer.
+  std::vector<sockaddr_storage> takeAdded() {
+    std::vector<sockaddr_storage> added(added_.begin(), added_.end());
+    added_.clear();
+    return added;
+  }
+
+  // The message telling the peer on connection how our connection set
+  // changed since the last one, or an empty string if it does not speak
+  // ut_pex, kInterval has not passed or nothing changed.
+  std::string update(uint64_t connection,
+                     const std::vector<sockaddr_storage>& connected) {
+    auto it = remotes_.find(connection);
+    auto now = std::chrono::steady_clock::now();
+    if (it == remotes_.end() || it->second.ut_pex_id == 0 ||
+        now - it->second.last_sent < kInterval) {
+      return {};
+    }
+    Remote& remote = it->second;
+    PeerAddressSet current(connected.begin(), connected.end());
+    std::string added, added6, dropped, dropped6;
+    size_t count = 0;
+    for (const auto& peer : current) {
+      if (count < kMaxAdded && !remote.sent.contains(peer)) {
+        (peer.ss_family == AF_INET ? added : added6) += encodeCompactPeer(peer);
+        remote.sent.insert(peer);
+        ++count;
+      }
+    }
+    for (auto peer = remote.sent.begin(); peer != remote.sent.end();) {
+      if (current.contains(*peer)) {
+        ++peer;
+        continue;
+      }
+      (peer->ss_family == AF_INET ? dropped : dropped6) +=
+          encodeCompactPeer(*peer);
+      peer = remote.sent.erase(peer);
+    }
+    remote.last_sent = now;
+    if (added.empty() && added6.empty() && dropped.empty() &&
+        dropped6.empty()) {
+      return {};
+    }
+    json message = json::object();
+    message["added"] = added;
+    message["added.f"] = std::string(added.size() / kCompactPeerSize, '\0');
+    message["added6"] = added6;
+    message["added6.f"] =
+        std::string(added6.size() / kCompactPeer6Size, '\0');
+    message["dropped"] = dropped;
+    message["dropped6"] = dropped6;
+    return extendedMessage(remote.ut_pex_id, bencodeTheString(message));
+  }
+
+  // Forgets a connection that has been closed.
+  void forget(uint64_t connection) { remotes_.erase(connection); }
+
+ private:
+  static constexpr auto kInterval = std::chrono::seconds(60);
+  static constexpr size_t kMaxAdded = 50;
+
+  struct Remote {
+    uint8_t ut_pex_id = 0;
+    PeerAddressSet sent;
+    std::chrono::steady_clock::time_point last_sent;
+  };
+
+  static std::string extendedMessage(uint8_t extension,
+                                     const std::string& body) {
+    return wireMessage(kMsgExtended,
+                       std::string(1, static_cast<char>(extension)) + body);
+  }
+
+  void merge(const json& message, const char* key, int family, bool add) {
+    auto it = message.find(key);
+    if (it == message.end() || !it->is_string()) {
+      return;
+    }
+    const auto& compact = it->get_ref<const std::string&>();
+    size_t size = family == AF_INET ? kCompactPeerSize : kCompactPeer6Size;
+    for (size_t i = 0; i + size <= compact.size(); i += size) {
+      auto peer = decodeCompactPeer(
+          reinterpret_cast<const unsigned char*>(compact.data()) + i, family);
+      if (add) {
+        added_.insert(peer);
+      } else {
+        added_.erase(peer);
+      }
+    }
+  }
+
+  std::unordered_map<uint64_t, Remote> remotes_;
+  PeerAddressSet added_;
+};
+
+// Progress of the running download, read by the bench command.
+struct DownloadStats {
+  std::atomic<bool> got_block{false};
+  std::chrono::steady_clock::time_point first_block;
+};
+
+DownloadStats download_stats;
+
+// I/O engine for downloads; the bench command can pin one to compare them.
+Reactor::Backend io_backend = Reactor::Backend::kAuto;
+// Transport tried first for every peer; the other one is the fallback.
+Transport::Kind peer_transport = Transport::Kind::kTcp;
+// Bandwidth limits, set from the command line; running downloads pick up
+// changes within a reactor round.
+RateLimits rate_limits;
+// The process-wide buckets, shared by every download.
+TokenBucket global_download_bucket;
+TokenBucket global_upload_bucket;
+
+// What a download needs to know about the torrent, parsed once.
+struct TorrentInfo {
+  std::string info_hash;
+  uint64_t length = 0;
+  uint64_t piece_length = 0;
+  size_t piece_count = 0;
+  // SHA-1 of every piece, 20 raw bytes each.
+  std::string piece_hashes;
+  // What every connection opens with: our handshake and, since we only
+  // download, interested. Built once and copied into each send queue.
+  std::string first_flight;
+
+  uint64_t pieceSize(uint32_t piece) const {
+    return std::min(piece_length, length - piece * piece_length);
+  }
+};
+
+TorrentInfo loadTorrentInfo(const json& torrent) {
+  const auto& info = torrent["info"];
+  TorrentInfo result;
+  std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
+  stringToSHA1(bencodeTheString(info), hash);
+  result.info_hash.assign(reinterpret_cast<const char*>(hash.data()),
+                          hash.size());
+  result.length = info["length"].get<uint64_t>();
+  result.piece_length = info["piece length"].get<uint64_t>();
+  result.piece_hashes = info["pieces"].get<std::string>();
+  result.piece_count = result.piece_hashes.size() / SHA_DIGEST_LENGTH;
+  if (result.piece_hashes.size() % SHA_DIGEST_LENGTH != 0 ||
+      result.piece_length == 0 ||
+      result.piece_count !=
+          (result.length + result.piece_length - 1) / result.piece_length) {
+    throw std::runtime_error("Inconsistent piece layout in torrent");
+  }
+  result.first_flight =
+      handshakeMessage(result.info_hash) + wireMessage(kMsgInterested);
+  return result;
+}
+
+// Connects to peer and swaps handshakes. Returns the socket and the
+// peer's id in hex, or -1 and "error".
+std::pair<int, std::string> establishConnection(const TorrentInfo& torrent,
+                                                const sockaddr_storage& peer) {
+  int client_socket = connectWithTimeout(peer, kConnectTimeout);
+  if (client_socket == -1) {
+    std::cerr << "Error connecting to the server" << std::endl;
+    return std::make_pair(-1, "error");
+  }
+  if (send(client_socket, torrent.first_flight.data(), kHandshakeSize,
+           MSG_NOSIGNAL) == -1) {
+    std::cerr << "Error sending data" << std::endl;
+  }
+  unsigned char buffer[kHandshakeSize];
+  ssize_t bytesRead = recv(client_socket, buffer, sizeof(buffer), MSG_WAITALL);
+  if (bytesRead != static_cast<ssize_t>(sizeof(buffer))) {
+    std::cerr << "Error receiving data" << std::endl;
+    close(client_socket);
+    return std::make_pair(-1, "error");
+  }
+  if (!handshakeMatches(buffer, torrent.info_hash)) {
+    std::cerr << "Peer answered for another torrent" << std::endl;
+    close(client_socket);
+    return std::make_pair(-1, "error");
+  }
+  return std::make_pair(
+      client_socket,
+      toHex(buffer + kHandshakePeerIdOffset, kPeerId.size()));
 }
 
-std::string decToHex(const unsigned int& num) {
-  std::stringstream ss;
-  std::string ans;
-  ss << std::hex << std::setfill('0') << std::setw(8) << num;
-  ss >> ans;
-  return ans;
-}
+struct PeerTransfer {
+  sockaddr_storage address{};
+  size_t bytes = 0;
+  std::chrono::duration<double> time{};
+};
+
+// Block requests outstanding across all connections of a download, against
+// a cap that bounds the memory waiting on slow peers.
+struct RequestBudget {
+  uint64_t limit = 0;
+  uint64_t outstanding = 0;
+};
+
+// The token buckets of one download, drawn on by all of its connections
+// along with the process-wide ones and their own.
+struct Throttle {
+  TokenBucket download;
+  TokenBucket upload;
+};
+
+// One peer connection driven by the reactor. The protocol runs as a
+// coroutine session written in sequence: connect, swap handshakes, then
+// handle messages as they arrive. The reactor handlers resume it once what
+// it awaits is there, so any number of sessions share the reactor thread.
+// The peer's choke state and piece set follow its choke/unchoke, bitfield
+// and have messages, and with the fast extension (BEP 6) its have all/none,
+// allowed fast, suggest and reject messages. While it lets us, the blocks
+// of the assigned pieces are requested through a pipeline sized to the
+// peer's bandwidth-delay product, as far as the rate limits allow: a request
+// goes out only while the download buckets of every level have tokens, and
+// output only while the upload ones do. Input is framed out of the receive
+// buffer the reactor fills; output the socket cannot take yet stays queued
+// until it drains.
+class PeerConnection : public Reactor::Handler {
+ public:
+  enum class State { kConnecting, kHandshake, kConnected, kClosed };
+
+  class Observer {
+   public:
+    virtual ~Observer() = default;
+    // The peer's handshake arrived; the observer may still drop the
+    // connection, e.g. as a duplicate of another one to the same peer.
+    virtual void onHandshake(PeerConnection& connection) = 0;
+    // The peer unchoked us; it can be given pieces from now on.
+    virtual void onReady(PeerConnection& connection) = 0;
+    // The connection gave up on these assigned pieces, e.g. because the
+    // peer choked us or rejected one of their blocks.
+    virtual void onDropped(PeerConnection& connection,
+                           const std::vector<uint32_t>& pieces) = 0;
+    // A requested block of bytes arrived.
+    virtual void onBlock(PeerConnection& connection, size_t bytes) = 0;
+    // Every block of an assigned piece arrived; data is not verified yet.
+    virtual void onPiece(PeerConnection& connection, uint32_t piece,
+                         std::vector<unsigned char>& data) = 0;
+    // The connection failed or was closed, losing its assigned pieces.
+    virtual void onClosed(PeerConnection& connection) = 0;
+    // A bitfield or have all/none replaced the peer's pieces, which were
+    // previous until now.
+    virtual void onPieces(PeerConnection& connection,
+                          const PieceSet& previous) = 0;
+    // The peer announced a piece (has) or rejected one, which it no longer
+    // counts as having.
+    virtual void onHave(PeerConnection& connection, uint32_t piece,
+                        bool has) = 0;
+  };
+
+  // Connects over kind; uTP connections go through utp.
+  PeerConnection(Reactor& reactor, Observer& observer,
+                 const TorrentInfo& torrent, PeerExchange* pex,
+                 RequestBudget& budget, Throttle& throttle,
+                 const sockaddr_storage& address, Transport::Kind kind,
+                 UtpSocket* utp)
+      : reactor_(reactor),
+        observer_(observer),
+        torrent_(torrent),
+        pex_(pex),
+        budget_(budget),
+        throttle_(throttle),
+        kind_(kind),
+        utp_(utp) {
+    transfer_.address = address;
+  }
+
+  PeerConnection(const PeerConnection&) = delete;
+  PeerConnection& operator=(const PeerConnection&) = delete;
+
+  // Starts connecting; the outcome is reported through the observer.
+  void start() {
+    started_at_ = std::chrono::steady_clock::now();
+    refillBuckets(started_at_);
+    try {
+      if (kind_ == Transport::Kind::kUtp) {
+        transport_ = utp_->connect(transfer_.address, in_, this);
+      } else {
+        transport_ = std::make_unique<TcpTransport>(
+            reactor_, transfer_.address, in_, this);
+      }
+    } catch (const std::runtime_error& e) {
+      fail(e.what());
+      return;
+    }
+    session_ = run();
+  }
+
+  // Adds piece to the pieces being fetched and tops up the pipeline.
+  void download(uint32_t piece) {
+    if (pieces_.empty()) {
+      busy_since_ = std::chrono::steady_clock::now();
+    }
+    PieceBuffer buffer;
+    buffer.index = piece;
+    buffer.data = std::move(spare_);
+    buffer.data.resize(torrent_.pieceSize(piece));
+    pieces_.push_back(std::move(buffer));
+    requestBlocks();
+  }
+
+  // Queues a framed message. Queued messages go out together at the end of
+  // the current event or reactor round, see flush().
+  void send(std::string message) { out_.push(std::move(message)); }
+
+  // Writes the queued messages, as many per syscall as the socket takes.
+  // Requests and other control messages are not held back by the upload
+  // limits, which only meter piece payload, or a download would be capped
+  // by its own upload limit.
+  void flush() {
+    if (state_ == State::kConnecting || state_ == State::kClosed ||
+        out_.empty()) {
+      return;
+    }
+    if (!out_.flush(*transport_)) {
+      fail("Error sending message");
+      return;
+    }
+    // Requests are timed from when the transport took them, not from when
+    // they were queued behind a full socket or the download limits.
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = requests_.rbegin();
+         it != requests_.rend() && it->sent == kUnsent; ++it) {
+      if (it->end <= out_.written()) {
+        it->sent = now;
+      }
+    }
+    if (!out_.empty()) {
+      transport_->wantWrite();
+    }
+  }
+
+  // Adds the tokens the connection's own buckets earned; called once per
+  // reactor round.
+  void refillBuckets(std::chrono::steady_clock::time_point now) {
+    download_bucket_.refill(rate_limits.peer_download, now);
+    upload_bucket_.refill(rate_limits.peer_upload, now);
+  }
+
+  // Bytes of blocks received since the last call; the download scores its
+  // peers by it.
+  uint64_t takeDelivered() { return std::exchange(delivered_, 0); }
+  // Whether the oldest outstanding request has gone unanswered for
+  // kSnubTimeout since it was sent.
+  bool snubbed(std::chrono::steady_clock::time_point now) const {
+    return !requests_.empty() && requests_.front().sent != kUnsent &&
+           now - requests_.front().sent > kSnubTimeout;
+  }
+
+  // Sends the requests the download limits held back, if they allow it now.
+  void resumeRequests() {
+    if (throttled_ && state_ == State::kConnected && mayDownload()) {
+      throttled_ = false;
+      requestBlocks();
+    }
+  }
+
+  void close() {
+    if (state_ == State::kClosed) {
+      return;
+    }
+    state_ = State::kClosed;
+    if (pex_ != nullptr) {
+      pex_->forget(id_);
+    }
+    transport_.reset();
+    observer_.onClosed(*this);
+    dropPieces();
+  }
+
+  // Logs why the connection is given up on and closes it.
+  void fail(const std::string& reason) {
+    std::cerr << formatPeer(transfer_.address) << ": " << reason << std::endl;
+    close();
+  }
+
+  // Closes the connection without holding it against the peer: it was
+  // slower than others or duplicated one.
+  void abandon() {
+    abandoned_ = true;
+    close();
+  }
+
+  void onWritable() override {
+    if (state_ == State::kConnecting) {
+      int error = transport_->connectError();
+      if (error != 0) {
+        fail(std::string("Error connecting: ") + std::strerror(error));
+        return;
+      }
+      state_ = State::kHandshake;
+      wake();
+      return;
+    }
+    flush();
+  }
+
+  // Messages queued in response are sent by the next flush(), together
+  // with those of the rest of the round.
+  void onReceived(ssize_t result) override {
+    if (state_ == State::kClosed) {
+      return;
+    }
+    if (result < 0 && state_ == State::kConnecting) {
+      fail(std::string("Error connecting: ") + std::strerror(-result));
+      return;
+    }
+    if (result <= 0) {
+      fail(result == 0 ? "Connection closed by peer"
+                       : std::string("Error receiving data: ") +
+                             std::strerror(-result));
+      return;
+    }
+    if (state_ == State::kConnecting) {
+      // Data can only come from a connected peer, even if the completion
+      // saying so is still on its way.
+      state_ = State::kHandshake;
+    }
+    wake();
+  }
+
+  State state() const { return state_; }
+  // Whether the connection is still waiting for the peer's handshake.
+  bool connecting() const {
+    return state_ == State::kConnecting || state_ == State::kHandshake;
+  }
+  bool abandoned() const { return abandoned_; }
+  std::chrono::steady_clock::time_point startedAt() const {
+    return started_at_;
+  }
+  const std::string& peerId() const { return peer_id_; }
+  // Tells connections apart for their lifetime, unlike their address.
+  uint64_t id() const { return id_; }
+  Transport::Kind kind() const { return kind_; }
+  const sockaddr_storage& address() const { return transfer_.address; }
+  PeerTransfer& transfer() { return transfer_; }
+  // Whether the peer's handshake arrived.
+  bool established() const { return established_; }
+  // Whether the peer lets us download, if only its allowed fast pieces,
+  // and the pipeline has room that the assigned pieces cannot fill.
+  bool wantsPiece() const {
+    if (state_ != State::kConnected || !mayDownload() ||
+        (peer_choking_ && allowed_fast_.empty()) ||
+        requests_.size() >= depth_ ||
+        budget_.outstanding + kBlockSize > budget_.limit) {
+      return false;
+    }
+    return std::all_of(pieces_.begin(), pieces_.end(), [](const auto& piece) {
+      return piece.requested == piece.data.size();
+    });
+  }
+  // The pieces being fetched.
+  std::vector<uint32_t> pieces() const {
+    std::vector<uint32_t> result;
+    for (const auto& piece : pieces_) {
+      result.push_back(piece.index);
+    }
+    return result;
+  }
+
+  bool hasPiece(uint32_t piece) const { return available_.test(piece); }
+  const PieceSet& availablePieces() const { return available_; }
+  // Whether piece can be requested now: the peer has it and has unchoked
+  // us or allows it while choked.
+  bool canFetch(uint32_t piece) const {
+    return hasPiece(piece) && (!peer_choking_ || allowedFast(piece));
+  }
+  // Pieces the peer suggested, most recent first.
+  const std::deque<uint32_t>& suggestions() const { return suggested_; }
+
+ private:
+  // A handshake or message in the receive buffer, without the length
+  // prefix; a message of size 0 is a keep-alive. The view stays valid until
+  // the session reads the next frame.
+  struct Frame {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+  };
+
+  // Suspends the session until ready() holds. The reactor handlers check
+  // again whenever they may have made it true; a closed connection never
+  // resumes its session.
+  class Until {
+   public:
+    using Condition = bool (PeerConnection::*)();
+
+    Until(PeerConnection& connection, Condition ready)
+        : connection_(connection), ready_(ready) {}
+
+    bool await_ready() {
+      return connection_.state_ != State::kClosed &&
+             (connection_.*ready_)();
+    }
+    void await_suspend(std::coroutine_handle<> session) {
+      connection_.waiting_ = session;
+      connection_.ready_ = ready_;
+    }
+    void await_resume() {}
+
+   protected:
+    PeerConnection& connection_;
+    Condition ready_;
+  };
+
+  class NextFrame : public Until {
+   public:
+    explicit NextFrame(PeerConnection& connection)
+        : Until(connection, &PeerConnection::frameReady) {}
+
+    Frame await_resume() { return connection_.takeFrame(); }
+  };
+
+  // Awaits the end of the non-blocking connect.
+  Until connected() {
+    return Until(*this, &PeerConnection::isConnected);
+  }
+
+  // Awaits the next frame: the handshake first, length-prefixed messages
+  // after it. The previous frame is released.
+  NextFrame readFrame() {
+    in_->consume(std::exchange(frame_size_, 0));
+    return NextFrame(*this);
+  }
+
+  // Resumes the session if what it waits for is there.
+  void wake() {
+    if (waiting_ && state_ != State::kClosed && (this->*ready_)()) {
+      std::exchange(waiting_, nullptr).resume();
+    }
+  }
+
+  bool isConnected() { return state_ != State::kConnecting; }
+
+  bool frameReady() {
+    size_t size = in_->size();
+    if (!established_) {
+      return size >= kHandshakeSize;
+    }
+    if (size < 4) {
+      return false;
+    }
+    uint32_t length = readUint32(in_->data());
+    if (length > kMaxMessageSize) {
+      fail("Message too large");
+      return false;
+    }
+    return size - 4 >= length;
+  }
+
+  Frame takeFrame() {
+    Frame frame;
+    if (!established_) {
+      frame.data = in_->data();
+      frame.size = kHandshakeSize;
+      frame_size_ = kHandshakeSize;
+    } else {
+      frame.data = in_->data() + 4;
+      frame.size = readUint32(in_->data());
+      frame_size_ = 4 + frame.size;
+    }
+    return frame;
+  }
+
+  // The session. Messages queued along the way are sent by the next
+  // flush(), together with those of the rest of the reactor round.
+  Session run() {
+    co_await connected();
+    // Handshake and interested leave in one write.
+    send(torrent_.first_flight);
+
+    Frame reply = co_await readFrame();
+    if (!handshakeMatches(reply.data, torrent_.info_hash)) {
+      fail("Handshake for another torrent");
+      co_return;
+    }
+    bool extensions = reply.data[20 + kExtensionByte] & kExtensionBit;
+    fast_ = reply.data[20 + kFastByte] & kFastBit;
+    peer_id_.assign(reply.data + kHandshakePeerIdOffset,
+                    reply.data + kHandshakeSize);
+    state_ = State::kConnected;
+    established_ = true;
+    observer_.onHandshake(*this);
+    if (state_ == State::kClosed) {
+      co_return;
+    }
+    if (pex_ != nullptr && extensions) {
+      send(PeerExchange::handshake());
+    }
+
+    for (;;) {
+      Frame message = co_await readFrame();
+      if (message.size > 0) {
+        handleMessage(message.data[0], message.data + 1, message.size - 1);
+      }
+    }
+  }
+
+  void handleMessage(uint8_t id, const unsigned char* payload, size_t size) {
+    if (id == kMsgExtended) {
+      if (pex_ != nullptr) {
+        pex_->onMessage(id_, payload, size);
+      }
+      return;
+    }
+    if (id >= kMsgSuggestPiece && id <= kMsgAllowedFast) {
+      if (fast_) {
+        handleFastMessage(id, payload, size);
+      }
+      return;
+    }
+    switch (id) {
+      case kMsgChoke:
+        if (!peer_choking_) {
+          peer_choking_ = true;
+          // Allowed fast pieces stay; a fast peer rejects the other
+          // requests, any other peer just drops them.
+          std::vector<uint32_t> dropped;
+          for (const auto& piece : pieces_) {
+            if (!allowedFast(piece.index)) {
+              dropped.push_back(piece.index);
+            }
+          }
+          for (uint32_t piece : dropped) {
+            dropPiece(piece);
+          }
+          observer_.onDropped(*this, dropped);
+        }
+        return;
+      case kMsgUnchoke:
+        if (peer_choking_) {
+          peer_choking_ = false;
+          observer_.onReady(*this);
+        }
+        return;
+      case kMsgHave:
+        if (size != 4) {
+          fail("Malformed have");
+          return;
+        }
+        addPiece(readUint32(payload));
+        return;
+      case kMsgBitfield: {
+        PieceSet previous = replacePieces();
+        available_.assignBitfield(payload, size);
+        observer_.onPieces(*this, previous);
+        return;
+      }
+      case kMsgPiece:
+        handleBlock(payload, size);
+        return;
+      case kMsgRequest:
+        // A fast peer is owed an answer to every request; we keep it
+        // choked, so the answer is a reject.
+        if (fast_ && size == 12) {
+          send(wireMessage(kMsgRejectRequest,
+                           std::string_view(
+                               reinterpret_cast<const char*>(payload), size)));
+        }
+        return;
+      case kMsgInterested:
+      case kMsgNotInterested:
+      case kMsgCancel:
+        // We do not upload, so the peer's interest and requests have
+        // nothing to act on.
+        return;
+      default:
+        // Messages of extensions we did not announce (DHT port, fast
+        // extension, ...) are skipped.
+        return;
+    }
+  }
+
+  void handleFastMessage(uint8_t id, const unsigned char* payload,
+                         size_t size) {
+    if (id == kMsgHaveAll || id == kMsgHaveNone) {
+      // Stands in for a bitfield, so seeds need not send one.
+      PieceSet previous = replacePieces();
+      if (id == kMsgHaveAll) {
+        available_.fill();
+      }
+      observer_.onPieces(*this, previous);
+      return;
+    }
+    if (id == kMsgRejectRequest) {
+      if (size != 12) {
+        fail("Malformed reject");
+        return;
+      }
+      handleReject(readUint32(payload), readUint32(payload + 4),
+                   readUint32(payload + 8));
+      return;
+    }
+    if (size != 4) {
+      fail("Malformed fast extension message");
+      return;
+    }
+    uint32_t piece = readUint32(payload);
+    if (piece >= torrent_.piece_count) {
+      return;
+    }
+    if (id == kMsgAllowedFast) {
+      if (!allowedFast(piece)) {
+        allowed_fast_.push_back(piece);
+      }
+    } else if (std::find(suggested_.begin(), suggested_.end(), piece) ==
+               suggested_.end()) {
+      suggested_.push_front(piece);
+      if (suggested_.size() > kMaxSuggestions) {
+        suggested_.pop_back();
+      }
+    }
+  }
+
+  // The peer will not send a block we asked for. Rather than wait on it,
+  // the whole piece goes back to the download, the rest of its requests
+  // are cancelled and the peer is not asked for it again. Rejects of
+  // requests dropped on a choke match nothing and are ignored.
+  void handleReject(uint32_t index, uint32_t offset, uint32_t length) {
+    auto request = std::find_if(
+        requests_.begin(), requests_.end(), [&](const BlockRequest& r) {
+          return r.piece == index && r.offset == offset &&
+                 r.length == length;
+        });
+    if (request == requests_.end()) {
+      return;
+    }
+    requests_.erase(request);
+    budget_.outstanding -= length;
+    for (const auto& other : requests_) {
+      if (other.piece == index) {
+        std::string message;
+        appendUint32(message, other.piece);
+        appendUint32(message, other.offset);
+        appendUint32(message, other.length);
+        send(wireMessage(kMsgCancel, message));
+      }
+    }
+    std::erase(allowed_fast_, index);
+    dropPiece(index);
+    if (hasPiece(index)) {
+      available_.reset(index);
+      observer_.onHave(*this, index, false);
+    }
+    observer_.onDropped(*this, {index});
+  }
+
+  bool allowedFast(uint32_t piece) const {
+    return std::find(allowed_fast_.begin(), allowed_fast_.end(), piece) !=
+           allowed_fast_.end();
+  }
+
+  void addPiece(uint32_t piece) {
+    if (piece >= torrent_.piece_count || hasPiece(piece)) {
+      return;
+    }
+    available_.set(piece);
+    observer_.onHave(*this, piece, true);
+  }
+
+  // Empties the peer's pieces for a bitfield or have all/none to refill,
+  // returning what they were.
+  PieceSet replacePieces() {
+    return std::exchange(available_, PieceSet(torrent_.piece_count));
+  }
+
+  // Forgets one assigned piece and its outstanding requests.
+  void dropPiece(uint32_t index) {
+    for (const auto& request : requests_) {
+      if (request.piece == index) {
+        budget_.outstanding -= request.length;
+      }
+    }
+    std::erase_if(requests_, [&](const BlockRequest& request) {
+      return request.piece == index;
+    });
+    size_t erased = std::erase_if(pieces_, [&](const PieceBuffer& piece) {
+      return piece.index == index;
+    });
+    if (erased > 0 && pieces_.empty()) {
+      transfer_.time += std::chrono::steady_clock::now() - busy_since_;
+    }
+  }
+
+  // Forgets the assigned pieces and their outstanding requests.
+  void dropPieces() {
+    if (!pieces_.empty()) {
+      transfer_.time += std::chrono::steady_clock::now() - busy_since_;
+    }
+    for (const auto& request : requests_) {
+      budget_.outstanding -= request.length;
+    }
+    requests_.clear();
+    pieces_.clear();
+  }
+
+  // Matches a block against the outstanding requests (peers answer in
+  // order, so normally the first one), stores it and refills the pipeline.
+  // Blocks nothing waits for, e.g. ones sent just before a choke, are
+  // dropped.
+  void handleBlock(const unsigned char* payload, size_t size) {
+    if (size < 8) {
+      fail("Malformed piece message");
+      return;
+    }
+    uint32_t index = readUint32(payload);
+    uint32_t offset = readUint32(payload + 4);
+    auto request = std::find_if(
+        requests_.begin(), requests_.end(), [&](const BlockRequest& r) {
+          return r.piece == index && r.offset == offset &&
+                 r.length == size - 8;
+        });
+    if (request == requests_.end()) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (!download_stats.got_block.exchange(true)) {
+      download_stats.first_block = now;
+    }
+    updatePipeline(now, now - request->sent, request->length);
+    delivered_ += request->length;
+    budget_.outstanding -= request->length;
+    requests_.erase(request);
+    observer_.onBlock(*this, size - 8);
+    auto piece = std::find_if(pieces_.begin(), pieces_.end(),
+                              [&](const PieceBuffer& p) {
+                                return p.index == index;
+                              });
+    std::memcpy(piece->data.data() + offset, payload + 8, size - 8);
+    piece->received += size - 8;
+    if (piece->received == piece->data.size()) {
+      std::vector<unsigned char> data = std::move(piece->data);
+      pieces_.erase(piece);
+      if (pieces_.empty()) {
+        transfer_.time += now - busy_since_;
+      }
+      observer_.onPiece(*this, index, data);
+      spare_ = std::move(data);
+      if (state_ == State::kClosed) {
+        return;
+      }
+    }
+    requestBlocks();
+  }
+
+  // Feeds the rate and round-trip samples of one block into the pipeline
+  // depth: twice the bandwidth-delay product, in blocks. The round trip is
+  // the smallest seen lately, as later requests also wait behind earlier
+  // ones at the peer; the rate is measured over at least one round trip.
+  // Doubling the product lets the depth, and so the rate, grow until the
+  // link is full.
+  void updatePipeline(std::chrono::steady_clock::time_point now,
+                      std::chrono::steady_clock::duration rtt,
+                      uint32_t bytes) {
+    if (rtt < min_rtt_ || now - min_rtt_at_ > kMinRttWindow) {
+      min_rtt_ = rtt;
+      min_rtt_at_ = now;
+    }
+    window_bytes_ += bytes;
+    std::chrono::duration<double> elapsed = now - window_start_;
+    if (elapsed < std::max<std::chrono::duration<double>>(min_rtt_,
+                                                           kMinRateWindow)) {
+      return;
+    }
+    double rate = window_bytes_ / elapsed.count();
+    double bdp = rate * std::chrono::duration<double>(min_rtt_).count();
+    depth_ = std::clamp<size_t>(2 * bdp / kBlockSize, kMinPipelineDepth,
+                                kMaxPipelineDepth);
+    window_start_ = now;
+    window_bytes_ = 0;
+  }
+
+  // Requests the next blocks of the assigned pieces, in order, until the
+  // pipeline is full or the download's budget is spent.
+  void requestBlocks() {
+    if (requests_.empty()) {
+      // An empty pipeline is no measure of the peer's rate.
+      window_start_ = std::chrono::steady_clock::now();
+      window_bytes_ = 0;
+    }
+    for (auto& piece : pieces_) {
+      while (piece.requested < piece.data.size() &&
+             requests_.size() < depth_ &&
+             budget_.outstanding + kBlockSize <= budget_.limit) {
+        if (!mayDownload()) {
+          throttled_ = true;
+          return;
+        }
+        BlockRequest request;
+        request.piece = piece.index;
+        request.offset = piece.requested;
+        request.length = std::min<uint64_t>(
+            kBlockSize, piece.data.size() - piece.requested);
+        std::string message;
+        appendUint32(message, request.piece);
+        appendUint32(message, request.offset);
+        appendUint32(message, request.length);
+        send(wireMessage(kMsgRequest, message));
+        request.end = out_.pushed();
+        piece.requested += request.length;
+        budget_.outstanding += request.length;
+        global_download_bucket.take(request.length);
+        throttle_.download.take(request.length);
+        download_bucket_.take(request.length);
+        requests_.push_back(request);
+      }
+    }
+  }
+
+  bool mayDownload() const {
+    return global_download_bucket.available() &&
+           throttle_.download.available() && download_bucket_.available();
+  }
+
+  // Holds many blocks; a whole message, length prefix included, always
+  // fits, so a full buffer means some message is complete. Bitfields of up
+  // to two million pieces stay within kMaxMessageSize.
+  static constexpr size_t kReceiveBufferSize = 256 * 1024;
+  static constexpr uint32_t kMaxMessageSize = kReceiveBufferSize - 4;
+  // Outstanding requests per peer: enough to start, at least two so the
+  // peer never waits on us, at most 4 MiB.
+  static constexpr size_t kInitialPipelineDepth = 4;
+  static constexpr size_t kMinPipelineDepth = 2;
+  static constexpr size_t kMaxPipelineDepth = 256;
+  static constexpr std::chrono::seconds kMinRttWindow{10};
+  static constexpr std::chrono::milliseconds kMinRateWindow{50};
+  // Suggested pieces remembered per peer.
+  static constexpr size_t kMaxSuggestions = 16;
+  static constexpr std::chrono::seconds kSnubTimeout{20};
+  static constexpr std::chrono::steady_clock::time_point kUnsent{};
+
+  struct PieceBuffer {
+    uint32_t index = 0;
+    std::vector<unsigned char> data;
+    // Bytes requested so far, from the start, and bytes received.
+    uint64_t requested = 0;
+    uint64_t received = 0;
+  };
+
+  struct BlockRequest {
+    uint32_t piece = 0;
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    // Where the message ends in the send queue's stream, and when flush()
+    // saw the transport take it.
+    uint64_t end = 0;
+    std::chrono::steady_clock::time_point sent = kUnsent;
+  };
+
+  static inline uint64_t next_id_ = 0;
+
+  Reactor& reactor_;
+  Observer& observer_;
+  const TorrentInfo& torrent_;
+  PeerExchange* pex_;
+  RequestBudget& budget_;
+  Throttle& throttle_;
+  TokenBucket download_bucket_;
+  // Meters piece payload only; we serve no pieces yet.
+  TokenBucket upload_bucket_;
+  // Whether requests were held back by the download limits.
+  bool throttled_ = false;
+  Transport::Kind kind_;
+  UtpSocket* utp_;
+  std::unique_ptr<Transport> transport_;
+  uint64_t id_ = next_id_++;
+  State state_ = State::kConnecting;
+  std::chrono::steady_clock::time_point started_at_;
+  bool established_ = false;
+  bool abandoned_ = false;
+  // The peer chokes us until it says otherwise; our interest went out
+  // with the handshake.
+  bool peer_choking_ = true;
+  // Whether both sides announced the fast extension.
+  bool fast_ = false;
+  // Pieces the peer lets us fetch even while it chokes us.
+  std::vector<uint32_t> allowed_fast_;
+  std::deque<uint32_t> suggested_;
+  std::string peer_id_;
+  // Peers with few pieces may skip the bitfield and only send haves.
+  PieceSet available_{torrent_.piece_count};
+  // Shared with the reactor, which may need it after we are gone.
+  std::shared_ptr<RingBuffer> in_ =
+      std::make_shared<RingBuffer>(kReceiveBufferSize);
+  SendQueue out_;
+  std::deque<PieceBuffer> pieces_;
+  // Buffer of the last completed piece, reused for the next one.
+  std::vector<unsigned char> spare_;
+  std::deque<BlockRequest> requests_;
+  size_t depth_ = kInitialPipelineDepth;
+  std::chrono::steady_clock::duration min_rtt_ =
+      std::chrono::steady_clock::duration::max();
+  std::chrono::steady_clock::time_point min_rtt_at_;
+  std::chrono::steady_clock::time_point window_start_;
+  uint64_t window_bytes_ = 0;
+  uint64_t delivered_ = 0;
+  // When the connection last went from no assigned piece to some.
+  std::chrono::steady_clock::time_point busy_since_;
+  PeerTransfer transfer_;
+  // Bytes of the frame the session holds in the receive buffer.
+  size_t frame_size_ = 0;
+  // The suspended session and the condition it waits on.
+  std::coroutine_handle<> waiting_;
+  Until::Condition ready_ = nullptr;
+  // Declared last, so the frame goes before the state it refers to.
+  Session session_;
+};
+
+// Per-user cache directory for state kept between runs, empty when neither
+// XDG_CACHE_HOME nor HOME is set.
+std::filesystem::path cacheDirectory() {
+  if (const char* cache_home = std::getenv("XDG_CACHE_HOME")) {
+    return std::filesystem::path(cache_home) / "bittorrent";
+  }
+  if (const char* home = std::getenv("HOME")) {
+    return std::filesystem::path(home) / ".cache" / "bittorrent";
+  }
+  return {};
+}
+
+// On-disk record of the peers seen for one torrent, so a restarted download
+// can dial known-good peers while the tracker announce is still in flight.
+// One line per peer: address, last seen (unix time), measured download rate
+// in bytes per second and consecutive failed connection attempts.
+class PeerCache {
+ public:
+  explicit PeerCache(const std::string& info_hash) {
+    std::filesystem::path dir = cacheDirectory();
+    if (dir.empty()) {
+      return;
+    }
+    path_ = dir / "peers" / toHex(info_hash);
+    load();
+  }
+
+  // The most promising peers first: fastest measured rate, fewest failures,
+  // most recently seen.
+  std::vector<sockaddr_storage> best(size_t count) const {
+    std::vector<const Entry*> sorted;
+    for (const auto& [address, entry] : entries_) {
+      sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) {
+      if (a->failures != b->failures) {
+        return a->failures < b->failures;
+      }
+      if (a->rate != b->rate) {
+        return a->rate > b->rate;
+      }
+      return a->last_seen > b->last_seen;
+    });
+    std::vector<sockaddr_storage> peers;
+    for (size_t i = 0; i < sorted.size() && i < count; ++i) {
+      peers.push_back(sorted[i]->address);
+    }
+    return peers;
+  }
+
+  void recordTransfer(const sockaddr_storage& peer, size_t bytes,
+                      double seconds) {
+    auto& entry = entryFor(peer);
+    entry.last_seen = now();
+    entry.failures = 0;
+    if (bytes > 0 && seconds > 0) {
+      entry.rate = static_cast<uint64_t>(bytes / seconds);
+    }
+  }
+
+  void recordFailure(const sockaddr_storage& peer) {
+    ++entryFor(peer).failures;
+  }
+
+  void save() {
+    if (path_.empty()) {
+      return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(path_.parent_path(), ec);
+    auto tmp_path = path_;
+    tmp_path += ".tmp";
+    std::ofstream out(tmp_path, std::ios::out | std::ios::trunc);
+    if (!out.is_open()) {
+      return;
+    }
+    int64_t expired = now() - kMaxAge.count();
+    for (const auto& [address, entry] : entries_) {
+      if (entry.failures >= kMaxFailures || entry.last_seen < expired) {
+        continue;
+      }
+      out << formatPeer(entry.address) << ' ' << entry.last_seen << ' '
+          << entry.rate << ' ' << entry.failures << '\n';
+    }
+    // A short write (say a full disk) must not replace the last good cache.
+    out.flush();
+    if (!out.good()) {
+      std::cerr << "Error writing peer cache " << tmp_path.string()
+                << std::endl;
+      out.close();
+      std::filesystem::remove(tmp_path, ec);
+      return;
+    }
+    out.close();
+    std::filesystem::rename(tmp_path, path_, ec);
+  }
+
+ private:
+  struct Entry {
+    sockaddr_storage address{};
+    int64_t last_seen = 0;
+    uint64_t rate = 0;
+    uint32_t failures = 0;
+  };
+
+  static constexpr std::chrono::hours kMaxAge{24 * 7};
+  static constexpr uint32_t kMaxFailures = 5;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  Entry& entryFor(const sockaddr_storage& peer) {
+    auto [it, inserted] = entries_.try_emplace(peer);
+    if (inserted) {
+      it->second.address = peer;
+    }
+    return it->second;
+  }
 
-unsigned int hexToDec(const std::string& num) {
-  std::stringstream ss;
-  unsigned int ans = 0;
-  unsigned int t;
-  for (int i = 0; i < num.size(); i += 2) {
-    std::string tmp = num.substr(i, 2);
-    ss << std::dec << tmp;
-    ss >> t;
-    ans *= 256;
-    ans += t;
-    ss.clear();
+  void load() {
+    std::ifstream in(path_);
+    std::string peer;
+    Entry entry;
+    while (in >> peer >> entry.last_seen >> entry.rate >> entry.failures) {
+      if (parsePeer(peer, entry.address)) {
+        entries_[entry.address] = entry;
+      }
+    }
   }
-  return ans;
-}
 
-bool isEncodedNum(const std::string& encoded_value) {
-  if (encoded_value[0] != 'i') {
-    return false;
+  std::filesystem::path path_;
+  std::unordered_map<sockaddr_storage, Entry, PeerAddressHash,
+                     PeerAddressEqual>
+      entries_;
+};
+
+// How long the download loop runs the reactor between discovery steps, and
+// how many peers from the peer cache are dialled at startup.
+constexpr std::chrono::milliseconds kDiscoveryInterval{20};
+constexpr size_t kCachedPeers = 30;
+// Connection attempts in flight at once, and the number of handshaken peers
+// after which slower attempts are dropped and no new ones are started.
+constexpr size_t kMaxConnecting = 16;
+constexpr size_t kWantedPeers = 30;
+// How often the slowest peers are swapped for candidates, and their share
+// of the peers judged.
+constexpr std::chrono::seconds kChurnInterval{10};
+constexpr double kPeerTurnover = 0.1;
+// How long a peer that left waits before it is a candidate again, doubled
+// for every failed attempt in a row, and the failures after which it is
+// given up on.
+constexpr std::chrono::seconds kRedialDelay{30};
+constexpr uint32_t kMaxDialFailures = 4;
+// Block requests outstanding across all peers, in bytes.
+constexpr uint64_t kMaxOutstandingBytes = 16 << 20;
+// Needed pieces a peer can serve that are compared for rarity, counted from
+// the first needed one: enough to spread peers over rare pieces while
+// still finishing the file roughly in order.
+constexpr size_t kRarestWindow = 128;
+
+// Drives every peer connection of one download on a single reactor thread.
+// Peers are dialled concurrently as discovery finds them, over
+// peer_transport first and the other transport if that fails, up to
+// kWantedPeers; the rest wait as candidates. Peers are scored by the bytes
+// they deliver, and slow or snubbing ones make way for candidates; peers
+// that left become candidates again after a backoff. Each
+// unchoked peer is handed the rarest of the first needed pieces it has as
+// fast as its request pipeline drains (peers on the LAN first) and
+// verified pieces are written to the output file at their offset.
+class Download : public PeerConnection::Observer {
+ public:
+  // Fetches pieces into output_fd; piece i lands at i * piece_length -
+  // output_offset.
+  Download(const TorrentInfo& torrent, const std::vector<uint32_t>& pieces,
+           int output_fd, uint64_t output_offset, TrackerClient& tracker,
+           PeerExchange* pex, LocalDiscovery* lsd)
+      : torrent_(torrent),
+        remaining_(pieces.size()),
+        output_fd_(output_fd),
+        output_offset_(output_offset),
+        tracker_(tracker),
+        pex_(pex),
+        lsd_(lsd) {
+    tracker_.join();
+    unneeded_.fill();
+    for (uint32_t piece : pieces) {
+      unneeded_.reset(piece);
+    }
+    try {
+      utp_ = std::make_unique<UtpSocket>();
+      reactor_->watch(utp_->fd(), utp_.get());
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << "; using TCP only" << std::endl;
+      utp_.reset();
+    }
   }
-  if (encoded_value[encoded_value.size() - 1] != 'e') {
-    return false;
+
+  Download(const Download&) = delete;
+  Download& operator=(const Download&) = delete;
+
+  // Closes the connections first, so their uTP FINs still go out.
+  ~Download() override {
+    connections_.clear();
+    if (utp_ != nullptr) {
+      utp_->flush();
+      reactor_->remove(utp_->fd());
+    }
   }
-  return encoded_value.size() > 2;
-}
 
-bool isEncodedList(const std::string& encoded_value) {
-  return encoded_value[0] == 'l' &&
-         encoded_value[encoded_value.size() - 1] == 'e';
-}
+  // Queues a peer for dialling unless it is already queued or connected
+  // (e.g. it came from the peer cache and again from a tracker) or is
+  // backing off after it left.
+  void connect(const sockaddr_storage& peer) {
+    if (dialled_.contains(peer)) {
+      return;
+    }
+    auto backoff = backoff_.find(peer);
+    if (backoff != backoff_.end() &&
+        (backoff->second.failures >= kMaxDialFailures ||
+         std::chrono::steady_clock::now() < backoff->second.until)) {
+      return;
+    }
+    dialled_.insert(peer);
+    pending_.push_back({peer, peer_transport});
+    dial();
+  }
 
-bool isEncodedDict(const std::string& encoded_value) {
-  return encoded_value[0] == 'd' &&
-         encoded_value[encoded_value.size() - 1] == 'e';
-}
+  // Runs the reactor for up to timeout, gives up on attempts that are too
+  // slow, then hands idle peers their next piece and passes our connection
+  // set on to ut_pex peers.
+  void poll(std::chrono::milliseconds timeout) {
+    reactor_->poll(timeout);
+    refillBuckets();
+    expireAttempts();
+    churn();
+    schedule();
+    if (pex_ != nullptr) {
+      std::vector<sockaddr_storage> connected;
+      for (const auto& connection : connections_) {
+        if (connection->established()) {
+          connected.push_back(connection->address());
+        }
+      }
+      for (const auto& connection : connections_) {
+        if (connection->established()) {
+          auto message = pex_->update(connection->id(), connected);
+          if (!message.empty()) {
+            connection->send(std::move(message));
+          }
+        }
+      }
+    }
+    // Requests queued by schedule() and PEX updates leave in one batch
+    // per connection, uTP ones together in one sendmmsg.
+    for (const auto& connection : connections_) {
+      connection->flush();
+    }
+    if (utp_ != nullptr) {
+      utp_->tick();
+    }
+    // Closed connections are only destroyed here, outside their handlers.
+    std::erase_if(connections_, [&](const auto& connection) {
+      if (connection->state() != PeerConnection::State::kClosed) {
+        return false;
+      }
+      retire(*connection);
+      return true;
+    });
+    dial();
+  }
 
-json decodeBencodedString(const std::string& encoded_value, uint& index) {
-  size_t colon_index = encoded_value.find(':', index);
-  if (colon_index != std::string::npos) {
-    std::string number_string =
-        encoded_value.substr(index, colon_index - index);
-    int64_t number = std::atoll(number_string.c_str());
-    std::string str = encoded_value.substr(colon_index + 1, number);
-    index = colon_index + str.size() + 1;
-    return json(str);
-  } else {
-    throw std::runtime_error("Invalid encoded value: " + encoded_value);
+  bool done() const { return remaining_ == 0; }
+
+  // Waits for the output file writes still in flight.
+  void finishWrites() {
+    while (reactor_->pendingWrites() > 0) {
+      reactor_->poll(kDiscoveryInterval);
+    }
   }
-}
+  bool active() const { return !connections_.empty() || !pending_.empty(); }
 
-json decodeBencodedNum(const std::string& encoded_value, uint& index) {
-  uint last = encoded_value.find('e', index);
-  const std::string number_str =
-      encoded_value.substr(index + 1, last - index - 1);
-  index = last + 1;
-  const long long number = std::stoll(number_str);
-  return json(number);
-}
+  // Bytes and time per peer that completed the handshake, and the
+  // peers that did not.
+  std::vector<PeerTransfer> transfers() const {
+    auto result = transfers_;
+    for (const auto& connection : connections_) {
+      if (connection->established()) {
+        result.push_back(connection->transfer());
+      }
+    }
+    return result;
+  }
+  const std::vector<sockaddr_storage>& failed() const { return failed_; }
 
-json decodeBencodedList(const std::string& encoded_value, uint& index) {
-  json arr = json::array();
-  while (index < encoded_value.size() && encoded_value[index] != 'e') {
-    json ans;
-    if (encoded_value[index] == 'i') {
-      ans = decodeBencodedNum(encoded_value, index);
-    } else if (encoded_value[index] != 'l') {
-      ans = decodeBencodedString(encoded_value, index);
-    } else {
-      std::string encoded_substr = encoded_value.substr(index);
-      uint tmp_index = 1;
-      ans = decodeBencodedList(encoded_substr, tmp_index);
-      index += tmp_index;
-    }
-    arr.push_back(ans);
-  }
-  ++index;
-  return arr;
-}
-
-json decodeBencodedDict(const std::string& encoded_value, uint& index) {
-  json dict = json::object();
-  bool done = false;
-  json first_val;
-  json second_val;
-  while (index < encoded_value.size() && encoded_value[index] != 'e') {
-    if (encoded_value[index] == 'i') {
-      second_val = decodeBencodedNum(encoded_value, index);
-      dict[first_val] = second_val;
-      done = false;
-    } else if (encoded_value[index] == 'l') {
-      ++index;
-      second_val = decodeBencodedList(encoded_value, index);
-      json tmp = second_val;
-      auto got = tmp.dump();
-      dict[first_val] = second_val;
-      done = false;
-    } else if (encoded_value[index] == 'd') {
-      ++index;
-      second_val = decodeBencodedDict(encoded_value, index);
-      dict[first_val] = second_val;
-      done = false;
-    } else {
-      if (done) {
-        second_val = decodeBencodedString(encoded_value, index);
-        dict[first_val] = second_val;
-        done = false;
-      } else {
-        first_val = decodeBencodedString(encoded_value, index);
-        done = true;
+  // Drops connections to ourselves and the slower of two connections to
+  // the same peer (say over IPv4 and IPv6).
+  void onHandshake(PeerConnection& connection) override {
+    if (connection.peerId() == kPeerId) {
+      connection.abandon();
+      return;
+    }
+    for (const auto& other : connections_) {
+      if (other.get() != &connection && !other->connecting() &&
+          other->state() != PeerConnection::State::kClosed &&
+          other->peerId() == connection.peerId()) {
+        connection.abandon();
+        return;
       }
     }
   }
-  ++index;
-  return dict;
-}
 
-json decodeBencodedValue(const std::string& encoded_value) {
-  uint index = 1;
-  if (std::isdigit(encoded_value[0])) {
-    --index;
-    return decodeBencodedString(encoded_value, index);
-  } else if (isEncodedNum(encoded_value)) {
-    index = 0;
-    return decodeBencodedNum(encoded_value, index);
-  } else if (isEncodedList(encoded_value)) {
-    return decodeBencodedList(encoded_value, index);
-  } else if (isEncodedDict(encoded_value)) {
-    return decodeBencodedDict(encoded_value, index);
-  } else {
-    throw std::runtime_error("Unhandled encoded value: " + encoded_value);
-  }
-}
-
-std::string bencodeTheString(const json& info) {
-  std::string ans;
-  if (info.is_object()) {
-    std::map<std::string, json> data = info;
-    ans += 'd';
-    for (auto& [key, value] : data) {
-      ans += bencodeTheString(key);
-      ans += bencodeTheString(value);
-    }
-    ans += 'e';
-  } else if (info.is_array()) {
-    std::vector<json> data = info;
-    ans += 'l';
-    for (auto& item : data) {
-      ans += bencodeTheString(item);
-    }
-    ans += 'e';
-  } else if (info.is_number()) {
-    long long data = info;
-    ans += 'i';
-    ans += std::to_string(data);
-    ans += 'e';
-  } else if (info.is_string()) {
-    std::string data = info;
-    ans += std::to_string(data.size());
-    ans += ':';
-    ans += data;
-  } else {
-    throw std::runtime_error("JSON type not handled");
+  void onReady(PeerConnection&) override {}
+
+  // Announces report what actually arrived, including blocks of pieces
+  // that are later dropped or fail their hash check.
+  void onBlock(PeerConnection&, size_t bytes) override {
+    tracker_.addDownloaded(bytes);
   }
-  return ans;
-}
 
-void stringToSHA1(const std::string& data,
-                  std::array<unsigned char, SHA_DIGEST_LENGTH>& hash) {
-  SHA1(reinterpret_cast<const unsigned char*>(data.c_str()), data.size(),
-       hash.data());
-}
+  void onPiece(PeerConnection& connection, uint32_t piece,
+               std::vector<unsigned char>& data) override {
+    std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
+    SHA1(data.data(), data.size(), hash.data());
+    if (std::memcmp(hash.data(),
+                    torrent_.piece_hashes.data() + piece * SHA_DIGEST_LENGTH,
+                    SHA_DIGEST_LENGTH) != 0) {
+      std::cerr << "Piece " << piece << " failed its hash check" << std::endl;
+      release(piece);
+      return;
+    }
+    uint64_t offset = piece * torrent_.piece_length - output_offset_;
+    size_t size = data.size();
+    // The buffer goes along with the write, which may finish later.
+    reactor_->write(output_fd_, std::move(data), offset);
+    connection.transfer().bytes += size;
+    tracker_.pieceVerified(size);
+    --remaining_;
+  }
+
+  // Pieces a peer choked us on or rejected go to other peers rather than
+  // waiting for it.
+  void onDropped(PeerConnection&,
+                 const std::vector<uint32_t>& pieces) override {
+    for (uint32_t piece : pieces) {
+      release(piece);
+    }
+  }
+
+  void onClosed(PeerConnection& connection) override {
+    for (uint32_t piece : connection.pieces()) {
+      release(piece);
+    }
+    availability_.remove(connection.availablePieces());
+  }
+
+  void onPieces(PeerConnection& connection,
+                const PieceSet& previous) override {
+    availability_.remove(previous);
+    availability_.add(connection.availablePieces());
+  }
 
-void getPiecesHashes(const json& info, std::vector<std::string>& res) {
-  std::string pieces_string = info["pieces"];
-  std::vector<std::string> pieces_hashes;
-  for (uint64_t i = 0; i < pieces_string.size(); i += 20) {
-    pieces_hashes.push_back(pieces_string.substr(i, 20));
+  void onHave(PeerConnection& connection, uint32_t piece,
+              bool has) override {
+    availability_.update(connection.availablePieces(), piece, has);
   }
-  std::stringstream ss;
-  for (const auto& hash : pieces_hashes) {
-    ss.str("");
-    for (unsigned char c : hash) {
-      ss << std::hex << std::setfill('0') << std::setw(2)
-         << static_cast<int>(c);
+
+ private:
+  // Starts queued attempts while fewer than kMaxConnecting are in flight
+  // and we are short of kWantedPeers. Address families alternate, IPv6
+  // first, so that one unreachable family cannot hold up the other (the
+  // address interleaving of Happy Eyeballs, RFC 8305).
+  void dial() {
+    size_t connecting = 0;
+    size_t connected = 0;
+    for (const auto& connection : connections_) {
+      if (connection->state() == PeerConnection::State::kClosed) {
+        continue;
+      }
+      ++(connection->connecting() ? connecting : connected);
     }
-    if (ss.str().length() != 40) {
-      throw std::runtime_error("Wrong piece hash length: " + ss.str());
+    while (!pending_.empty() && connecting < kMaxConnecting &&
+           connected < kWantedPeers) {
+      auto it = std::find_if(pending_.begin(), pending_.end(),
+                             [&](const Attempt& attempt) {
+                               return attempt.peer.ss_family != last_family_;
+                             });
+      if (it == pending_.end()) {
+        it = pending_.begin();
+      }
+      Attempt attempt = *it;
+      pending_.erase(it);
+      last_family_ = attempt.peer.ss_family;
+      if (utp_ == nullptr) {
+        attempt.kind = Transport::Kind::kTcp;
+      }
+      connections_.push_back(std::make_unique<PeerConnection>(
+          *reactor_, *this, torrent_, pex_, budget_, throttle_, attempt.peer,
+          attempt.kind, utp_.get()));
+      connections_.back()->start();
+      if (connections_.back()->state() != PeerConnection::State::kClosed) {
+        ++connecting;
+      }
     }
-    res.push_back(ss.str());
   }
-}
 
-std::vector<std::string> extractInfo(const std::string& buffer) {
-  std::vector<std::string> res;
-  std::array<unsigned char, SHA_DIGEST_LENGTH> info_hash{};
-  auto torrent = decodeBencodedValue(buffer);
-  std::string announce = torrent["announce"];
-  res.push_back("Tracker URL: " + announce);
-  auto info = torrent["info"];
-  std::string length = std::to_string(info["length"].template get<int>());
-  res.push_back("Length: " + length);
-  stringToSHA1(bencodeTheString(info), info_hash);
-  std::stringstream ss;
-  for (auto c : info_hash) {
-    ss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(c);
+  // Tops up the buckets of every level, once per round rather than per
+  // transfer, and lets connections send what the limits held back.
+  void refillBuckets() {
+    auto now = std::chrono::steady_clock::now();
+    global_download_bucket.refill(rate_limits.download, now);
+    global_upload_bucket.refill(rate_limits.upload, now);
+    throttle_.download.refill(rate_limits.torrent_download, now);
+    throttle_.upload.refill(rate_limits.torrent_upload, now);
+    for (const auto& connection : connections_) {
+      connection->refillBuckets(now);
+      connection->resumeRequests();
+    }
   }
-  res.push_back("Info Hash: " + ss.str());
-  std::string piece_length =
-      std::to_string(info["piece length"].template get<int>());
-  res.push_back("Piece Length: " + piece_length);
-  res.emplace_back("Pieces Hashes:");
-  getPiecesHashes(info, res);
-  return res;
-}
 
-std::vector<std::string> parseTorrentFile(const std::string& filename) {
-  std::vector<std::string> res;
-  std::fstream fs;
-  fs.open(filename, std::ios::in | std::ios::binary);
-  if (!fs.is_open()) {
-    throw std::runtime_error("Cannot open file: " + filename);
+  // Fails attempts that did not finish the handshake within
+  // kConnectTimeout. Once kWantedPeers peers did, the attempts still in
+  // flight are only slower, so they are dropped and queued again in case
+  // some of the fast peers go away.
+  void expireAttempts() {
+    auto now = std::chrono::steady_clock::now();
+    size_t connected = 0;
+    for (const auto& connection : connections_) {
+      if (!connection->connecting() &&
+          connection->state() != PeerConnection::State::kClosed) {
+        ++connected;
+      }
+    }
+    for (const auto& connection : connections_) {
+      if (!connection->connecting()) {
+        continue;
+      }
+      if (connected >= kWantedPeers) {
+        pending_.push_back({connection->address(), connection->kind()});
+        connection->abandon();
+      } else if (now - connection->startedAt() > kConnectTimeout) {
+        connection->fail("Connection timed out");
+      }
+    }
   }
-  std::istreambuf_iterator<char> it{fs}, end;
-  std::string buffer(it, end);
-  res = extractInfo(buffer);
-  return res;
-}
 
-json openTorrentFile(const std::string& filename) {
-  std::vector<std::string> res;
-  std::fstream fs;
-  fs.open(filename, std::ios::in | std::ios::binary);
-  if (!fs.is_open()) {
-    throw std::runtime_error("Cannot open file: " + filename);
+  // Every kChurnInterval: queues peers whose backoff is over again, fails
+  // peers that leave requests unanswered, then, if every slot is taken and
+  // candidates are waiting, drops the
+  // kPeerTurnover share of peers (at least one) that delivered least over
+  // the interval, so candidates get their slots. Only peers that were
+  // around for the whole interval are judged. Candidates that turn out
+  // slower go the same way, so the set converges on the fastest peers.
+  void churn() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_churn_ < kChurnInterval) {
+      return;
+    }
+    for (const auto& [peer, backoff] : backoff_) {
+      if (backoff.failures < kMaxDialFailures && now >= backoff.until &&
+          dialled_.insert(peer).second) {
+        pending_.push_back({peer, peer_transport});
+      }
+    }
+    std::vector<std::pair<uint64_t, PeerConnection*>> judged;
+    size_t connected = 0;
+    for (const auto& connection : connections_) {
+      if (connection->connecting() ||
+          connection->state() == PeerConnection::State::kClosed) {
+        continue;
+      }
+      uint64_t delivered = connection->takeDelivered();
+      if (connection->snubbed(now)) {
+        connection->fail("Peer stopped sending blocks");
+        continue;
+      }
+      ++connected;
+      if (connection->startedAt() < last_churn_) {
+        judged.emplace_back(delivered, connection.get());
+      }
+    }
+    last_churn_ = now;
+    if (pending_.empty() || connected < kWantedPeers) {
+      return;
+    }
+    size_t drop = std::min({std::max<size_t>(judged.size() * kPeerTurnover, 1),
+                            judged.size(), pending_.size()});
+    std::partial_sort(judged.begin(), judged.begin() + drop, judged.end());
+    for (size_t i = 0; i < drop; ++i) {
+      judged[i].second->abandon();
+    }
   }
-  std::istreambuf_iterator<char> it{fs}, end;
-  std::string buffer(it, end);
-  auto torrent = decodeBencodedValue(buffer);
-  fs.close();
-  return torrent;
-}
 
-std::vector<std::string> getAns(const std::string& peers) {
-  class ip {
-   public:
-    std::vector<uint> nums;
-    std::string get_str() {
-      std::string ans;
-      for (size_t i = 0; i < 4; ++i) {
-        ans += std::to_string(nums[i]);
-        if (i < 3) {
-          ans += '.';
-        } else {
-          ans += ':';
+  // Gives every peer with room in its pipeline the needed pieces it
+  // suggested, then the rarest of the first kRarestWindow needed pieces it
+  // can serve, serving peers on the LAN before the others.
+  void schedule() {
+    first_needed_ = unneeded_.nextClear(first_needed_);
+    if (first_needed_ == torrent_.piece_count) {
+      return;
+    }
+    std::vector<PeerConnection*> idle;
+    for (const auto& connection : connections_) {
+      if (connection->wantsPiece()) {
+        idle.push_back(connection.get());
+      }
+    }
+    std::stable_partition(idle.begin(), idle.end(), [&](const auto* c) {
+      return isLanPeer(c->address()) ||
+             (lsd_ != nullptr && lsd_->discovered(c->address()));
+    });
+    for (auto* connection : idle) {
+      while (connection->wantsPiece()) {
+        size_t piece = torrent_.piece_count;
+        for (uint32_t suggested : connection->suggestions()) {
+          if (!unneeded_.test(suggested) && connection->canFetch(suggested)) {
+            piece = suggested;
+            break;
+          }
+        }
+        if (piece == torrent_.piece_count) {
+          piece = rarestPiece(*connection);
         }
+        if (piece == torrent_.piece_count) {
+          break;
+        }
+        unneeded_.set(piece);
+        connection->download(piece);
       }
-      ans += std::to_string(nums[4] * 256 + nums[5]);
-      return ans;
     }
-  };
-  ip ip_addr;
-  std::vector<std::string> ans;
-  for (size_t i = 0; i < peers.size(); i += 6) {
-    std::string tmp = peers.substr(i, 6);
-    ip_addr.nums.clear();
-    for (const auto& j : tmp) {
-      ip_addr.nums.push_back(getNum(j));
+  }
+
+  // The rarest among the peers of the first kRarestWindow needed pieces
+  // connection can fetch, or piece_count if it can fetch none.
+  size_t rarestPiece(const PeerConnection& connection) const {
+    const PieceSet& pieces = connection.availablePieces();
+    size_t best = torrent_.piece_count;
+    uint32_t best_count = 0;
+    size_t candidates = 0;
+    for (size_t p = pieces.nextAndNot(unneeded_, first_needed_);
+         p < torrent_.piece_count && candidates < kRarestWindow;
+         p = pieces.nextAndNot(unneeded_, p + 1)) {
+      if (!connection.canFetch(p)) {
+        continue;
+      }
+      ++candidates;
+      uint32_t count = availability_[p];
+      if (best == torrent_.piece_count || count < best_count) {
+        best = p;
+        best_count = count;
+        if (count <= 1) {
+          break;
+        }
+      }
     }
-    ans.push_back(ip_addr.get_str());
+    return best;
   }
-  return ans;
-}
 
-std::vector<std::string> sendRequest(const std::string& filename) {
-  CURL* curl = curl_easy_init();
-  std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
-  if (!curl) {
-    std::cerr << "Failed to initialize cURL" << std::endl;
-    return {};
-  }
-  auto torrent = openTorrentFile(filename);
-  std::string url = torrent["announce"];
-  auto info = torrent["info"];
-  std::string bencoded_info = bencodeTheString(info);
-  std::string peer_id = "00112233445566778899";
-  size_t port = 6881;
-  size_t uploaded = 0;
-  size_t downloaded = 0;
-  size_t left = std::stoul(std::to_string(info["length"].template get<int>()));
-  size_t compact = 1;
-  std::string response;
-  url += "?info_hash=";
-  SHA1(reinterpret_cast<const unsigned char*>(bencoded_info.c_str()),
-       bencoded_info.size(), hash.data());
-  char* encoded_info_hash = curl_easy_escape(
-      curl, reinterpret_cast<const char*>(hash.data()), SHA_DIGEST_LENGTH);
-  url += std::string(encoded_info_hash);
-  url += "&peer_id=";
-  url += peer_id;
-  url += "&port=";
-  url += std::to_string(port);
-  url += "&uploaded=";
-  url += std::to_string(uploaded);
-  url += "&downloaded=";
-  url += std::to_string(downloaded);
-  url += "&left=";
-  url += std::to_string(left);
-  url += "&compact=";
-  url += std::to_string(compact);
-  auto write_callback =
-      +[](char* contents, size_t size, size_t nmemb, void* userp) -> size_t {
-    ((std::string*)userp)->append((char*)contents, size * nmemb);
-    return size * nmemb;
-  };
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-  CURLcode status = curl_easy_perform(curl);
-  if (status != CURLE_OK) {
-    std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(status)
-              << std::endl;
+  // Makes piece needed again after its download failed or was dropped.
+  void release(uint32_t piece) {
+    unneeded_.reset(piece);
+    first_needed_ = std::min<size_t>(first_needed_, piece);
   }
-  curl_free(encoded_info_hash);
-  curl_easy_cleanup(curl);
 
-  auto data = decodeBencodedValue(response);
-  std::string peers = data.at("peers").template get<std::string>();
-  getNum(peers[0]);
-  return getAns(peers);
-}
+  // A peer that the first transport could not reach is tried once more
+  // over the other one before it counts as failed. Peers that left after
+  // the handshake back off, as failures if they delivered nothing, unless
+  // we dropped them ourselves (churn, duplicates, ourselves).
+  void retire(PeerConnection& connection) {
+    if (connection.established()) {
+      transfers_.push_back(connection.transfer());
+      backOff(connection.address(),
+              !connection.abandoned() && connection.transfer().bytes == 0);
+    } else if (connection.abandoned()) {
+      return;
+    } else if (connection.kind() == peer_transport && utp_ != nullptr) {
+      pending_.push_back({connection.address(),
+                          connection.kind() == Transport::Kind::kTcp
+                              ? Transport::Kind::kUtp
+                              : Transport::Kind::kTcp});
+    } else {
+      failed_.push_back(connection.address());
+      backOff(connection.address(), true);
+    }
+  }
 
-std::string getInfoHash(const std::string& filename) {
-  std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
+  // Makes a peer that left a candidate again after kRedialDelay, doubled
+  // for each failure in a row.
+  void backOff(const sockaddr_storage& peer, bool failed) {
+    dialled_.erase(peer);
+    Backoff& backoff = backoff_[peer];
+    backoff.failures = failed ? backoff.failures + 1 : 0;
+    backoff.until = std::chrono::steady_clock::now() +
+                    kRedialDelay * (1 << std::min(backoff.failures, 8u));
+  }
 
-  auto torrent = openTorrentFile(filename);
-  auto info = torrent["info"];
-  std::string bencoded_info = bencodeTheString(info);
-  SHA1(reinterpret_cast<const unsigned char*>(bencoded_info.c_str()),
-       bencoded_info.size(), hash.data());
-  std::string raw_hash;
-  std::copy(hash.begin(), hash.end(),
-            std::back_insert_iterator<std::string>(raw_hash));
-  return raw_hash;
-}
+  struct Attempt {
+    sockaddr_storage peer;
+    Transport::Kind kind;
+  };
 
-void insertData(const std::string& part, std::vector<unsigned char>& msg) {
-  for (const auto& i : part) {
-    msg.push_back(i);
-  }
+  struct Backoff {
+    uint32_t failures = 0;
+    std::chrono::steady_clock::time_point until;
+  };
+
+  const TorrentInfo& torrent_;
+  // Pieces that are verified, assigned to a peer or not wanted at all; the
+  // rest are needed. Every piece before first_needed_ is in it.
+  PieceSet unneeded_{torrent_.piece_count};
+  size_t first_needed_ = 0;
+  // How many connected peers have each piece.
+  PieceAvailability availability_{torrent_.piece_count};
+  size_t remaining_;
+  int output_fd_;
+  uint64_t output_offset_;
+  TrackerClient& tracker_;
+  PeerExchange* pex_;
+  LocalDiscovery* lsd_;
+  std::unique_ptr<Reactor> reactor_ = Reactor::create(io_backend);
+  // Shared by every uTP connection; null if it could not be bound.
+  std::unique_ptr<UtpSocket> utp_;
+  RequestBudget budget_{kMaxOutstandingBytes};
+  Throttle throttle_;
+  std::chrono::steady_clock::time_point last_churn_ =
+      std::chrono::steady_clock::now();
+  // Peers queued, connecting or connected.
+  PeerAddressSet dialled_;
+  std::unordered_map<sockaddr_storage, Backoff, PeerAddressHash,
+                     PeerAddressEqual>
+      backoff_;
+  std::deque<Attempt> pending_;
+  sa_family_t last_family_ = AF_INET;
+  std::vector<std::unique_ptr<PeerConnection>> connections_;
+  std::vector<PeerTransfer> transfers_;
+  std::vector<sockaddr_storage> failed_;
+};
+
+// Private torrents (BEP 27) must only get peers from their trackers, so
+// neither the DHT nor peer exchange is used for them.
+bool isPrivate(const json& torrent) {
+  const auto& info = torrent["info"];
+  return info.contains("private") && info["private"].is_number() &&
+         info["private"].get<long long>() == 1;
 }
 
-std::pair<int, std::string> establishConnection(const std::string& filename,
-                                                const std::string& peer) {
-  int client_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (client_socket == -1) {
-    std::cerr << "Error creating socket" << std::endl;
-    return std::make_pair(-1, "error");
+// Joins the DHT and starts looking for peers of the torrent, seeding the
+// routing table with the torrent's "nodes" hints.
+std::unique_ptr<Dht> startDht(const json& torrent,
+                              const std::string& info_hash) {
+  if (isPrivate(torrent)) {
+    return nullptr;
   }
-  uint delim = peer.find(':');
-  sockaddr_in server_address{};
-  server_address.sin_family = AF_INET;
-  server_address.sin_port = htons(std::stoi(peer.substr(delim + 1)));
-  if (inet_pton(AF_INET, peer.substr(0, delim).c_str(),
-                &(server_address.sin_addr)) <= 0) {
-    std::cerr << "Error converting IP address" << std::endl;
-    close(client_socket);
-    return std::make_pair(-1, "error");
+  DhtConfig config;
+  std::filesystem::path dir = cacheDirectory();
+  if (!dir.empty()) {
+    config.state_path = dir / "dht.dat";
   }
-  if (connect(client_socket,
-              reinterpret_cast<struct sockaddr*>(&server_address),
-              sizeof(server_address)) == -1) {
-    std::cerr << "Error connecting to the server" << std::endl;
-    close(client_socket);
-    return std::make_pair(-1, "error");
+  std::unique_ptr<Dht> dht;
+  try {
+    dht = std::make_unique<Dht>(config);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return nullptr;
   }
-  std::string info_hash = getInfoHash(filename);
-  unsigned char length = 19;
-  std::string protocol = "BitTorrent protocol";
-  std::array<unsigned char, 8> reserved{};
-  reserved.fill(0);
-  std::string peer_id = "00112233445566778899";
-  std::vector<unsigned char> msg;
-  msg.push_back(length);
-  insertData(protocol, msg);
-  for (const auto& i : reserved) {
-    msg.push_back(i);
-  }
-  insertData(info_hash, msg);
-  insertData(peer_id, msg);
-  if (send(client_socket, msg.data(), msg.size(), 0) == -1) {
-    std::cerr << "Error sending data" << std::endl;
+  if (torrent.contains("nodes") && torrent["nodes"].is_array()) {
+    for (const auto& node : torrent["nodes"]) {
+      if (node.is_array() && node.size() == 2 && node[0].is_string() &&
+          node[1].is_number()) {
+        dht->addNode(node[0].get<std::string>(),
+                     static_cast<uint16_t>(node[1].get<long long>()));
+      }
+    }
   }
-  char buffer[msg.size()];
-  ssize_t bytesRead = recv(client_socket, buffer, sizeof(buffer), 0);
-  if (bytesRead == -1) {
-    std::cerr << "Error receiving data" << std::endl;
-  } else {
-    buffer[bytesRead] = '\0';
+  // We do not accept incoming connections, so nothing is announced.
+  dht->getPeers(info_hash);
+  return dht;
+}
+
+// Starts listening for peers announcing the torrent on the LAN (BEP 14).
+// Private torrents stay off the LAN like they stay off the DHT.
+std::unique_ptr<LocalDiscovery> startLocalDiscovery(
+    const json& torrent, const std::string& info_hash) {
+  if (isPrivate(torrent)) {
+    return nullptr;
   }
-  std::string recv_peer_id(buffer + 48, buffer + 68);
-  std::stringstream ss;
-  for (unsigned char c : recv_peer_id) {
-    ss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(c);
+  try {
+    return std::make_unique<LocalDiscovery>(info_hash);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return nullptr;
   }
-  std::string str_peer_id;
-  ss >> str_peer_id;
-
-  return std::make_pair(client_socket, str_peer_id);
 }
 
-struct interest_unchoke_msg {
-  uint32_t length;
-  uint8_t id;
-} __attribute__((packed));
-
-struct bitfield_msg {
-  uint32_t length;
-  uint8_t id;
-  std::vector<unsigned char> payload;
-};
-
-struct request_msg {
-  uint32_t length;
-  uint8_t id;
-  uint32_t index;
-  uint32_t begin;
-  uint32_t block_length;
-} __attribute__((packed));
-
-struct piece_msg {
-  uint32_t length;
-  uint8_t id;
-  uint32_t index;
-  uint32_t begin;
-  std::vector<unsigned char> payload;
-};
+// True while some discovery source may still produce peers.
+bool discovering(TrackerClient& tracker, Dht* dht) {
+  return tracker.busy() ||
+         (dht != nullptr && dht->searching(tracker.infoHash()));
+}
 
+// One step of peer discovery: collects announce responses (re-announcing
+// when due, waiting up to tracker_wait for them), DHT lookup results, LAN
+// announcements and peers learned through PEX, and hands every new peer to
+// the download.
+void discoverPeers(TrackerClient& tracker, Download& download, Dht* dht,
+                   LocalDiscovery* lsd, PeerExchange* pex,
+                   std::chrono::milliseconds tracker_wait) {
+  if (tracker.announceDue()) {
+    tracker.startAnnounce();
+  }
+  if (tracker.busy()) {
+    for (const auto& peer : tracker.poll(tracker_wait)) {
+      download.connect(peer);
+    }
+  }
+  if (dht != nullptr) {
+    for (const auto& peer : dht->takePeers(tracker.infoHash())) {
+      download.connect(peer);
+    }
+  }
+  if (lsd != nullptr) {
+    for (const auto& peer : lsd->poll()) {
+      download.connect(peer);
+    }
+  }
+  if (pex != nullptr) {
+    for (const auto& peer : pex->takeAdded()) {
+      download.connect(peer);
+    }
+  }
+}
 
-std::pair<int, std::vector<unsigned char>> recvMsg(const int& socket) {
-  auto* len_adr = new uint32_t;
-  ssize_t len_red = recv(socket, len_adr, 4, 0);
-  uint32_t length = ntohl(*len_adr);
-  delete (len_adr);
-  if (len_red == 0) {
-    throw std::runtime_error("Received unexpected EOF");
+// Downloads the given pieces of a torrent into output_fd (see Download) from
+// every peer that discovery turns up, all driven from this thread. Returns
+// false if some piece could not be fetched.
+bool downloadPieces(const json& torrent, const TorrentInfo& info,
+                    const std::vector<uint32_t>& pieces, int output_fd,
+                    uint64_t output_offset) {
+  TrackerClient tracker(torrent);
+  std::unique_ptr<PeerExchange> pex;
+  if (!isPrivate(torrent)) {
+    pex = std::make_unique<PeerExchange>();
   }
-  uint8_t id;
-  recv(socket, &id, 1, 0);
-  std::vector<unsigned char> payload(length - 1);
-  size_t done = 0;
-  while (done < payload.size()) {
-    ssize_t payload_red =
-        recv(socket, payload.data() + done, payload.size() - done, 0);
-    if (payload_red < 0) {
-      throw std::runtime_error("Error receiving payload");
+  PeerCache cache(tracker.infoHash());
+  auto dht = startDht(torrent, tracker.infoHash());
+  auto lsd = startLocalDiscovery(torrent, tracker.infoHash());
+  Download download(info, pieces, output_fd, output_offset, tracker,
+                    pex.get(), lsd.get());
+  // Peers that served us well last time are dialled alongside the announce.
+  for (const auto& peer : cache.best(kCachedPeers)) {
+    download.connect(peer);
+  }
+  tracker.startAnnounce("started");
+  while (!download.done()) {
+    // Tracker responses are only seen between reactor polls, so with no
+    // peer to talk to yet the wait happens on the trackers instead.
+    bool wait_for_tracker = !download.active() && tracker.busy();
+    discoverPeers(tracker, download, dht.get(), lsd.get(), pex.get(),
+                  wait_for_tracker ? kDiscoveryInterval
+                                   : std::chrono::milliseconds(0));
+    if (!download.active() && !discovering(tracker, dht.get())) {
+      std::cerr << "No peers available" << std::endl;
+      break;
     }
-    done += payload_red;
+    download.poll(wait_for_tracker ? std::chrono::milliseconds(0)
+                                   : kDiscoveryInterval);
   }
-  if (id > 8) {
-    throw std::runtime_error("Invalid message id");
+  download.finishWrites();
+  for (const auto& transfer : download.transfers()) {
+    cache.recordTransfer(transfer.address, transfer.bytes,
+                         transfer.time.count());
   }
-  return {id, payload};
+  for (const auto& peer : download.failed()) {
+    cache.recordFailure(peer);
+  }
+  cache.save();
+  return download.done();
 }
 
-size_t sendMsg(const int& socket, void* msg_pointer, size_t size) {
-  std::vector<unsigned char> msg;
-  std::span<unsigned char> span(reinterpret_cast<unsigned char*>(msg_pointer),
-                                size);
-  std::copy(span.begin(), span.end(),
-            std::back_insert_iterator<std::vector<unsigned char>>(msg));
-  ssize_t sent = send(socket, msg.data(), msg.size(), 0);
-  if (sent < 0 || sent < msg.size()) {
-    throw std::runtime_error("Error sending message");
+// Opens (and truncates) a download's output file.
+int openOutputFile(const std::string& address) {
+  int fd = open(address.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open output file: " + address);
   }
-  return sent;
+  return fd;
 }
 
-struct block {
-  uint32_t index_id;
-  uint32_t index;
-  uint32_t begin;
-  uint32_t length;
-};
+bool downloadFile(const std::string& file, const std::string& address) {
+  auto torrent = openTorrentFile(file);
+  TorrentInfo info = loadTorrentInfo(torrent);
+  std::vector<uint32_t> pieces(info.piece_count);
+  std::iota(pieces.begin(), pieces.end(), 0);
+  int fd = openOutputFile(address);
+  bool ok = downloadPieces(torrent, info, pieces, fd, 0);
+  close(fd);
+  return ok;
+}
 
-std::pair<uint32_t, std::string> saveBlock(std::vector<unsigned char> payload,
-                                           block Block,
-                                           const std::string& address) {
-  std::string output_name =
-      address + '_' + std::to_string(Block.index_id) + ".block";
-  std::ofstream outfile(output_name, std::ios::out | std::ios::binary);
-
-  uint32_t block_index;
-  std::span<unsigned char> span(payload.data(), 4);
-  std::copy(span.begin(), span.end(),
-            reinterpret_cast<unsigned char*>(&block_index));
-  block_index = ntohl(block_index);
-  if (Block.index != block_index) {
-    std::cout << "Different indexes\n";
-  }
-
-  uint32_t block_offset;
-  span = std::span<unsigned char>(payload.data() + 4, 4);
-  std::copy(span.begin(), span.end(),
-            reinterpret_cast<unsigned char*>(&block_offset));
-  block_offset = ntohl(block_offset);
-  if (Block.begin != block_offset) {
-    std::cout << "Different offset\n";
-  }
-
-  std::vector<unsigned char> buf;
-  size_t blockSize = payload.size() - 8;
-  span = std::span<unsigned char>(payload.data() + 8, blockSize);
-  std::copy(span.begin(), span.end(),
-            std::back_insert_iterator<std::vector<unsigned char>>(buf));
-  outfile.write(reinterpret_cast<char*>(buf.data()), blockSize);
-  outfile.close();
-  return {block_offset, output_name};
-}
-
-
-std::string calculateSHA1Hash(const std::string& filename) {
-  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-  EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
-  FILE* file = fopen(filename.c_str(), "rb");
-  char buffer[1024];
-  while (true) {
-    size_t bytes_read = fread(buffer, 1, 1024, file);
-    if (bytes_read == 0) {
-      break;
-    }
-    EVP_DigestUpdate(ctx, buffer, bytes_read);
-  }
-  fclose(file);
-  unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len = 0;
-  EVP_DigestFinal_ex(ctx, hash, &hash_len);
-  std::stringstream ss;
-  for (int i = 0; i < 20; ++i) {
-    ss << std::hex << std::setfill('0') << std::setw(2) << (uint32_t)hash[i];
-  }
-  EVP_MD_CTX_free(ctx);
-  return ss.str();
-}
-
-bool downloadPiece(const int& socket, const std::string& filename,
-                   const std::string& address, const uint32_t& piece) {
-  auto res = parseTorrentFile(filename);
-  size_t file_length = std::stoul(res[1].substr(8));
-  size_t piece_length = std::stoul(res[3].substr(14));
-  auto piece_hash = res[5 + piece];
-  uint32_t block_size = 16384;
-  std::queue<block> waiting;
-  uint32_t tmp = piece_length;
-  if (file_length / (piece + 1) < piece_length) {
-    tmp = file_length - piece * piece_length;
-  }
-  uint32_t ind = 0;
-  while (tmp > 0) {
-    waiting.push(
-        block{ind, piece, ind * block_size, std::min(tmp, block_size)});
-    ++ind;
-    if (tmp < block_size) {
-      break;
-    }
-    tmp -= block_size;
-  }
-  std::queue<block> curr;
-  std::vector<std::pair<std::string, uint32_t>> done;
-  while (!waiting.empty() || !curr.empty()) {
-    while (curr.size() < 5 && !waiting.empty()) {
-      auto top = waiting.front();
-      waiting.pop();
-      curr.push(top);
-    }
-    block curr_block = curr.front();
-    request_msg req_msg{13, 6, htonl(curr_block.index), htonl(curr_block.begin),
-                        htonl(curr_block.length)};
-    sendMsg(socket, (void*)&req_msg, sizeof(request_msg));
-    auto [id, payload] = recvMsg(socket);
-    auto [offset, name] = saveBlock(payload, curr_block, address);
-    done.emplace_back(name, offset);
-    curr.pop();
-  }
-  std::sort(done.begin(), done.end(), [](auto p1, auto p2) {
-    auto [n1, o1] = p1;
-    auto [n2, o2] = p2;
-    return o1 < o2;
-  });
-  std::ofstream outfile(address, std::ios::out | std::ios::binary);
-  for (auto [name, offset] : done) {
-    std::ifstream in(name, std::ios::out | std::ios::binary);
-    std::filesystem::path path(name);
-    auto file_size = std::filesystem::file_size(path);
-    std::vector<unsigned char> buf(file_size);
-    in.read(reinterpret_cast<char*>(buf.data()), file_size);
-    in.close();
-    outfile.write(reinterpret_cast<char*>(buf.data()), file_size);
-  }
-  outfile.close();
-  auto file_hash = calculateSHA1Hash(address);
-  std::cout << piece_hash << " piece hash\n";
-  std::cout << file_hash << " file hash\n";
-  if (piece_hash != file_hash) {
-    return false;
+bool downloadSinglePiece(const std::string& file, const std::string& address,
+                         uint32_t piece) {
+  auto torrent = openTorrentFile(file);
+  TorrentInfo info = loadTorrentInfo(torrent);
+  if (piece >= info.piece_count) {
+    throw std::runtime_error("No such piece: " + std::to_string(piece));
   }
-  std::cout << piece << " downloaded correctly\n";
-  return true;
+  int fd = openOutputFile(address);
+  bool ok =
+      downloadPieces(torrent, info, {piece}, fd, piece * info.piece_length);
+  close(fd);
+  return ok;
 }
 
-void getAvailablePieces(std::vector<std::vector<int>>& available_peers, const int& socket) {
-//  std::cout << "payload of socket " << socket << '\n';
-  auto [id, payload] = recvMsg(socket);
-  size_t ix=0;
-  for (auto byte: payload) {
-    for (int i=0; i < 8; i++) {
-      if (byte & (128 >> i)) {
-        available_peers[ix].push_back(socket);
-      }
-      ++ix;
-    }
+// Parses all of text as a number; false if it is not one or anything is
+// left over (so "20e6" is rejected rather than read as 20).
+template <typename T>
+bool parseNumber(std::string_view text, T& value) {
+  const char* end = text.data() + text.size();
+  auto [parsed, ec] = std::from_chars(text.data(), end, value);
+  return !text.empty() && ec == std::errc() && parsed == end;
+}
+
+// Reports an option value that does not parse; returns false.
+bool invalidValue(std::string_view option, std::string_view value) {
+  std::cerr << "Invalid value for " << option << ": " << value << std::endl;
+  return false;
+}
+
+// The limit a rate limit option sets, in bytes per second, or null for an
+// option that is not one.
+std::atomic<uint64_t>* rateLimitFor(const std::string& option) {
+  if (option == "--download-limit") {
+    return &rate_limits.download;
   }
-  interest_unchoke_msg interest_msg{1, 2};
-  sendMsg(socket, (void*)&interest_msg, sizeof(interest_msg));
-//  std::cout << socket << " here\n";
-  std::tie(id, payload) = recvMsg(socket);
+  if (option == "--upload-limit") {
+    return &rate_limits.upload;
+  }
+  if (option == "--torrent-download-limit") {
+    return &rate_limits.torrent_download;
+  }
+  if (option == "--torrent-upload-limit") {
+    return &rate_limits.torrent_upload;
+  }
+  if (option == "--peer-download-limit") {
+    return &rate_limits.peer_download;
+  }
+  if (option == "--peer-upload-limit") {
+    return &rate_limits.peer_upload;
+  }
+  return nullptr;
 }
 
-void getAvailablePiecesSingular(const int& socket) {
-  auto [id, payload] = recvMsg(socket);
-  interest_unchoke_msg interest_msg{1, 2};
-  sendMsg(socket, (void*)&interest_msg, sizeof(interest_msg));
-  std::tie(id, payload) = recvMsg(socket);
+// Sets limit from the value of option; false if the value is invalid.
+bool setRateLimit(std::atomic<uint64_t>& limit, const std::string& option,
+                  const std::string& value) {
+  uint64_t rate = 0;
+  if (!parseNumber(value, rate)) {
+    return invalidValue(option, value);
+  }
+  limit.store(rate);
+  return true;
 }
 
-int getFreePeers(const std::vector<int>& peersPithCurrPiece, const std::unordered_set<int>& free_peers) {
-  for (const auto peer : peersPithCurrPiece) {
-    if (free_peers.contains(peer)) {
-      return peer;
+// Applies the rate limit options from argv[first] on; false, with the
+// problem reported, for an unknown option or a bad value.
+bool parseRateLimits(int argc, char* argv[], int first) {
+  for (int i = first; i < argc; i += 2) {
+    std::atomic<uint64_t>* limit = rateLimitFor(argv[i]);
+    if (limit == nullptr) {
+      std::cerr << "Unknown option: " << argv[i] << std::endl;
+      return false;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "Missing value for " << argv[i] << std::endl;
+      return false;
+    }
+    if (!setRateLimit(*limit, argv[i], argv[i + 1])) {
+      return false;
     }
   }
-  return -1;
+  return true;
 }
 
-bool process(const int& socket, const std::string& filename,
-             const std::string& address, const int& piece) {
+// Downloads a synthetic payload from a LocalSwarm through the regular
+// download path and reports throughput, time to first block and the CPU
+// time the downloader spent per gigabyte.
+// Checks that an announce made through one node of a loopback DHT is found
+// by a lookup from another, and reports how long each step took.
+int runDhtBench(size_t node_count) {
+  using namespace std::chrono_literals;
+  constexpr uint16_t kAnnouncedPort = 6999;
+  std::unique_ptr<LocalDht> dht_owner;
+  try {
+    dht_owner = std::make_unique<LocalDht>(node_count);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  LocalDht& dht = *dht_owner;
+  auto elapsed = [](auto since) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - since)
+        .count();
+  };
+  auto start = std::chrono::steady_clock::now();
+  if (!dht.waitForRoutes(10s)) {
+    std::cerr << "DHT nodes did not find each other" << std::endl;
+    return 1;
+  }
+  std::cout << "DHT nodes: " << dht.size() << " (bootstrapped in "
+            << elapsed(start) << " ms)\n";
 
-  auto res = parseTorrentFile(filename);
-  size_t file_length = std::stoul(res[1].substr(8));
-  size_t piece_length = std::stoul(res[3].substr(14));
-  size_t piece_num = (file_length - 1) / piece_length + 1;
-  piece_num = 1;
-  bool ans = downloadPiece(socket, filename, address, piece);
+  std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
+  stringToSHA1("bench dht", hash);
+  std::string info_hash(hash.begin(), hash.end());
+  Dht& announcer = dht.node(1);
+  start = std::chrono::steady_clock::now();
+  announcer.getPeers(info_hash, kAnnouncedPort);
+  auto deadline = start + 10s;
+  while (announcer.searching(info_hash) &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(1ms);
+  }
+  std::cout << "Announce: " << elapsed(start) << " ms\n";
 
-  return ans;
+  // The announces may still be on their way, so a lookup that comes back
+  // empty is retried until the deadline.
+  Dht& searcher = dht.node(dht.size() - 1);
+  std::string expected = "127.0.0.1:" + std::to_string(kAnnouncedPort);
+  bool found = false;
+  start = std::chrono::steady_clock::now();
+  deadline = start + 10s;
+  while (!found && std::chrono::steady_clock::now() < deadline) {
+    if (!searcher.searching(info_hash)) {
+      searcher.getPeers(info_hash);
+    }
+    std::this_thread::sleep_for(1ms);
+    for (const auto& peer : searcher.takePeers(info_hash)) {
+      found = found || formatPeer(peer) == expected;
+    }
+  }
+  std::cout << "Lookup: " << elapsed(start) << " ms ("
+            << (found ? "found announced peer" : "FAILED") << ")\n";
+  return found ? 0 : 1;
 }
 
-void gatherPieces(const std::string& address, const size_t& piece_num) {
-  std::ofstream outfile(address, std::ios::out | std::ios::binary);
-  for (int i = 0; i < piece_num; ++i) {
-    std::string name = address + "_piece_" + std::to_string(i);
-    std::ifstream in(name, std::ios::out | std::ios::binary);
-    std::filesystem::path path(name);
-    auto file_size = std::filesystem::file_size(path);
-    std::vector<unsigned char> buf(file_size);
-    in.read(reinterpret_cast<char*>(buf.data()), file_size);
-    in.close();
-    outfile.write(reinterpret_cast<char*>(buf.data()), file_size);
+// Checks that one LocalDiscovery hears another announce over loopback
+// multicast, and that neither takes its own announce for a peer.
+int runLsdBench(uint16_t lsd_port) {
+  using namespace std::chrono_literals;
+  constexpr uint16_t kAnnouncedPort = 6999;
+  std::array<unsigned char, SHA_DIGEST_LENGTH> hash{};
+  stringToSHA1("bench lsd", hash);
+  std::string info_hash(hash.begin(), hash.end());
+  LsdConfig config;
+  config.interface = "127.0.0.1";
+  config.port = lsd_port;
+  std::unique_ptr<LocalDiscovery> listener;
+  std::unique_ptr<LocalDiscovery> announcer;
+  try {
+    listener = std::make_unique<LocalDiscovery>(info_hash, config);
+    config.announce_port = kAnnouncedPort;
+    announcer = std::make_unique<LocalDiscovery>(info_hash, config);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::string expected = "127.0.0.1:" + std::to_string(kAnnouncedPort);
+  bool heard = false;
+  bool echoed = false;
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + 5s;
+  while (!heard && std::chrono::steady_clock::now() < deadline) {
+    echoed = echoed || !announcer->poll().empty();
+    for (const auto& peer : listener->poll()) {
+      heard = heard || formatPeer(peer) == expected;
+    }
+    std::this_thread::sleep_for(1ms);
   }
-  outfile.close();
+  echoed = echoed || !announcer->poll().empty();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "LSD announce: " << elapsed.count() << " ms ("
+            << (heard ? "heard " + expected : std::string("FAILED")) << ")\n";
+  if (echoed) {
+    std::cout << "LSD announcer heard itself\n";
+  }
+  return heard && !echoed ? 0 : 1;
 }
 
-bool downloadFile(const std::string& file, const std::string& address) {
-  auto info = parseTorrentFile(file);
-  size_t file_length = std::stoul(info[1].substr(8));
-  size_t piece_length = std::stoul(info[3].substr(14));
-  size_t piece_num = (file_length - 1) / piece_length + 1;
-  std::vector<std::string> peers = sendRequest(file);
-  std::unordered_map<int, std::string> reses;
-  std::unordered_set<int> free_peers;
-  std::vector<int> pieces;
-  std::vector<std::vector<int>> available_peers(piece_num);
-  for (const auto& peer : peers) {
-    auto res = establishConnection(file, peer);
-    reses[res.first] = res.second;
-    free_peers.insert(res.first);
-    getAvailablePieces(available_peers, res.first);
-  }
-  pieces.reserve(piece_num);
-for (int i = 0; i < piece_num; ++i) {
-    pieces.push_back(i);
-  }
-  while (!pieces.empty()) {
-    std::vector<std::pair<int, std::future<bool>>> futures;
-    for (int i = 0; i < pieces.size(); ++i) {
-      int piece = pieces[i];
-      int socket = getFreePeers(available_peers[piece], free_peers);
-      if (socket == -1) {
-        continue;
+int runBench(int argc, char* argv[]) {
+  SwarmConfig config;
+  PeerProfile defaults;
+  size_t peer_count = 4;
+  size_t dht_nodes = 0;
+  uint16_t lsd_port = 0;
+  for (int i = 2; i < argc; ++i) {
+    std::string option = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << "Missing value for " << option << std::endl;
+      return 1;
+    }
+    std::string value = argv[++i];
+    bool valid = true;
+    int64_t latency_ms = 0;
+    if (option == "--peers") {
+      valid = parseNumber(value, peer_count) && peer_count > 0;
+    } else if (option == "--size") {
+      valid = parseNumber(value, config.payload_size) &&
+              config.payload_size > 0;
+    } else if (option == "--piece-length") {
+      valid = parseNumber(value, config.piece_length) &&
+              config.piece_length > 0;
+    } else if (option == "--latency") {
+      valid = parseNumber(value, latency_ms) && latency_ms >= 0;
+      defaults.latency = std::chrono::milliseconds(latency_ms);
+    } else if (option == "--bandwidth") {
+      valid = parseNumber(value, defaults.bandwidth);
+    } else if (option == "--loss") {
+      valid = parseNumber(value, defaults.loss) && defaults.loss >= 0 &&
+              defaults.loss < 1;
+    } else if (option == "--seed") {
+      valid = parseNumber(value, config.seed);
+    } else if (option == "--dht-nodes") {
+      // The announcer, the searcher and the router they share.
+      valid = parseNumber(value, dht_nodes) && dht_nodes >= 3;
+    } else if (option == "--lsd-port") {
+      valid = parseNumber(value, lsd_port) && lsd_port > 0;
+    } else if (option == "--io") {
+      if (value == "epoll") {
+        io_backend = Reactor::Backend::kEpoll;
+      } else if (value == "io_uring") {
+        io_backend = Reactor::Backend::kIoUring;
+      } else {
+        std::cerr << "Unknown I/O engine: " << value << std::endl;
+        return 1;
+      }
+    } else if (option == "--tracker") {
+      if (value != "http" && value != "udp") {
+        std::cerr << "Unknown tracker protocol: " << value << std::endl;
+        return 1;
+      }
+      config.udp_tracker = value == "udp";
+    } else if (option == "--transport") {
+      if (value == "tcp") {
+        peer_transport = Transport::Kind::kTcp;
+      } else if (value == "utp") {
+        peer_transport = Transport::Kind::kUtp;
+      } else {
+        std::cerr << "Unknown transport: " << value << std::endl;
+        return 1;
       }
-      free_peers.erase(socket);
-      std::string piece_address = address + "_piece_" + std::to_string(piece);
-      if (process(socket, file, piece_address, piece)) {
-        pieces.erase(pieces.begin() + i);
+    } else if (auto* limit = rateLimitFor(option)) {
+      if (!setRateLimit(*limit, option, value)) {
+        return 1;
       }
-      free_peers.insert(socket);
+    } else if (option == "--peer") {
+      // LATENCY_MS:BANDWIDTH:LOSS for one seed; repeat for more.
+      PeerProfile profile;
+      size_t first = value.find(':');
+      size_t second = value.find(':', first + 1);
+      std::string_view text = value;
+      valid = first != std::string::npos && second != std::string::npos &&
+              parseNumber(text.substr(0, first), latency_ms) &&
+              latency_ms >= 0 &&
+              parseNumber(text.substr(first + 1, second - first - 1),
+                          profile.bandwidth) &&
+              parseNumber(text.substr(second + 1), profile.loss) &&
+              profile.loss >= 0 && profile.loss < 1;
+      profile.latency = std::chrono::milliseconds(latency_ms);
+      config.peers.push_back(profile);
+    } else {
+      std::cerr << "Unknown bench option: " << option << std::endl;
+      return 1;
+    }
+    if (!valid) {
+      invalidValue(option, value);
+      return 1;
     }
   }
-  while (!free_peers.empty()) {
-    int socket = *free_peers.begin();
-    free_peers.erase(socket);
-    close(socket);
+  if (dht_nodes > 0) {
+    return runDhtBench(dht_nodes);
+  }
+  if (lsd_port > 0) {
+    return runLsdBench(lsd_port);
+  }
+  if (config.peers.empty()) {
+    config.peers.assign(peer_count, defaults);
   }
-  gatherPieces(address, piece_num);
-  return pieces.empty();
+  std::unique_ptr<LocalSwarm> swarm_owner;
+  try {
+    swarm_owner = std::make_unique<LocalSwarm>(config);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  LocalSwarm& swarm = *swarm_owner;
+  // Keep the peer cache of earlier runs out of the measurement.
+  setenv("XDG_CACHE_HOME", swarm.directory().c_str(), 1);
+  std::string output = swarm.directory() + "/bench.bin";
+
+  rusage usage_before{};
+  getrusage(RUSAGE_SELF, &usage_before);
+  auto start = std::chrono::steady_clock::now();
+  bool ok = downloadFile(swarm.torrentPath(), output);
+  auto end = std::chrono::steady_clock::now();
+  rusage usage_after{};
+  getrusage(RUSAGE_SELF, &usage_after);
+  ok = ok && swarm.verify(output);
+
+  auto cpu_seconds = [](const rusage& usage) {
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  };
+  double seconds = std::chrono::duration<double>(end - start).count();
+  double bytes = static_cast<double>(swarm.payloadSize());
+  double cpu = cpu_seconds(usage_after) - cpu_seconds(usage_before);
+  std::cout << "Payload: " << swarm.payloadSize() << " bytes from "
+            << config.peers.size() << " peers ("
+            << (ok ? "verified" : "FAILED") << ")\n";
+  std::cout << "Throughput: " << bytes / seconds / 1e6 << " MB/s\n";
+  if (download_stats.got_block) {
+    std::chrono::duration<double, std::milli> first_block =
+        download_stats.first_block - start;
+    std::cout << "Time to first block: " << first_block.count() << " ms\n";
+  }
+  std::cout << "CPU per GB: " << cpu / (bytes / 1e9) << " s\n";
+  return ok ? 0 : 1;
 }
 
 int main(int argc, char* argv[]) {
@@ -773,14 +3192,25 @@ int main(int argc, char* argv[]) {
     json decoded_value = decodeBencodedValue(encoded_value);
     std::cout << decoded_value.dump() << std::endl;
   } else if (command == "info") {
-    if (argc < 3) {
-      std::cerr << "Usage: " << argv[0] << " info <file>" << std::endl;
+    bool as_json = false;
+    std::string file;
+    for (int i = 2; i < argc; ++i) {
+      if (std::string_view(argv[i]) == "--json") {
+        as_json = true;
+      } else {
+        file = argv[i];
+      }
+    }
+    if (file.empty()) {
+      std::cerr << "Usage: " << argv[0] << " info [--json] <file>"
+                << std::endl;
       return 1;
     }
-    std::string file = argv[2];
-    std::vector<std::string> info = parseTorrentFile(file);
-    for (const auto& i : info) {
-      std::cout << i << '\n';
+    OutputBuffer out(STDOUT_FILENO);
+    writeInfo(readTorrentFile(file), out, as_json);
+    if (!out.flush()) {
+      std::cerr << "Error writing output" << std::endl;
+      return 1;
     }
   } else if (command == "peers") {
     if (argc < 3) {
@@ -790,7 +3220,7 @@ int main(int argc, char* argv[]) {
     std::string file = argv[2];
     auto peers = sendRequest(file);
     for (const auto& peer : peers) {
-      std::cout << peer << '\n';
+      std::cout << formatPeer(peer) << '\n';
     }
   } else if (command == "handshake") {
     if (argc < 4) {
@@ -798,32 +3228,65 @@ int main(int argc, char* argv[]) {
       return 1;
     }
     std::string file = argv[2];
-    std::string peer = argv[3];
-    auto res = establishConnection(file, peer);
+    sockaddr_storage peer{};
+    if (!parsePeer(argv[3], peer)) {
+      std::cerr << "Invalid peer address: " << argv[3] << std::endl;
+      return 1;
+    }
+    auto res =
+        establishConnection(loadTorrentInfo(openTorrentFile(file)), peer);
     int socket = res.first;
     std::cout << "Peer ID: " << res.second << '\n';
     close(socket);
   } else if (command == "download_piece") {
+    uint32_t piece = 0;
+    if (argc < 6 || !parseNumber(argv[5], piece)) {
+      std::cerr << "Usage: " << argv[0]
+                << " download_piece -o <output> <file> <piece> [limits]"
+                << std::endl;
+      return 1;
+    }
     std::string address = argv[3];
     std::string file = argv[4];
-    int piece = std::stoi(argv[5]);
-    std::vector<std::string> peers = sendRequest(file);
-    std::string peer = peers[0];
-    auto res = establishConnection(file, peer);
-    int socket = res.first;
-    getAvailablePiecesSingular(socket);
-    auto ans = process(socket, file, address, piece);
-    if (ans) {
-      std::cout << "Piece " << piece << " downloaded to " << address << '\n';
+    if (!parseRateLimits(argc, argv, 6)) {
+      return 1;
     }
-    close(socket);
+    bool ok = false;
+    try {
+      ok = downloadSinglePiece(file, address, piece);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+    if (!ok) {
+      std::cerr << "Error downloading piece " << piece << " of " << file
+                << std::endl;
+      return 1;
+    }
+    std::cout << "Piece " << piece << " downloaded to " << address << '\n';
   } else if (command == "download") {
+    if (argc < 5) {
+      std::cerr << "Usage: " << argv[0]
+                << " download -o <output> <file> [limits]" << std::endl;
+      return 1;
+    }
     std::string address = argv[3];
     std::string file = argv[4];
-    bool ans = downloadFile(file, address);
-    if (ans) {
-      std::cout << "Downloaded test.torrent to " << address << '\n';
+    if (!parseRateLimits(argc, argv, 5)) {
+      return 1;
+    }
+    bool ok = false;
+    try {
+      ok = downloadFile(file, address);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+    if (!ok) {
+      std::cerr << "Error downloading " << file << std::endl;
+      return 1;
     }
+    std::cout << "Downloaded test.torrent to " << address << '\n';
+  } else if (command == "bench") {
+    return runBench(argc, argv);
   } else {
     std::cerr << "unknown command: " << command << std::endl;
     return 1;
@@ -0,0 +1,215 @@
+#include "PieceSet.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Bytes with their bit order reversed: bitfield messages put the first
+// piece in the most significant bit.
+constexpr std::array<uint8_t, 256> kReversed = [] {
+  std::array<uint8_t, 256> table{};
+  for (int i = 0; i < 256; ++i) {
+    for (int bit = 0; bit < 8; ++bit) {
+      if (i & (1 << bit)) {
+        table[i] |= 0x80 >> bit;
+      }
+    }
+  }
+  return table;
+}();
+
+size_t popcount(const uint64_t* words, size_t n) {
+  size_t count = 0;
+  size_t i = 0;
+#if defined(__SSE2__)
+  // Bit-sliced popcount per byte, summed per 64-bit lane by psadbw.
+  const __m128i m1 = _mm_set1_epi8(0x55);
+  const __m128i m2 = _mm_set1_epi8(0x33);
+  const __m128i m4 = _mm_set1_epi8(0x0f);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + i));
+    v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+    v = _mm_add_epi8(_mm_and_si128(v, m2),
+                     _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+    v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+    total = _mm_add_epi64(total, _mm_sad_epu8(v, zero));
+  }
+  count = _mm_cvtsi128_si64(total) +
+          _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total));
+#endif
+  for (; i < n; ++i) {
+    count += std::popcount(words[i]);
+  }
+  return count;
+}
+
+}  // namespace
+
+PieceSet::PieceSet(size_t size) : size_(size), words_((size + 63) / 64) {}
+
+void PieceSet::set(size_t piece) {
+  uint64_t bit = uint64_t{1} << piece % 64;
+  if (piece < size_ && !(words_[piece / 64] & bit)) {
+    words_[piece / 64] |= bit;
+    ++count_;
+  }
+}
+
+void PieceSet::reset(size_t piece) {
+  uint64_t bit = uint64_t{1} << piece % 64;
+  if (piece < size_ && (words_[piece / 64] & bit)) {
+    words_[piece / 64] &= ~bit;
+    --count_;
+  }
+}
+
+void PieceSet::fill() {
+  std::fill(words_.begin(), words_.end(), ~uint64_t{0});
+  if (size_ % 64 != 0) {
+    words_.back() = (uint64_t{1} << size_ % 64) - 1;
+  }
+  count_ = size_;
+}
+
+void PieceSet::clear() {
+  std::fill(words_.begin(), words_.end(), 0);
+  count_ = 0;
+}
+
+void PieceSet::assignBitfield(const unsigned char* data, size_t size) {
+  clear();
+  size = std::min(size, (size_ + 7) / 8);
+  for (size_t i = 0; i < size; ++i) {
+    words_[i / 8] |= uint64_t{kReversed[data[i]]} << i % 8 * 8;
+  }
+  if (size_ % 64 != 0 && !words_.empty()) {
+    words_.back() &= (uint64_t{1} << size_ % 64) - 1;
+  }
+  recount();
+}
+
+size_t PieceSet::nextAndNot(const PieceSet& exclude, size_t from) const {
+  if (from >= size_) {
+    return size_;
+  }
+  size_t n = words_.size();
+  size_t w = from / 64;
+  uint64_t word =
+      words_[w] & ~exclude.words_[w] & (~uint64_t{0} << from % 64);
+  while (word == 0) {
+    ++w;
+#if defined(__SSE2__)
+    // Skips pairs of words with nothing to offer.
+    const __m128i zero = _mm_setzero_si128();
+    for (; w + 2 <= n; w += 2) {
+      __m128i ours =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(&words_[w]));
+      __m128i theirs = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(&exclude.words_[w]));
+      __m128i left = _mm_andnot_si128(theirs, ours);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(left, zero)) != 0xffff) {
+        break;
+      }
+    }
+#endif
+    if (w >= n) {
+      return size_;
+    }
+    word = words_[w] & ~exclude.words_[w];
+  }
+  return w * 64 + std::countr_zero(word);
+}
+
+size_t PieceSet::nextClear(size_t from) const {
+  if (from >= size_) {
+    return size_;
+  }
+  size_t w = from / 64;
+  uint64_t clear = ~words_[w] & (~uint64_t{0} << from % 64);
+  while (clear == 0) {
+    if (++w >= words_.size()) {
+      return size_;
+    }
+    clear = ~words_[w];
+  }
+  return std::min(w * 64 + std::countr_zero(clear), size_);
+}
+
+void PieceSet::recount() { count_ = popcount(words_.data(), words_.size()); }
+
+PieceAvailability::PieceAvailability(size_t size)
+    : counts_((size + 63) / 64 * 64) {}
+
+void PieceAvailability::add(const PieceSet& pieces) {
+  if (pieces.size() > 0 && pieces.full()) {
+    ++seeds_;
+  } else {
+    apply(pieces, 1);
+  }
+}
+
+void PieceAvailability::remove(const PieceSet& pieces) {
+  if (pieces.size() > 0 && pieces.full()) {
+    --seeds_;
+  } else {
+    apply(pieces, -1);
+  }
+}
+
+void PieceAvailability::update(const PieceSet& pieces, size_t piece,
+                               bool has) {
+  if (has && pieces.full()) {
+    // A new seed: its pieces move from the counters to the seed count.
+    ++counts_[piece];
+    apply(pieces, -1);
+    ++seeds_;
+  } else if (!has && pieces.count() + 1 == pieces.size()) {
+    --seeds_;
+    apply(pieces, 1);
+  } else if (has) {
+    ++counts_[piece];
+  } else {
+    --counts_[piece];
+  }
+}
+
+void PieceAvailability::apply(const PieceSet& pieces, int delta) {
+  const auto& words = pieces.words();
+  size_t n = std::min(words.size(), counts_.size() / 64);
+#if defined(__SSE2__)
+  // Lane j of an 8-counter vector takes bit j of a byte of the set: the
+  // byte is broadcast, masked and compared into all-ones (-1) lanes, which
+  // are subtracted to add one or added to remove one.
+  const __m128i lanes = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  for (size_t w = 0; w < n; ++w) {
+    uint64_t word = words[w];
+    if (word == 0) {
+      continue;
+    }
+    auto* counters = reinterpret_cast<__m128i*>(&counts_[w * 64]);
+    for (int byte = 0; byte < 8; ++byte) {
+      auto bits = _mm_set1_epi16(static_cast<int16_t>(word >> byte * 8 & 0xff));
+      __m128i ones = _mm_cmpeq_epi16(_mm_and_si128(bits, lanes), lanes);
+      __m128i value = _mm_loadu_si128(counters + byte);
+      value = delta > 0 ? _mm_sub_epi16(value, ones)
+                        : _mm_add_epi16(value, ones);
+      _mm_storeu_si128(counters + byte, value);
+    }
+  }
+#else
+  for (size_t w = 0; w < n; ++w) {
+    for (uint64_t word = words[w]; word != 0; word &= word - 1) {
+      counts_[w * 64 + std::countr_zero(word)] += delta;
+    }
+  }
+#endif
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A set of piece indices of one torrent, packed 64 to a word: piece i is
+// bit i % 64 of word i / 64. Bits past size() are always clear, and the
+// number of pieces in the set is kept up to date, so full() is free. The
+// bulk operations go through SSE2 where the target has it, two words at a
+// time.
+class PieceSet {
+ public:
+  PieceSet() = default;
+  // An empty set over pieces [0, size).
+  explicit PieceSet(size_t size);
+
+  size_t size() const { return size_; }
+  size_t count() const { return count_; }
+  bool full() const { return count_ == size_; }
+
+  bool test(size_t piece) const {
+    return piece < size_ && (words_[piece / 64] >> piece % 64 & 1);
+  }
+  void set(size_t piece);
+  void reset(size_t piece);
+  void fill();
+  void clear();
+  // Loads the payload of a bitfield message, where piece i is bit
+  // 7 - i % 8 of byte i / 8. Bytes and bits past size() are ignored.
+  void assignBitfield(const unsigned char* data, size_t size);
+
+  // The first piece at or after from that is in this set but not in
+  // exclude (a set of the same size), or size() if there is none.
+  size_t nextAndNot(const PieceSet& exclude, size_t from) const;
+  // The first piece at or after from that is not in the set, or size().
+  size_t nextClear(size_t from) const;
+
+  const std::vector<uint64_t>& words() const { return words_; }
+
+ private:
+  void recount();
+
+  size_t size_ = 0;
+  size_t count_ = 0;
+  std::vector<uint64_t> words_;
+};
+
+// How many connected peers have each piece. Whole piece sets are added and
+// removed at once, 64 counters per word of the set; complete sets only move
+// a seed count, so seeds cost nothing per piece however large the torrent.
+class PieceAvailability {
+ public:
+  explicit PieceAvailability(size_t size);
+
+  uint32_t operator[](size_t piece) const { return counts_[piece] + seeds_; }
+
+  void add(const PieceSet& pieces);
+  void remove(const PieceSet& pieces);
+  // A peer gained (has) or lost one piece; pieces is its set afterwards.
+  void update(const PieceSet& pieces, size_t piece, bool has);
+
+ private:
+  // Adds delta (1 or -1) to the counter of every piece in a set that is
+  // not complete.
+  void apply(const PieceSet& pieces, int delta);
+
+  // Padded to whole words of 64 counters.
+  std::vector<uint16_t> counts_;
+  uint32_t seeds_ = 0;
+};
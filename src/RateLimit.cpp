@@ -0,0 +1,34 @@
+#include "RateLimit.hpp"
+
+#include <algorithm>
+
+void TokenBucket::refill(uint64_t rate,
+                         std::chrono::steady_clock::time_point now) {
+  rate_.store(rate, std::memory_order_relaxed);
+  int64_t ticks = now.time_since_epoch().count();
+  int64_t last = refilled_at_.load(std::memory_order_relaxed);
+  if (ticks - last <
+      std::chrono::steady_clock::duration(kRefillInterval).count()) {
+    return;
+  }
+  // Whoever moves the refill time forward adds the tokens.
+  if (!refilled_at_.compare_exchange_strong(last, ticks,
+                                            std::memory_order_relaxed)) {
+    return;
+  }
+  if (rate == 0) {
+    tokens_.store(0, std::memory_order_relaxed);
+    return;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::duration(ticks - last);
+  auto burst = static_cast<int64_t>(
+      rate * std::chrono::duration<double>(kMaxBurst).count());
+  auto earned = static_cast<int64_t>(
+      std::min(rate * elapsed.count(), static_cast<double>(burst)));
+  int64_t tokens = tokens_.load(std::memory_order_relaxed);
+  while (!tokens_.compare_exchange_weak(tokens,
+                                        std::min(tokens + earned, burst),
+                                        std::memory_order_relaxed)) {
+  }
+}
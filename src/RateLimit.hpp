@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Byte budget of one transfer direction at one level. Tokens are added in
+// batches by refill(), at most once per kRefillInterval however often it is
+// called, and taken whole transfers at a time: a transfer may start while
+// the bucket holds any tokens and leaves it in debt until later refills
+// pay it off. Everything is atomic, so a bucket shared between threads
+// needs no lock.
+class TokenBucket {
+ public:
+  // Whether a transfer may start now: always without a limit, otherwise
+  // while the bucket is not empty or in debt.
+  bool available() const {
+    return rate_.load(std::memory_order_relaxed) == 0 ||
+           tokens_.load(std::memory_order_relaxed) > 0;
+  }
+  // Charges bytes that were transferred.
+  void take(size_t bytes) {
+    if (rate_.load(std::memory_order_relaxed) != 0) {
+      tokens_.fetch_sub(static_cast<int64_t>(bytes),
+                        std::memory_order_relaxed);
+    }
+  }
+  // Sets the rate in bytes per second, 0 for no limit, and adds the tokens
+  // earned since the last refill, up to a burst of kMaxBurst at that rate.
+  void refill(uint64_t rate, std::chrono::steady_clock::time_point now);
+
+ private:
+  static constexpr std::chrono::milliseconds kRefillInterval{10};
+  static constexpr std::chrono::milliseconds kMaxBurst{250};
+
+  std::atomic<uint64_t> rate_{0};
+  std::atomic<int64_t> tokens_{0};
+  // steady_clock ticks of the last refill.
+  std::atomic<int64_t> refilled_at_{0};
+};
+
+// Rate limits in bytes per second, 0 for none: for the whole process, for
+// each torrent and for each peer, in both directions. They may be changed
+// at any time from any thread; the buckets follow on their next refill.
+struct RateLimits {
+  std::atomic<uint64_t> download{0};
+  std::atomic<uint64_t> upload{0};
+  std::atomic<uint64_t> torrent_download{0};
+  std::atomic<uint64_t> torrent_upload{0};
+  std::atomic<uint64_t> peer_download{0};
+  std::atomic<uint64_t> peer_upload{0};
+};
@@ -0,0 +1,168 @@
+#include "Reactor.hpp"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+constexpr size_t kMaxEvents = 256;
+
+// Edge-triggered epoll loop. Every socket is watched for input, output and
+// hang-up at once; because notifications are edge-triggered, input is read
+// until EAGAIN before the next socket is looked at.
+class EpollReactor : public Reactor {
+ public:
+  EpollReactor() : events_(kMaxEvents) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+      throw std::runtime_error("Error creating epoll instance");
+    }
+  }
+
+  ~EpollReactor() override { close(epoll_fd_); }
+
+  void add(int fd, std::shared_ptr<RingBuffer> in, Handler* handler) override {
+    auto watch = std::make_unique<Watch>();
+    watch->fd = fd;
+    watch->in = std::move(in);
+    watch->handler = handler;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = watch.get();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      throw std::runtime_error("Error registering descriptor with epoll");
+    }
+    watches_[fd] = std::move(watch);
+  }
+
+  void watch(int fd, Handler* handler) override {
+    auto watch = std::make_unique<Watch>();
+    watch->fd = fd;
+    watch->handler = handler;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = watch.get();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      throw std::runtime_error("Error registering descriptor with epoll");
+    }
+    watches_[fd] = std::move(watch);
+  }
+
+  void remove(int fd) override {
+    auto it = watches_.find(fd);
+    if (it == watches_.end()) {
+      return;
+    }
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    // Events for it may still be waiting in this round's batch.
+    it->second->handler = nullptr;
+    removed_.push_back(std::move(it->second));
+    watches_.erase(it);
+  }
+
+  // Edge-triggered EPOLLOUT fires by itself once the socket drains.
+  void wantWrite(int) override {}
+
+  void write(int fd, std::vector<unsigned char> data,
+             uint64_t offset) override {
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = pwrite(fd, data.data() + written, data.size() - written,
+                         offset + written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        throw std::runtime_error("Error writing output file");
+      }
+      written += n;
+    }
+  }
+
+  size_t pendingWrites() const override { return 0; }
+
+  int poll(std::chrono::milliseconds timeout) override {
+    int ready = epoll_wait(epoll_fd_, events_.data(), events_.size(),
+                           static_cast<int>(timeout.count()));
+    if (ready < 0) {
+      if (errno == EINTR) {
+        return 0;
+      }
+      throw std::runtime_error("Error waiting for epoll events");
+    }
+    for (int i = 0; i < ready; ++i) {
+      auto* watch = static_cast<Watch*>(events_[i].data.ptr);
+      uint32_t events = events_[i].events;
+      if (watch->in == nullptr) {
+        if (watch->handler != nullptr) {
+          watch->handler->onReadable();
+        }
+        continue;
+      }
+      if (watch->handler != nullptr &&
+          (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        watch->handler->onWritable();
+      }
+      if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        readAvailable(*watch);
+      }
+    }
+    removed_.clear();
+    return ready;
+  }
+
+ private:
+  struct Watch {
+    int fd = -1;
+    // Null for descriptors the handler reads itself.
+    std::shared_ptr<RingBuffer> in;
+    Handler* handler = nullptr;
+  };
+
+  // Reads until EAGAIN, handing every chunk to the handler, which frees
+  // buffer space by consuming complete messages.
+  void readAvailable(Watch& watch) {
+    while (watch.handler != nullptr) {
+      if (watch.in->space() == 0) {
+        watch.handler->onReceived(-ENOBUFS);
+        return;
+      }
+      ssize_t n = watch.in->readFrom(watch.fd);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+      }
+      watch.handler->onReceived(n < 0 ? -errno : n);
+      if (n <= 0) {
+        return;
+      }
+    }
+  }
+
+  int epoll_fd_ = -1;
+  std::vector<epoll_event> events_;
+  std::unordered_map<int, std::unique_ptr<Watch>> watches_;
+  // Watches removed during this round, kept until its events are handled.
+  std::vector<std::unique_ptr<Watch>> removed_;
+};
+
+}  // namespace
+
+std::unique_ptr<Reactor> Reactor::create(Backend backend) {
+  if (backend != Backend::kEpoll) {
+    if (auto reactor = makeIoUringReactor()) {
+      return reactor;
+    }
+    if (backend == Backend::kIoUring) {
+      throw std::runtime_error("io_uring is not available");
+    }
+  }
+  return std::make_unique<EpollReactor>();
+}
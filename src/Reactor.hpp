@@ -0,0 +1,68 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "RingBuffer.hpp"
+
+// Event loop for the peer sockets and the output file of a download. A
+// registered socket is read into its receive buffer by the reactor itself
+// and its handler is told about new bytes; output goes straight to the
+// socket until it is full, after which wantWrite() asks for a wake-up.
+// Output file writes are queued and may complete later.
+//
+// Two engines implement it: io_uring, which receives, polls and writes with
+// one io_uring_enter per round, and epoll, the fallback where io_uring is
+// missing or disabled.
+class Reactor {
+ public:
+  enum class Backend { kAuto, kEpoll, kIoUring };
+
+  class Handler {
+   public:
+    virtual ~Handler() = default;
+    // The socket can take output again; also reported once a pending
+    // connect has succeeded or failed.
+    virtual void onWritable() = 0;
+    // result bytes were appended to the receive buffer; 0 is end of
+    // stream and a negative result is -errno, after which the socket is
+    // not read again.
+    virtual void onReceived(ssize_t result) = 0;
+    // Input is waiting on a descriptor registered with watch(); the
+    // handler reads it itself, until EAGAIN.
+    virtual void onReadable() {}
+  };
+
+  // Builds the requested engine; kAuto picks io_uring when the kernel
+  // allows it. Throws if an explicitly requested engine is unavailable.
+  static std::unique_ptr<Reactor> create(Backend backend);
+
+  virtual ~Reactor() = default;
+
+  // Starts watching fd, receiving into in. The reactor keeps in alive
+  // until the kernel is done with it, which may be after remove().
+  virtual void add(int fd, std::shared_ptr<RingBuffer> in,
+                   Handler* handler) = 0;
+  // Reports readability of fd, a descriptor (such as a datagram socket)
+  // that the handler reads itself.
+  virtual void watch(int fd, Handler* handler) = 0;
+  // Stops watching fd; its handler is not called again.
+  virtual void remove(int fd) = 0;
+  // Asks for onWritable once fd can take more output.
+  virtual void wantWrite(int fd) = 0;
+  // Queues data to be written to file descriptor fd at offset. Throws
+  // from poll() if the write fails.
+  virtual void write(int fd, std::vector<unsigned char> data,
+                     uint64_t offset) = 0;
+  virtual size_t pendingWrites() const = 0;
+  // Waits up to timeout for events and dispatches them. Returns the number
+  // of events handled.
+  virtual int poll(std::chrono::milliseconds timeout) = 0;
+};
+
+// The io_uring engine, or null if the kernel does not provide io_uring.
+std::unique_ptr<Reactor> makeIoUringReactor();
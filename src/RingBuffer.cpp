@@ -0,0 +1,55 @@
+#include "RingBuffer.hpp"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+RingBuffer::RingBuffer(size_t capacity) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  capacity_ = (capacity + page - 1) / page * page;
+  int fd = memfd_create("ring", MFD_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("Error creating ring buffer");
+  }
+  if (ftruncate(fd, capacity_) != 0) {
+    close(fd);
+    throw std::runtime_error("Error sizing ring buffer");
+  }
+  // Reserve twice the size, then map the same pages into both halves.
+  void* base = mmap(nullptr, 2 * capacity_, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    throw std::runtime_error("Error mapping ring buffer");
+  }
+  base_ = static_cast<unsigned char*>(base);
+  for (size_t half = 0; half < 2; ++half) {
+    if (mmap(base_ + half * capacity_, capacity_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      munmap(base_, 2 * capacity_);
+      close(fd);
+      throw std::runtime_error("Error mapping ring buffer");
+    }
+  }
+  close(fd);
+}
+
+RingBuffer::~RingBuffer() { munmap(base_, 2 * capacity_); }
+
+ssize_t RingBuffer::readFrom(int fd) {
+  ssize_t n = recv(fd, base_ + tail_, space(), 0);
+  if (n > 0) {
+    tail_ += n;
+  }
+  return n;
+}
+
+void RingBuffer::consume(size_t n) {
+  head_ += n;
+  if (head_ >= capacity_) {
+    head_ -= capacity_;
+    tail_ -= capacity_;
+  }
+}
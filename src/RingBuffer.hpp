@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+
+// Receive buffer for one connection. The storage is mapped twice, back to
+// back, so both the buffered bytes and the free space are always contiguous
+// in memory even when they wrap around: a frame can be handed out as a
+// plain pointer into the buffer and a socket can be drained with one recv
+// per call, without ever moving data.
+class RingBuffer {
+ public:
+  // capacity is rounded up to a whole number of pages.
+  explicit RingBuffer(size_t capacity);
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+  ~RingBuffer();
+
+  // Receives into the free space; returns what recv returned.
+  ssize_t readFrom(int fd);
+  // The free space, space() bytes, for receives issued elsewhere (e.g. by
+  // io_uring); produce() then appends the n bytes they delivered.
+  unsigned char* freeSpace() { return base_ + tail_; }
+  void produce(size_t n) { tail_ += n; }
+  // Drops the first n buffered bytes.
+  void consume(size_t n);
+
+  // The buffered bytes, valid until the next readFrom or consume.
+  const unsigned char* data() const { return base_ + head_; }
+  size_t size() const { return tail_ - head_; }
+  size_t space() const { return capacity_ - size(); }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  unsigned char* base_ = nullptr;
+  size_t capacity_ = 0;
+  // head_ is below capacity_; tail_ may run up to head_ + capacity_, into
+  // the second mapping.
+  size_t head_ = 0;
+  size_t tail_ = 0;
+};
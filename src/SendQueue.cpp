@@ -0,0 +1,68 @@
+#include "SendQueue.hpp"
+
+#include <array>
+#include <cerrno>
+#include <utility>
+
+namespace {
+
+// Messages up to this size are packed together, up to this many bytes per
+// chunk; a block of piece data always gets its own chunk.
+constexpr size_t kChunkSize = 4096;
+// Chunks handed to the transport in one call.
+constexpr size_t kMaxBatch = 64;
+
+}  // namespace
+
+void SendQueue::push(std::string message) {
+  size_ += message.size();
+  if (message.size() < kChunkSize && !chunks_.empty() &&
+      chunks_.back().size() + message.size() <= kChunkSize) {
+    chunks_.back() += message;
+    return;
+  }
+  if (message.size() < kChunkSize) {
+    message.reserve(kChunkSize);
+  }
+  chunks_.push_back(std::move(message));
+}
+
+bool SendQueue::flush(Transport& transport) {
+  while (!chunks_.empty()) {
+    std::array<iovec, kMaxBatch> iov{};
+    size_t count = 0;
+    size_t batch = 0;
+    for (auto it = chunks_.begin(); it != chunks_.end() && count < kMaxBatch;
+         ++it, ++count) {
+      size_t skip = count == 0 ? offset_ : 0;
+      iov[count].iov_base = it->data() + skip;
+      iov[count].iov_len = it->size() - skip;
+      batch += it->size() - skip;
+    }
+    ssize_t n = transport.send(iov.data(), count);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    size_ -= n;
+    written_ += n;
+    size_t left = n;
+    while (left > 0) {
+      size_t rest = chunks_.front().size() - offset_;
+      if (left < rest) {
+        offset_ += left;
+        break;
+      }
+      left -= rest;
+      offset_ = 0;
+      chunks_.pop_front();
+    }
+    if (static_cast<size_t>(n) < batch) {
+      // The transport is full; onWritable will bring us back.
+      return true;
+    }
+  }
+  return true;
+}
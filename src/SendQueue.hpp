@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "Transport.hpp"
+
+// Outbound bytes of one connection. Small messages (requests, haves,
+// interested and the like) are packed into shared chunks, large ones are
+// queued as they are, and flush() hands a whole batch of chunks to the
+// transport in one call, carrying on where a partial write stopped.
+class SendQueue {
+ public:
+  void push(std::string message);
+  // Writes until the queue is empty or the transport is full. Returns
+  // false if the transport failed.
+  bool flush(Transport& transport);
+
+  bool empty() const { return chunks_.empty(); }
+  // Bytes still to be written.
+  size_t size() const { return size_; }
+  // Bytes handed to the transport so far, and that plus the queued ones:
+  // a message pushed when pushed() was x has left once written() >= x.
+  uint64_t written() const { return written_; }
+  uint64_t pushed() const { return written_ + size_; }
+
+ private:
+  std::deque<std::string> chunks_;
+  // Bytes of the first chunk already written.
+  size_t offset_ = 0;
+  size_t size_ = 0;
+  uint64_t written_ = 0;
+};
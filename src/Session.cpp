@@ -0,0 +1,75 @@
+#include "Session.hpp"
+
+#include <array>
+#include <new>
+
+namespace {
+
+// Frames are rounded up to kGranule bytes; larger ones than kMaxPooled go
+// straight to the heap.
+constexpr size_t kGranule = 64;
+constexpr size_t kMaxPooled = 4096;
+// Free frames kept per size class, enough for every peer of a download.
+constexpr size_t kMaxCached = 256;
+
+struct FreeFrame {
+  FreeFrame* next;
+};
+
+struct FreeList {
+  FreeFrame* head = nullptr;
+  size_t count = 0;
+};
+
+class Pools {
+ public:
+  Pools() = default;
+  Pools(const Pools&) = delete;
+  Pools& operator=(const Pools&) = delete;
+  ~Pools() {
+    for (auto& list : lists_) {
+      while (list.head != nullptr) {
+        ::operator delete(std::exchange(list.head, list.head->next));
+      }
+    }
+  }
+
+  FreeList& forSize(size_t size) { return lists_[(size - 1) / kGranule]; }
+
+ private:
+  std::array<FreeList, kMaxPooled / kGranule> lists_;
+};
+
+thread_local Pools pools;
+
+size_t roundUp(size_t size) {
+  return (size + kGranule - 1) / kGranule * kGranule;
+}
+
+}  // namespace
+
+void* FramePool::allocate(size_t size) {
+  if (size == 0 || size > kMaxPooled) {
+    return ::operator new(size);
+  }
+  FreeList& list = pools.forSize(size);
+  if (list.head == nullptr) {
+    return ::operator new(roundUp(size));
+  }
+  --list.count;
+  return std::exchange(list.head, list.head->next);
+}
+
+void FramePool::deallocate(void* frame, size_t size) noexcept {
+  if (size == 0 || size > kMaxPooled) {
+    ::operator delete(frame);
+    return;
+  }
+  FreeList& list = pools.forSize(size);
+  if (list.count >= kMaxCached) {
+    ::operator delete(frame);
+    return;
+  }
+  ++list.count;
+  list.head = new (frame) FreeFrame{list.head};
+}
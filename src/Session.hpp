@@ -0,0 +1,60 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <utility>
+
+// Recycles coroutine frames. All sessions of one coroutine function have
+// frames of the same size, so freed frames wait on a per-thread free list
+// for their size class and are handed out again without touching the heap.
+class FramePool {
+ public:
+  static void* allocate(size_t size);
+  static void deallocate(void* frame, size_t size) noexcept;
+};
+
+// A coroutine running one peer session. It starts right away, runs until
+// its first co_await and from then on is resumed by whatever it waits on.
+// The Session owns the frame and destroys it when it goes away, whether
+// the coroutine finished or is still suspended. Exceptions propagate to
+// whoever resumed it.
+class Session {
+ public:
+  struct promise_type {
+    Session get_return_object() {
+      return Session(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { throw; }
+
+    static void* operator new(size_t size) {
+      return FramePool::allocate(size);
+    }
+    static void operator delete(void* frame, size_t size) noexcept {
+      FramePool::deallocate(frame, size);
+    }
+  };
+
+  Session() = default;
+  Session(Session&& other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)) {}
+  Session& operator=(Session&& other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+  ~Session() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+
+ private:
+  explicit Session(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
@@ -0,0 +1,54 @@
+#include "Transport.hpp"
+
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+TcpTransport::TcpTransport(Reactor& reactor, const sockaddr_storage& address,
+                           std::shared_ptr<RingBuffer> in,
+                           Reactor::Handler* handler)
+    : reactor_(reactor) {
+  socket_ = ::socket(address.ss_family,
+                     SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (socket_ == -1) {
+    throw std::runtime_error("Error creating socket");
+  }
+  socklen_t length = address.ss_family == AF_INET ? sizeof(sockaddr_in)
+                                                  : sizeof(sockaddr_in6);
+  if (connect(socket_, reinterpret_cast<const sockaddr*>(&address),
+              length) == -1 &&
+      errno != EINPROGRESS) {
+    std::string reason = std::strerror(errno);
+    close(socket_);
+    throw std::runtime_error("Error connecting: " + reason);
+  }
+  reactor_.add(socket_, std::move(in), handler);
+  // Writability tells us the connect finished.
+  reactor_.wantWrite(socket_);
+}
+
+TcpTransport::~TcpTransport() {
+  reactor_.remove(socket_);
+  close(socket_);
+}
+
+ssize_t TcpTransport::send(const iovec* iov, size_t count) {
+  msghdr header{};
+  header.msg_iov = const_cast<iovec*>(iov);
+  header.msg_iovlen = count;
+  return sendmsg(socket_, &header, MSG_NOSIGNAL);
+}
+
+void TcpTransport::wantWrite() { reactor_.wantWrite(socket_); }
+
+int TcpTransport::connectError() {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  getsockopt(socket_, SOL_SOCKET, SO_ERROR, &error, &length);
+  return error;
+}
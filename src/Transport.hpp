@@ -0,0 +1,50 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <memory>
+
+#include "Reactor.hpp"
+#include "RingBuffer.hpp"
+
+// The byte stream under a peer connection. Whatever carries it, events
+// reach the connection through the Reactor::Handler interface: onWritable
+// once a connect finished or more output fits, onReceived for input
+// appended to the connection's receive buffer. Destroying a transport
+// closes it.
+class Transport {
+ public:
+  enum class Kind { kTcp, kUtp };
+
+  virtual ~Transport() = default;
+
+  // Takes as much of iov as fits right now, like sendmsg on a non-blocking
+  // socket: returns the bytes taken, or -1 with errno set.
+  virtual ssize_t send(const iovec* iov, size_t count) = 0;
+  // Asks for onWritable once more output fits.
+  virtual void wantWrite() = 0;
+  // After the first onWritable: 0 if the connect succeeded, else its errno.
+  virtual int connectError() = 0;
+};
+
+// A TCP socket driven by the reactor.
+class TcpTransport : public Transport {
+ public:
+  // Starts a non-blocking connect to address; throws std::runtime_error if
+  // it fails right away.
+  TcpTransport(Reactor& reactor, const sockaddr_storage& address,
+               std::shared_ptr<RingBuffer> in, Reactor::Handler* handler);
+  TcpTransport(const TcpTransport&) = delete;
+  TcpTransport& operator=(const TcpTransport&) = delete;
+  ~TcpTransport() override;
+
+  ssize_t send(const iovec* iov, size_t count) override;
+  void wantWrite() override;
+  int connectError() override;
+
+ private:
+  Reactor& reactor_;
+  int socket_ = -1;
+};
@@ -0,0 +1,437 @@
+#include "UdpTracker.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace {
+
+constexpr uint64_t kProtocolId = 0x41727101980;
+constexpr uint32_t kActionConnect = 0;
+constexpr uint32_t kActionAnnounce = 1;
+constexpr uint32_t kActionError = 3;
+constexpr auto kConnectionLifetime = std::chrono::seconds(60);
+
+void put32(unsigned char* out, uint32_t value) {
+  for (int i = 3; i >= 0; --i) {
+    out[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+void put64(unsigned char* out, uint64_t value) {
+  for (int i = 7; i >= 0; --i) {
+    out[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+uint32_t get32(const unsigned char* in) {
+  return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) |
+         (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+}
+
+uint64_t get64(const unsigned char* in) {
+  return (uint64_t(get32(in)) << 32) | get32(in + 4);
+}
+
+uint32_t eventCode(const std::string& event) {
+  if (event == "completed") {
+    return 1;
+  }
+  if (event == "started") {
+    return 2;
+  }
+  if (event == "stopped") {
+    return 3;
+  }
+  return 0;
+}
+
+bool isIPv4(const sockaddr_storage& address) {
+  if (address.ss_family == AF_INET) {
+    return true;
+  }
+  const auto& addr6 = reinterpret_cast<const sockaddr_in6&>(address);
+  return IN6_IS_ADDR_V4MAPPED(&addr6.sin6_addr);
+}
+
+// Looks up the host of a udp:// URL; blocks for as long as DNS takes.
+bool resolveUrl(const std::string& url, int family, sockaddr_storage& address,
+                socklen_t& address_len, std::string& error) {
+  const std::string scheme = "udp://";
+  if (url.compare(0, scheme.size(), scheme) != 0) {
+    error = "Not a UDP tracker URL: " + url;
+    return false;
+  }
+  std::string authority = url.substr(scheme.size());
+  authority = authority.substr(0, authority.find('/'));
+  std::string host;
+  std::string port;
+  if (!authority.empty() && authority[0] == '[') {
+    size_t close_bracket = authority.find(']');
+    if (close_bracket == std::string::npos) {
+      error = "Invalid tracker URL: " + url;
+      return false;
+    }
+    host = authority.substr(1, close_bracket - 1);
+    if (close_bracket + 1 < authority.size() &&
+        authority[close_bracket + 1] == ':') {
+      port = authority.substr(close_bracket + 2);
+    }
+  } else {
+    size_t delim = authority.rfind(':');
+    host = authority.substr(0, delim);
+    if (delim != std::string::npos) {
+      port = authority.substr(delim + 1);
+    }
+  }
+  if (host.empty() || port.empty()) {
+    error = "Invalid tracker URL: " + url;
+    return false;
+  }
+  addrinfo hints{};
+  hints.ai_family = family == AF_INET6 ? AF_UNSPEC : AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* result = nullptr;
+  int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (status != 0 || result == nullptr) {
+    error = "Cannot resolve " + host + ": " + gai_strerror(status);
+    return false;
+  }
+  address = {};
+  if (family == AF_INET6 && result->ai_family == AF_INET) {
+    // The dual-stack socket reaches IPv4 trackers through mapped addresses.
+    const auto* addr4 = reinterpret_cast<const sockaddr_in*>(result->ai_addr);
+    auto& addr6 = reinterpret_cast<sockaddr_in6&>(address);
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = addr4->sin_port;
+    addr6.sin6_addr.s6_addr[10] = 0xff;
+    addr6.sin6_addr.s6_addr[11] = 0xff;
+    std::memcpy(&addr6.sin6_addr.s6_addr[12], &addr4->sin_addr, 4);
+    address_len = sizeof(sockaddr_in6);
+  } else {
+    std::memcpy(&address, result->ai_addr, result->ai_addrlen);
+    address_len = result->ai_addrlen;
+  }
+  freeaddrinfo(result);
+  return true;
+}
+
+bool sameAddress(const sockaddr_storage& a, const sockaddr_storage& b) {
+  if (a.ss_family != b.ss_family) {
+    return false;
+  }
+  if (a.ss_family == AF_INET) {
+    const auto& a4 = reinterpret_cast<const sockaddr_in&>(a);
+    const auto& b4 = reinterpret_cast<const sockaddr_in&>(b);
+    return a4.sin_port == b4.sin_port &&
+           a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+  }
+  const auto& a6 = reinterpret_cast<const sockaddr_in6&>(a);
+  const auto& b6 = reinterpret_cast<const sockaddr_in6&>(b);
+  return a6.sin6_port == b6.sin6_port &&
+         IN6_ARE_ADDR_EQUAL(&a6.sin6_addr, &b6.sin6_addr);
+}
+
+}  // namespace
+
+UdpTracker::UdpTracker(std::chrono::milliseconds base_timeout, int max_retries)
+    : base_timeout_(base_timeout), max_retries_(max_retries) {
+  socket_ = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (socket_ != -1) {
+    int off = 0;
+    setsockopt(socket_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  } else {
+    family_ = AF_INET;
+    socket_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  }
+  if (socket_ == -1) {
+    throw std::runtime_error("Error creating UDP tracker socket");
+  }
+  std::random_device rd;
+  key_ = rd();
+  next_transaction_id_ = rd();
+}
+
+UdpTracker::~UdpTracker() { close(socket_); }
+
+std::vector<UdpAnnounceResponse> UdpTracker::announce(
+    const std::vector<UdpAnnounceRequest>& requests) {
+  for (const auto& request : requests) {
+    submit(request);
+  }
+  while (!idle()) {
+    pollfd pfd{socket_, POLLIN, 0};
+    int ready = poll(&pfd, 1, static_cast<int>(nextTimeout().count()));
+    if (ready < 0 && errno != EINTR) {
+      throw std::runtime_error("Error polling UDP tracker socket");
+    }
+    if (ready > 0) {
+      onReadable();
+    }
+    onTimeout();
+  }
+  auto responses = takeFinished();
+  std::sort(responses.begin(), responses.end(),
+            [](const auto& a, const auto& b) { return a.id < b.id; });
+  return responses;
+}
+
+uint64_t UdpTracker::submit(const UdpAnnounceRequest& request) {
+  Pending pending{};
+  pending.id = next_id_++;
+  pending.request = request;
+  pending.attempt = 0;
+  pending_.push_back(std::move(pending));
+  auto address = addresses_.find(request.url);
+  if (address != addresses_.end()) {
+    startAnnounce(pending_.back(), address->second);
+  } else {
+    // Waits for the resolver; onTimeout() takes it from there.
+    pending_.back().stage = Stage::kResolving;
+    pending_.back().deadline = std::chrono::steady_clock::time_point::max();
+    resolve(request.url);
+  }
+  return pending_.back().id;
+}
+
+void UdpTracker::cancel(uint64_t id) {
+  std::erase_if(pending_,
+                [&](const auto& pending) { return pending.id == id; });
+  std::erase_if(finished_,
+                [&](const auto& response) { return response.id == id; });
+}
+
+std::chrono::milliseconds UdpTracker::nextTimeout() const {
+  if (pending_.empty()) {
+    return std::chrono::milliseconds(-1);
+  }
+  auto now = std::chrono::steady_clock::now();
+  auto earliest = pending_.front().deadline;
+  for (const auto& pending : pending_) {
+    earliest = std::min(earliest, pending.deadline);
+  }
+  if (!resolving_.empty()) {
+    earliest = std::min(earliest, now + kResolvePollInterval);
+  }
+  if (earliest <= now) {
+    return std::chrono::milliseconds(0);
+  }
+  return std::chrono::ceil<std::chrono::milliseconds>(earliest - now);
+}
+
+void UdpTracker::onReadable() {
+  std::array<unsigned char, 65536> buffer{};
+  while (true) {
+    sockaddr_storage from{};
+    socklen_t from_len = sizeof(from);
+    ssize_t size = recvfrom(socket_, buffer.data(), buffer.size(), 0,
+                            reinterpret_cast<sockaddr*>(&from), &from_len);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (size < 8) {
+      continue;
+    }
+    uint32_t action = get32(buffer.data());
+    uint32_t transaction_id = get32(buffer.data() + 4);
+    auto it = std::find_if(pending_.begin(), pending_.end(), [&](auto& p) {
+      return p.stage != Stage::kResolving &&
+             p.transaction_id == transaction_id &&
+             sameAddress(p.address, from);
+    });
+    if (it == pending_.end()) {
+      continue;
+    }
+    size_t index = it - pending_.begin();
+    Pending& pending = *it;
+    if (action == kActionError) {
+      fail(index, std::string(reinterpret_cast<char*>(buffer.data()) + 8,
+                              size - 8));
+      continue;
+    }
+    if (pending.stage == Stage::kConnecting && action == kActionConnect &&
+        size >= 16) {
+      connections_[pending.key] = {
+          get64(buffer.data() + 8),
+          std::chrono::steady_clock::now() + kConnectionLifetime};
+      pending.stage = Stage::kAnnouncing;
+      pending.attempt = 0;
+      sendCurrent(pending);
+    } else if (pending.stage == Stage::kAnnouncing &&
+               action == kActionAnnounce && size >= 20) {
+      UdpAnnounceResponse response;
+      response.id = pending.id;
+      response.url = pending.request.url;
+      response.ok = true;
+      response.interval = get32(buffer.data() + 8);
+      response.leechers = get32(buffer.data() + 12);
+      response.seeders = get32(buffer.data() + 16);
+      std::string peers(reinterpret_cast<char*>(buffer.data()) + 20,
+                        size - 20);
+      if (isIPv4(pending.address)) {
+        peers.resize(peers.size() - peers.size() % 6);
+        response.peers = std::move(peers);
+      } else {
+        peers.resize(peers.size() - peers.size() % 18);
+        response.peers6 = std::move(peers);
+      }
+      finished_.push_back(std::move(response));
+      pending_.erase(it);
+    }
+  }
+}
+
+void UdpTracker::onTimeout() {
+  takeResolved();
+  auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < pending_.size();) {
+    Pending& pending = pending_[i];
+    if (pending.deadline > now) {
+      ++i;
+      continue;
+    }
+    if (pending.attempt >= max_retries_) {
+      fail(i, "Tracker timed out");
+      continue;
+    }
+    ++pending.attempt;
+    // An expired connection id has to be renewed before the retry.
+    if (pending.stage == Stage::kAnnouncing &&
+        !cachedConnection(pending.key)) {
+      pending.stage = Stage::kConnecting;
+    }
+    sendCurrent(pending);
+    ++i;
+  }
+}
+
+std::vector<UdpAnnounceResponse> UdpTracker::takeFinished() {
+  return std::exchange(finished_, {});
+}
+
+void UdpTracker::resolve(const std::string& url) {
+  if (!resolving_.insert(url).second) {
+    return;
+  }
+  std::thread([resolver = resolver_, family = family_, url] {
+    Lookup lookup{url, std::nullopt, ""};
+    Address address{};
+    if (resolveUrl(url, family, address.address, address.address_len,
+                   lookup.error)) {
+      lookup.address = address;
+    }
+    std::lock_guard lock(resolver->mutex);
+    resolver->done.push_back(std::move(lookup));
+  }).detach();
+}
+
+void UdpTracker::takeResolved() {
+  if (resolving_.empty()) {
+    return;
+  }
+  std::vector<Lookup> done;
+  {
+    std::lock_guard lock(resolver_->mutex);
+    done = std::exchange(resolver_->done, {});
+  }
+  for (const auto& lookup : done) {
+    resolving_.erase(lookup.url);
+    if (lookup.address) {
+      addresses_[lookup.url] = *lookup.address;
+    }
+    for (size_t i = 0; i < pending_.size();) {
+      Pending& pending = pending_[i];
+      if (pending.stage != Stage::kResolving ||
+          pending.request.url != lookup.url) {
+        ++i;
+      } else if (!lookup.address) {
+        fail(i, lookup.error);
+      } else {
+        startAnnounce(pending, *lookup.address);
+        ++i;
+      }
+    }
+  }
+}
+
+void UdpTracker::startAnnounce(Pending& pending, const Address& address) {
+  pending.address = address.address;
+  pending.address_len = address.address_len;
+  pending.key.assign(reinterpret_cast<const char*>(&pending.address),
+                     pending.address_len);
+  pending.stage = cachedConnection(pending.key) ? Stage::kAnnouncing
+                                                : Stage::kConnecting;
+  sendCurrent(pending);
+}
+
+void UdpTracker::sendCurrent(Pending& pending) {
+  pending.transaction_id = next_transaction_id_++;
+  std::array<unsigned char, 98> packet{};
+  size_t size;
+  if (pending.stage == Stage::kConnecting) {
+    put64(packet.data(), kProtocolId);
+    put32(packet.data() + 8, kActionConnect);
+    put32(packet.data() + 12, pending.transaction_id);
+    size = 16;
+  } else {
+    const auto& request = pending.request;
+    put64(packet.data(), *cachedConnection(pending.key));
+    put32(packet.data() + 8, kActionAnnounce);
+    put32(packet.data() + 12, pending.transaction_id);
+    std::memcpy(packet.data() + 16, request.info_hash.data(),
+                std::min<size_t>(request.info_hash.size(), 20));
+    std::memcpy(packet.data() + 36, request.peer_id.data(),
+                std::min<size_t>(request.peer_id.size(), 20));
+    put64(packet.data() + 56, request.downloaded);
+    put64(packet.data() + 64, request.left);
+    put64(packet.data() + 72, request.uploaded);
+    put32(packet.data() + 80, eventCode(request.event));
+    put32(packet.data() + 84, 0);
+    put32(packet.data() + 88, key_);
+    put32(packet.data() + 92, static_cast<uint32_t>(-1));
+    packet[96] = request.port >> 8;
+    packet[97] = request.port & 0xff;
+    size = 98;
+  }
+  // A failed send is treated like a lost datagram and retried on timeout.
+  sendto(socket_, packet.data(), size, 0,
+         reinterpret_cast<const sockaddr*>(&pending.address),
+         pending.address_len);
+  pending.deadline =
+      std::chrono::steady_clock::now() + base_timeout_ * (1 << pending.attempt);
+}
+
+void UdpTracker::fail(size_t index, const std::string& error) {
+  UdpAnnounceResponse response;
+  response.id = pending_[index].id;
+  response.url = pending_[index].request.url;
+  response.error = error;
+  finished_.push_back(std::move(response));
+  pending_.erase(pending_.begin() + index);
+}
+
+std::optional<uint64_t> UdpTracker::cachedConnection(
+    const std::string& key) const {
+  auto it = connections_.find(key);
+  if (it == connections_.end() ||
+      it->second.expires <= std::chrono::steady_clock::now()) {
+    return std::nullopt;
+  }
+  return it->second.connection_id;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+// Announce parameters for one torrent on one udp:// tracker (BEP 15).
+struct UdpAnnounceRequest {
+  std::string url;
+  std::string info_hash;
+  std::string peer_id;
+  uint64_t downloaded = 0;
+  uint64_t left = 0;
+  uint64_t uploaded = 0;
+  std::string event;
+  uint16_t port = 6881;
+};
+
+struct UdpAnnounceResponse {
+  uint64_t id = 0;
+  std::string url;
+  bool ok = false;
+  std::string error;
+  uint32_t interval = 0;
+  uint32_t leechers = 0;
+  uint32_t seeders = 0;
+  // Compact peer lists in the same layout HTTP trackers use for "peers" and
+  // "peers6" (6 and 18 bytes per entry).
+  std::string peers;
+  std::string peers6;
+};
+
+// UDP tracker client. Every announce goes through one socket; connection ids
+// are cached per tracker address for their one-minute lifetime and lost
+// datagrams are retransmitted with exponential backoff (timeout * 2^n).
+// Tracker hostnames are resolved once each, on threads of their own, so a
+// slow DNS server holds up neither the caller nor other trackers; responses
+// are only accepted from the address the request went to.
+//
+// announce() runs a batch to completion. submit()/fd()/onReadable()/
+// onTimeout() expose the same state machine to an external poll loop.
+class UdpTracker {
+ public:
+  explicit UdpTracker(
+      std::chrono::milliseconds base_timeout = std::chrono::seconds(15),
+      int max_retries = 8);
+  UdpTracker(const UdpTracker&) = delete;
+  UdpTracker& operator=(const UdpTracker&) = delete;
+  ~UdpTracker();
+
+  std::vector<UdpAnnounceResponse> announce(
+      const std::vector<UdpAnnounceRequest>& requests);
+
+  // Queues an announce and sends its first datagram. Returns an id that is
+  // echoed in the matching response.
+  uint64_t submit(const UdpAnnounceRequest& request);
+  // Drops a submitted announce; its response is ignored if it still arrives.
+  void cancel(uint64_t id);
+  int fd() const { return socket_; }
+  bool idle() const { return pending_.empty(); }
+  // Time until the earliest retransmit deadline, zero if one is overdue.
+  // While hostnames are being resolved it is at most kResolvePollInterval,
+  // as their results are picked up by onTimeout().
+  std::chrono::milliseconds nextTimeout() const;
+  void onReadable();
+  void onTimeout();
+  std::vector<UdpAnnounceResponse> takeFinished();
+
+ private:
+  enum class Stage { kResolving, kConnecting, kAnnouncing };
+
+  struct Pending {
+    uint64_t id;
+    UdpAnnounceRequest request;
+    sockaddr_storage address;
+    socklen_t address_len;
+    std::string key;
+    Stage stage;
+    uint32_t transaction_id;
+    int attempt;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  struct Address {
+    sockaddr_storage address;
+    socklen_t address_len;
+  };
+
+  struct Lookup {
+    std::string url;
+    std::optional<Address> address;
+    std::string error;
+  };
+  // Finished lookups. Shared with the resolver threads, which are detached
+  // so that a hung lookup cannot hold up our destructor.
+  struct Resolver {
+    std::mutex mutex;
+    std::vector<Lookup> done;
+  };
+
+  static constexpr std::chrono::milliseconds kResolvePollInterval{10};
+
+  struct CachedConnection {
+    uint64_t connection_id;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  void sendCurrent(Pending& pending);
+  void fail(size_t index, const std::string& error);
+  std::optional<uint64_t> cachedConnection(const std::string& key) const;
+  // Starts resolving a tracker URL on a thread of its own.
+  void resolve(const std::string& url);
+  // Sends the first datagram of announces whose tracker got resolved and
+  // fails those whose tracker could not be.
+  void takeResolved();
+  void startAnnounce(Pending& pending, const Address& address);
+
+  int socket_ = -1;
+  int family_ = AF_INET6;
+  uint32_t key_;
+  uint32_t next_transaction_id_;
+  uint64_t next_id_ = 1;
+  std::chrono::milliseconds base_timeout_;
+  int max_retries_;
+  std::vector<Pending> pending_;
+  std::vector<UdpAnnounceResponse> finished_;
+  std::map<std::string, CachedConnection> connections_;
+  // Resolved tracker addresses by URL, and URLs still being resolved.
+  std::map<std::string, Address> addresses_;
+  std::set<std::string> resolving_;
+  std::shared_ptr<Resolver> resolver_ = std::make_shared<Resolver>();
+};
@@ -0,0 +1,786 @@
+#include "Utp.hpp"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+// Packet types and the protocol version, the first byte of every header.
+constexpr uint8_t kStData = 0;
+constexpr uint8_t kStFin = 1;
+constexpr uint8_t kStState = 2;
+constexpr uint8_t kStReset = 3;
+constexpr uint8_t kStSyn = 4;
+constexpr uint8_t kVersion = 1;
+constexpr uint8_t kExtSelectiveAck = 1;
+constexpr size_t kHeaderSize = 20;
+
+// Payload per packet, so that a packet with a selective ack still fits a
+// 1500-byte Ethernet frame over IPv6.
+constexpr size_t kMaxPayload = 1400;
+// Bytes send() takes before the caller has to wait for onWritable.
+constexpr size_t kSendBufferSize = 256 * 1024;
+// Selective acks cover this many packets past the first missing one.
+constexpr size_t kSackBytes = 8;
+// Packets further ahead of the next expected one are dropped.
+constexpr int kReorderLimit = 4096;
+
+// LEDBAT: the queueing delay aimed for and the most the window grows by
+// per round trip when there is none.
+constexpr double kTargetDelayMicros = 100000;
+constexpr double kMaxWindowGain = 3000;
+constexpr double kMinWindow = kMaxPayload;
+constexpr double kInitialWindow = 4 * kMaxPayload;
+constexpr double kMaxWindow = 4 << 20;
+
+constexpr std::chrono::microseconds kInitialTimeout{1000000};
+constexpr std::chrono::microseconds kMinTimeout{500000};
+constexpr std::chrono::microseconds kMaxTimeout{30000000};
+// Sends of one packet before the connection is given up.
+constexpr int kMaxTransmissions = 6;
+constexpr std::chrono::seconds kDelayBucket{60};
+
+void put16(unsigned char* out, uint16_t value) {
+  uint16_t network = htons(value);
+  std::memcpy(out, &network, sizeof(network));
+}
+
+void put32(unsigned char* out, uint32_t value) {
+  uint32_t network = htonl(value);
+  std::memcpy(out, &network, sizeof(network));
+}
+
+uint16_t get16(const unsigned char* in) {
+  uint16_t network;
+  std::memcpy(&network, in, sizeof(network));
+  return ntohs(network);
+}
+
+uint32_t get32(const unsigned char* in) {
+  uint32_t network;
+  std::memcpy(&network, in, sizeof(network));
+  return ntohl(network);
+}
+
+// Microsecond timestamps wrap around every 71 minutes; only differences
+// are ever looked at.
+uint32_t micros(std::chrono::steady_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+// Signed distance from b to a in sequence number space.
+int16_t seqDistance(uint16_t a, uint16_t b) {
+  return static_cast<int16_t>(a - b);
+}
+
+socklen_t addressLength(const sockaddr_storage& address) {
+  return address.ss_family == AF_INET ? sizeof(sockaddr_in)
+                                      : sizeof(sockaddr_in6);
+}
+
+}  // namespace
+
+UtpStream::UtpStream(UtpSocket& socket, const sockaddr_storage& peer,
+                     uint16_t recv_id, uint16_t send_id)
+    : socket_(socket),
+      peer_(peer),
+      recv_id_(recv_id),
+      send_id_(send_id),
+      max_window_(kInitialWindow),
+      peer_window_(kMaxPayload),
+      rto_(kInitialTimeout),
+      delay_bucket_start_(std::chrono::steady_clock::now()) {}
+
+UtpStream::~UtpStream() {
+  if (state_ == State::kConnected) {
+    socket_.queue(peer_, kStFin, send_id_, reply_micro_, receiveWindow(),
+                  seq_nr_++, ack_nr_, nullptr, 0, {});
+  }
+  socket_.streams_.erase(socket_.key(peer_, recv_id_));
+  std::erase(socket_.acks_, this);
+  if (notifying_) {
+    std::replace(socket_.notify_.begin(), socket_.notify_.end(), this,
+                 static_cast<UtpStream*>(nullptr));
+  }
+}
+
+ssize_t UtpStream::send(const iovec* iov, size_t count) {
+  if (state_ == State::kClosed) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  size_t room = kSendBufferSize - unsentSize();
+  size_t taken = 0;
+  for (size_t i = 0; i < count && taken < room; ++i) {
+    size_t n = std::min(iov[i].iov_len, room - taken);
+    unsent_.append(static_cast<const char*>(iov[i].iov_base), n);
+    taken += n;
+  }
+  trySend(std::chrono::steady_clock::now());
+  return taken;
+}
+
+void UtpStream::wantWrite() {
+  want_write_ = true;
+  if (state_ != State::kSynSent && unsentSize() < kSendBufferSize / 2) {
+    want_write_ = false;
+    writable_event_ = true;
+    notify();
+  }
+}
+
+void UtpStream::attach(std::shared_ptr<RingBuffer> in,
+                       Reactor::Handler* handler) {
+  in_ = std::move(in);
+  handler_ = handler;
+}
+
+void UtpStream::onPacket(uint8_t type, const unsigned char* header,
+                         const unsigned char* sack, size_t sack_size,
+                         const unsigned char* payload, size_t size,
+                         std::chrono::steady_clock::time_point now) {
+  if (state_ == State::kClosed) {
+    return;
+  }
+  uint32_t timestamp = get32(header + 4);
+  uint32_t delay = get32(header + 8);
+  uint16_t seq = get16(header + 16);
+  uint16_t ack = get16(header + 18);
+  reply_micro_ = micros(now) - timestamp;
+  peer_window_ = get32(header + 12);
+  if (type == kStReset) {
+    fail(state_ == State::kSynSent ? ECONNREFUSED : ECONNRESET);
+    return;
+  }
+  if (state_ == State::kSynSent) {
+    if (type != kStState) {
+      return;
+    }
+    // The acceptor's first data packet carries the number of this ack.
+    state_ = State::kConnected;
+    ack_nr_ = seq - 1;
+    connected_event_ = true;
+    notify();
+  }
+  acknowledge(ack, sack, sack_size, delay, now);
+  if (type == kStData || type == kStFin) {
+    receive(seq, type == kStFin, payload, size);
+  }
+  trySend(now);
+  if (want_write_ && unsentSize() < kSendBufferSize / 2) {
+    want_write_ = false;
+    writable_event_ = true;
+    notify();
+  }
+}
+
+// Drops the packets ack_nr and the selective ack cover, feeding round
+// trip and delay samples into the timeout and the window. A packet that
+// three later ones overtook is taken as lost and sent again.
+void UtpStream::acknowledge(uint16_t ack_nr, const unsigned char* sack,
+                            size_t sack_size, uint32_t delay,
+                            std::chrono::steady_clock::time_point now) {
+  if (seqDistance(ack_nr, seq_nr_) >= 0) {
+    // Acks something never sent.
+    return;
+  }
+  size_t bytes_acked = 0;
+  auto acked = [&](const Packet& packet) {
+    if (packet.transmissions == 1) {
+      sampleRtt(now - packet.sent);
+    }
+    bytes_acked += packet.payload.size();
+    bytes_in_flight_ -= packet.payload.size();
+  };
+  while (!in_flight_.empty() &&
+         seqDistance(in_flight_.front().seq, ack_nr) <= 0) {
+    acked(in_flight_.front());
+    in_flight_.pop_front();
+  }
+  if (sack != nullptr) {
+    auto sacked = [&](int bit) {
+      return bit >= 0 && static_cast<size_t>(bit) < sack_size * 8 &&
+             (sack[bit / 8] & (1 << (bit % 8)));
+    };
+    std::erase_if(in_flight_, [&](const Packet& packet) {
+      if (!sacked(seqDistance(packet.seq, ack_nr + 2))) {
+        return false;
+      }
+      acked(packet);
+      return true;
+    });
+    for (auto& packet : in_flight_) {
+      int bit = seqDistance(packet.seq, ack_nr + 2);
+      int later = 0;
+      for (int b = std::max(bit + 1, 0); b < static_cast<int>(sack_size * 8);
+           ++b) {
+        later += sacked(b);
+      }
+      if (later >= 3 && !packet.resent) {
+        packet.resent = true;
+        onLoss(packet);
+        transmit(packet, now);
+      }
+    }
+  }
+  if (bytes_acked > 0 || in_flight_.empty()) {
+    rto_deadline_ = now + rto_;
+  }
+  if (bytes_acked > 0) {
+    updateWindow(bytes_acked, delay, now);
+  }
+}
+
+void UtpStream::sampleRtt(std::chrono::steady_clock::duration rtt) {
+  auto sample = std::chrono::duration_cast<std::chrono::microseconds>(rtt);
+  if (rtt_.count() == 0) {
+    rtt_ = sample;
+    rtt_var_ = sample / 2;
+  } else {
+    rtt_var_ += (std::chrono::abs(rtt_ - sample) - rtt_var_) / 4;
+    rtt_ += (sample - rtt_) / 8;
+  }
+  rto_ = std::max(rtt_ + 4 * rtt_var_, kMinTimeout);
+}
+
+// LEDBAT (RFC 6817) as BEP 29 applies it: the delay the peer reports for
+// our packets, less the smallest such delay of the last two minutes, is
+// our queueing delay. Below the target the window grows by up to
+// kMaxWindowGain per round trip, above it it shrinks. Until the delay first
+// reaches half the target the window doubles every round trip instead.
+void UtpStream::updateWindow(size_t bytes_acked, uint32_t delay,
+                             std::chrono::steady_clock::time_point now) {
+  double off_target = 1;
+  if (delay != 0) {
+    if (now - delay_bucket_start_ > kDelayBucket) {
+      delay_min_previous_ = delay_min_current_;
+      delay_min_current_ = UINT32_MAX;
+      delay_bucket_start_ = now;
+    }
+    delay_min_current_ = std::min(delay_min_current_, delay);
+    uint32_t base = std::min(delay_min_current_, delay_min_previous_);
+    double queueing = static_cast<uint32_t>(delay - base);
+    off_target = (kTargetDelayMicros - queueing) / kTargetDelayMicros;
+  }
+  if (slow_start_ && off_target > 0.5) {
+    max_window_ += bytes_acked;
+  } else {
+    slow_start_ = false;
+    double acked = static_cast<double>(bytes_acked);
+    double window_factor =
+        std::min(acked, max_window_) / std::max(max_window_, acked);
+    max_window_ += kMaxWindowGain * off_target * window_factor;
+  }
+  max_window_ = std::clamp(max_window_, kMinWindow, kMaxWindow);
+}
+
+// Halves the window once per loss event: losses of packets sent before
+// the last cut are part of it.
+void UtpStream::onLoss(const Packet& packet) {
+  if (loss_seen_ && seqDistance(packet.seq, loss_seq_) <= 0) {
+    return;
+  }
+  loss_seen_ = true;
+  loss_seq_ = seq_nr_ - 1;
+  slow_start_ = false;
+  max_window_ = std::max(max_window_ / 2, kMinWindow);
+}
+
+void UtpStream::receive(uint16_t seq, bool fin, const unsigned char* payload,
+                        size_t size) {
+  if (!ack_due_) {
+    ack_due_ = true;
+    socket_.acks_.push_back(this);
+  }
+  int distance = seqDistance(seq, ack_nr_ + 1);
+  if (distance < 0) {
+    // A duplicate; the ack tells the peer again.
+    return;
+  }
+  if (distance > 0) {
+    if (distance < kReorderLimit && size <= receiveWindow() &&
+        reorder_.count(seq) == 0) {
+      reorder_[seq] = {fin, std::string(payload, payload + size)};
+      reorder_bytes_ += size;
+    }
+    return;
+  }
+  if (!deliver(fin, payload, size)) {
+    return;
+  }
+  ack_nr_ = seq;
+  for (auto it = reorder_.find(ack_nr_ + 1); it != reorder_.end();
+       it = reorder_.find(ack_nr_ + 1)) {
+    const auto& data = it->second.data;
+    if (!deliver(it->second.fin,
+                 reinterpret_cast<const unsigned char*>(data.data()),
+                 data.size())) {
+      break;
+    }
+    reorder_bytes_ -= data.size();
+    ++ack_nr_;
+    reorder_.erase(it);
+  }
+}
+
+// Appends in-order input to the receive buffer. Returns false, leaving
+// the packet unacked, if it does not fit.
+bool UtpStream::deliver(bool fin, const unsigned char* payload,
+                        size_t size) {
+  if (fin) {
+    eof_event_ = true;
+    notify();
+    return true;
+  }
+  if (in_ == nullptr || in_->space() < size) {
+    return false;
+  }
+  std::memcpy(in_->freeSpace(), payload, size);
+  in_->produce(size);
+  received_event_ += size;
+  notify();
+  return true;
+}
+
+// Cuts packets from the unsent bytes while the windows allow. With nothing
+// in flight one packet always goes, which probes a closed peer window.
+void UtpStream::trySend(std::chrono::steady_clock::time_point now) {
+  if (state_ != State::kConnected) {
+    return;
+  }
+  while (unsent_head_ < unsent_.size()) {
+    size_t size = std::min(unsentSize(), kMaxPayload);
+    size_t window = std::min(static_cast<size_t>(max_window_), peer_window_);
+    if (!in_flight_.empty() && bytes_in_flight_ + size > window) {
+      break;
+    }
+    Packet packet;
+    packet.seq = seq_nr_++;
+    packet.type = kStData;
+    packet.payload.assign(unsent_, unsent_head_, size);
+    unsent_head_ += size;
+    if (in_flight_.empty()) {
+      rto_deadline_ = now + rto_;
+    }
+    bytes_in_flight_ += size;
+    in_flight_.push_back(std::move(packet));
+    transmit(in_flight_.back(), now);
+  }
+  if (unsent_head_ == unsent_.size()) {
+    unsent_.clear();
+    unsent_head_ = 0;
+  } else if (unsent_head_ > unsent_.size() / 2) {
+    unsent_.erase(0, unsent_head_);
+    unsent_head_ = 0;
+  }
+}
+
+// Every packet carries the current ack, so a pending ack goes with it.
+void UtpStream::transmit(Packet& packet,
+                         std::chrono::steady_clock::time_point now) {
+  packet.sent = now;
+  ++packet.transmissions;
+  advertised_window_ = receiveWindow();
+  ack_due_ = false;
+  socket_.queue(peer_, packet.type,
+                packet.type == kStSyn ? recv_id_ : send_id_, reply_micro_,
+                advertised_window_, packet.seq, ack_nr_, nullptr, 0,
+                packet.payload);
+}
+
+void UtpStream::sendAck() {
+  std::array<unsigned char, kSackBytes> sack{};
+  bool selective = false;
+  for (const auto& [seq, received] : reorder_) {
+    int bit = seqDistance(seq, ack_nr_ + 2);
+    if (bit >= 0 && bit < static_cast<int>(kSackBytes * 8)) {
+      sack[bit / 8] |= 1 << (bit % 8);
+      selective = true;
+    }
+  }
+  advertised_window_ = receiveWindow();
+  ack_due_ = false;
+  socket_.queue(peer_, kStState, send_id_, reply_micro_, advertised_window_,
+                seq_nr_, ack_nr_, selective ? sack.data() : nullptr,
+                selective ? sack.size() : 0, {});
+}
+
+// Resends the oldest packet once its timeout passed, with the window back
+// at its minimum, and tells the peer when our receive window reopened
+// after it had been nearly closed.
+void UtpStream::tick(std::chrono::steady_clock::time_point now) {
+  if (state_ == State::kClosed) {
+    return;
+  }
+  if (!in_flight_.empty() && now >= rto_deadline_) {
+    Packet& packet = in_flight_.front();
+    if (packet.transmissions >= kMaxTransmissions) {
+      fail(ETIMEDOUT);
+      return;
+    }
+    if (state_ == State::kConnected) {
+      onLoss(packet);
+      max_window_ = kMinWindow;
+    }
+    rto_ = std::min(rto_ * 2, kMaxTimeout);
+    rto_deadline_ = now + rto_;
+    transmit(packet, now);
+  }
+  if (state_ == State::kConnected && advertised_window_ < kMaxPayload &&
+      receiveWindow() >= kMaxPayload) {
+    sendAck();
+  }
+}
+
+void UtpStream::fail(int error) {
+  if (state_ == State::kSynSent) {
+    connect_error_ = error;
+    connected_event_ = true;
+  } else {
+    error_event_ = error;
+  }
+  state_ = State::kClosed;
+  in_flight_.clear();
+  bytes_in_flight_ = 0;
+  notify();
+}
+
+size_t UtpStream::receiveWindow() const {
+  if (in_ == nullptr || in_->space() < reorder_bytes_) {
+    return 0;
+  }
+  return in_->space() - reorder_bytes_;
+}
+
+void UtpStream::notify() {
+  if (!notifying_) {
+    notifying_ = true;
+    socket_.notify_.push_back(this);
+  }
+}
+
+// The handler may destroy the stream from any of its callbacks, so only
+// copies are used once the first one runs.
+void UtpStream::dispatch() {
+  Reactor::Handler* handler = handler_;
+  bool connected = std::exchange(connected_event_, false);
+  size_t received = std::exchange(received_event_, 0);
+  bool writable = std::exchange(writable_event_, false);
+  bool eof = std::exchange(eof_event_, false);
+  int error = std::exchange(error_event_, 0);
+  if (handler == nullptr) {
+    return;
+  }
+  if (connected) {
+    handler->onWritable();
+  }
+  if (received > 0) {
+    handler->onReceived(received);
+  }
+  if (writable) {
+    handler->onWritable();
+  }
+  if (eof) {
+    handler->onReceived(0);
+  }
+  if (error != 0) {
+    handler->onReceived(-error);
+  }
+}
+
+UtpSocket::UtpSocket(uint16_t port) {
+  fd_ = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int result = -1;
+  if (fd_ != -1) {
+    int off = 0;
+    setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    sockaddr_in6 address{};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    result = bind(fd_, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address));
+  } else {
+    family_ = AF_INET;
+    fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ != -1) {
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_ANY);
+      address.sin_port = htons(port);
+      result = bind(fd_, reinterpret_cast<sockaddr*>(&address),
+                    sizeof(address));
+    }
+  }
+  if (result == -1) {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+    throw std::runtime_error("Error binding uTP socket");
+  }
+  // Room for whole windows of several connections between two reads.
+  int buffer = 4 << 20;
+  setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+  setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+}
+
+UtpSocket::~UtpSocket() { close(fd_); }
+
+std::unique_ptr<UtpStream> UtpSocket::connect(const sockaddr_storage& peer,
+                                              std::shared_ptr<RingBuffer> in,
+                                              Reactor::Handler* handler) {
+  uint16_t recv_id;
+  do {
+    recv_id = random_();
+  } while (streams_.count(key(peer, recv_id)) != 0);
+  std::unique_ptr<UtpStream> stream(
+      new UtpStream(*this, peer, recv_id, recv_id + 1));
+  stream->attach(std::move(in), handler);
+  streams_[key(peer, recv_id)] = stream.get();
+  auto now = std::chrono::steady_clock::now();
+  UtpStream::Packet syn;
+  syn.seq = stream->seq_nr_++;
+  syn.type = kStSyn;
+  stream->rto_deadline_ = now + stream->rto_;
+  stream->in_flight_.push_back(std::move(syn));
+  stream->transmit(stream->in_flight_.back(), now);
+  return stream;
+}
+
+void UtpSocket::onReadable() {
+  std::array<mmsghdr, kBatch> messages{};
+  std::array<iovec, kBatch> iov{};
+  std::array<sockaddr_storage, kBatch> from{};
+  while (true) {
+    for (size_t i = 0; i < kBatch; ++i) {
+      iov[i] = {in_[i].data(), in_[i].size()};
+      messages[i].msg_hdr = {};
+      messages[i].msg_hdr.msg_name = &from[i];
+      messages[i].msg_hdr.msg_namelen = sizeof(from[i]);
+      messages[i].msg_hdr.msg_iov = &iov[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(fd_, messages.data(), kBatch, MSG_DONTWAIT, nullptr);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i) {
+      handleDatagram(fromSocket(from[i]), in_[i].data(), messages[i].msg_len,
+                     now);
+    }
+    if (static_cast<size_t>(count) < kBatch) {
+      break;
+    }
+  }
+  for (UtpStream* stream : acks_) {
+    if (stream->ack_due_) {
+      stream->sendAck();
+    }
+  }
+  acks_.clear();
+  dispatch();
+  flush();
+}
+
+void UtpSocket::tick() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto& [key, stream] : streams_) {
+    stream->tick(now);
+  }
+  dispatch();
+  flush();
+}
+
+void UtpSocket::flush() {
+  std::array<mmsghdr, kBatch> messages{};
+  std::array<iovec, kBatch> iov{};
+  std::array<sockaddr_storage, kBatch> to{};
+  for (size_t i = 0; i < out_count_; ++i) {
+    to[i] = toSocket(out_peer_[i]);
+    iov[i] = {out_[i].data(), out_size_[i]};
+    messages[i].msg_hdr.msg_name = &to[i];
+    messages[i].msg_hdr.msg_namelen = addressLength(to[i]);
+    messages[i].msg_hdr.msg_iov = &iov[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  size_t sent = 0;
+  while (sent < out_count_) {
+    int count = sendmmsg(fd_, messages.data() + sent, out_count_ - sent, 0);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Lost like any datagram; retransmission takes care of it.
+      break;
+    }
+    // A datagram the kernel refused is skipped.
+    sent += count < 0 ? 1 : count;
+  }
+  out_count_ = 0;
+}
+
+void UtpSocket::handleDatagram(const sockaddr_storage& from,
+                               const unsigned char* data, size_t size,
+                               std::chrono::steady_clock::time_point now) {
+  if (size < kHeaderSize || (data[0] & 0x0f) != kVersion) {
+    return;
+  }
+  uint8_t type = data[0] >> 4;
+  if (type > kStSyn) {
+    return;
+  }
+  const unsigned char* sack = nullptr;
+  size_t sack_size = 0;
+  size_t offset = kHeaderSize;
+  for (uint8_t extension = data[1]; extension != 0;) {
+    if (size - offset < 2 || size - offset - 2 < data[offset + 1]) {
+      return;
+    }
+    if (extension == kExtSelectiveAck) {
+      sack = data + offset + 2;
+      sack_size = data[offset + 1];
+    }
+    extension = data[offset];
+    offset += 2 + data[offset + 1];
+  }
+  uint16_t id = get16(data + 2);
+  uint16_t seq = get16(data + 16);
+  if (type == kStSyn) {
+    auto it = streams_.find(key(from, id + 1));
+    if (it != streams_.end()) {
+      // Our answer got lost.
+      it->second->sendAck();
+      return;
+    }
+    if (!acceptor_) {
+      sendReset(from, id, seq);
+      return;
+    }
+    std::unique_ptr<UtpStream> stream(new UtpStream(*this, from, id + 1, id));
+    stream->state_ = UtpStream::State::kConnected;
+    stream->seq_nr_ = random_();
+    stream->ack_nr_ = seq;
+    stream->peer_window_ = get32(data + 12);
+    stream->reply_micro_ = micros(now) - get32(data + 4);
+    UtpStream* accepted = stream.get();
+    std::string accepted_key = key(from, id + 1);
+    streams_[accepted_key] = accepted;
+    acceptor_(std::move(stream));
+    if (streams_.count(accepted_key) != 0) {
+      accepted->sendAck();
+    }
+    return;
+  }
+  auto it = streams_.find(key(from, id));
+  if (it == streams_.end()) {
+    if (type != kStReset) {
+      sendReset(from, id, seq);
+    }
+    return;
+  }
+  it->second->onPacket(type, data, sack, sack_size, data + offset,
+                       size - offset, now);
+}
+
+void UtpSocket::queue(const sockaddr_storage& peer, uint8_t type,
+                      uint16_t connection_id, uint32_t reply_micro,
+                      uint32_t window, uint16_t seq_nr, uint16_t ack_nr,
+                      const unsigned char* sack, size_t sack_size,
+                      const std::string& payload) {
+  if (out_count_ == kBatch) {
+    flush();
+  }
+  unsigned char* out = out_[out_count_].data();
+  out[0] = static_cast<unsigned char>(type << 4 | kVersion);
+  out[1] = sack != nullptr ? kExtSelectiveAck : 0;
+  put16(out + 2, connection_id);
+  put32(out + 4, micros(std::chrono::steady_clock::now()));
+  put32(out + 8, reply_micro);
+  put32(out + 12, window);
+  put16(out + 16, seq_nr);
+  put16(out + 18, ack_nr);
+  size_t size = kHeaderSize;
+  if (sack != nullptr) {
+    out[size] = 0;
+    out[size + 1] = static_cast<unsigned char>(sack_size);
+    std::memcpy(out + size + 2, sack, sack_size);
+    size += 2 + sack_size;
+  }
+  std::memcpy(out + size, payload.data(), payload.size());
+  out_size_[out_count_] = size + payload.size();
+  out_peer_[out_count_] = peer;
+  ++out_count_;
+}
+
+void UtpSocket::sendReset(const sockaddr_storage& peer, uint16_t connection_id,
+                          uint16_t ack_nr) {
+  queue(peer, kStReset, connection_id, 0, 0, random_(), ack_nr, nullptr, 0,
+        {});
+}
+
+void UtpSocket::dispatch() {
+  for (size_t i = 0; i < notify_.size(); ++i) {
+    UtpStream* stream = notify_[i];
+    if (stream != nullptr) {
+      stream->notifying_ = false;
+      stream->dispatch();
+    }
+  }
+  notify_.clear();
+}
+
+std::string UtpSocket::key(const sockaddr_storage& peer,
+                           uint16_t recv_id) const {
+  std::string result(1, static_cast<char>(peer.ss_family));
+  if (peer.ss_family == AF_INET) {
+    const auto& address = reinterpret_cast<const sockaddr_in&>(peer);
+    result.append(reinterpret_cast<const char*>(&address.sin_addr), 4);
+    result.append(reinterpret_cast<const char*>(&address.sin_port), 2);
+  } else {
+    const auto& address = reinterpret_cast<const sockaddr_in6&>(peer);
+    result.append(reinterpret_cast<const char*>(&address.sin6_addr), 16);
+    result.append(reinterpret_cast<const char*>(&address.sin6_port), 2);
+  }
+  result.append(reinterpret_cast<const char*>(&recv_id), 2);
+  return result;
+}
+
+sockaddr_storage UtpSocket::toSocket(const sockaddr_storage& peer) const {
+  if (family_ != AF_INET6 || peer.ss_family != AF_INET) {
+    return peer;
+  }
+  const auto& v4 = reinterpret_cast<const sockaddr_in&>(peer);
+  sockaddr_storage result{};
+  auto& v6 = reinterpret_cast<sockaddr_in6&>(result);
+  v6.sin6_family = AF_INET6;
+  v6.sin6_port = v4.sin_port;
+  v6.sin6_addr.s6_addr[10] = 0xff;
+  v6.sin6_addr.s6_addr[11] = 0xff;
+  std::memcpy(&v6.sin6_addr.s6_addr[12], &v4.sin_addr, 4);
+  return result;
+}
+
+sockaddr_storage UtpSocket::fromSocket(const sockaddr_storage& from) const {
+  const auto& v6 = reinterpret_cast<const sockaddr_in6&>(from);
+  if (from.ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&v6.sin6_addr)) {
+    return from;
+  }
+  sockaddr_storage result{};
+  auto& v4 = reinterpret_cast<sockaddr_in&>(result);
+  v4.sin_family = AF_INET;
+  v4.sin_port = v6.sin6_port;
+  std::memcpy(&v4.sin_addr, &v6.sin6_addr.s6_addr[12], 4);
+  return result;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Reactor.hpp"
+#include "RingBuffer.hpp"
+#include "Transport.hpp"
+
+class UtpSocket;
+
+// One uTP connection (BEP 29): a reliable byte stream over the datagrams
+// of a shared UtpSocket. Output is cut into packets of at most kMaxPayload
+// bytes and sent as far as the congestion window and the peer's receive
+// window allow. The congestion window follows LEDBAT: it grows while the
+// one-way delay the peer reports stays under the 100 ms target and
+// shrinks as queues build up, so uTP yields to other traffic. Lost
+// packets are found through selective acks and timeouts. Input is written
+// straight into the receive buffer, whose free space is the window we
+// advertise.
+class UtpStream : public Transport {
+ public:
+  UtpStream(const UtpStream&) = delete;
+  UtpStream& operator=(const UtpStream&) = delete;
+  // Sends a FIN, without waiting for its ack, and forgets the connection.
+  ~UtpStream() override;
+
+  ssize_t send(const iovec* iov, size_t count) override;
+  void wantWrite() override;
+  int connectError() override { return connect_error_; }
+
+  // Sets where input of an accepted stream goes; see UtpSocket::Acceptor.
+  void attach(std::shared_ptr<RingBuffer> in, Reactor::Handler* handler);
+
+ private:
+  friend class UtpSocket;
+
+  enum class State { kSynSent, kConnected, kClosed };
+
+  struct Packet {
+    uint16_t seq = 0;
+    uint8_t type = 0;
+    std::string payload;
+    std::chrono::steady_clock::time_point sent;
+    int transmissions = 0;
+    bool resent = false;
+  };
+
+  struct Received {
+    bool fin = false;
+    std::string data;
+  };
+
+  UtpStream(UtpSocket& socket, const sockaddr_storage& peer,
+            uint16_t recv_id, uint16_t send_id);
+
+  void onPacket(uint8_t type, const unsigned char* header,
+                const unsigned char* sack, size_t sack_size,
+                const unsigned char* payload, size_t size,
+                std::chrono::steady_clock::time_point now);
+  void acknowledge(uint16_t ack_nr, const unsigned char* sack,
+                   size_t sack_size, uint32_t delay,
+                   std::chrono::steady_clock::time_point now);
+  void updateWindow(size_t bytes_acked, uint32_t delay,
+                    std::chrono::steady_clock::time_point now);
+  void sampleRtt(std::chrono::steady_clock::duration rtt);
+  void onLoss(const Packet& packet);
+  void receive(uint16_t seq, bool fin, const unsigned char* payload,
+               size_t size);
+  bool deliver(bool fin, const unsigned char* payload, size_t size);
+  size_t unsentSize() const { return unsent_.size() - unsent_head_; }
+  void trySend(std::chrono::steady_clock::time_point now);
+  void transmit(Packet& packet, std::chrono::steady_clock::time_point now);
+  void sendAck();
+  void tick(std::chrono::steady_clock::time_point now);
+  void fail(int error);
+  size_t receiveWindow() const;
+  // Queues this stream for UtpSocket::dispatch().
+  void notify();
+  // Reports the events gathered since the last call to the handler.
+  void dispatch();
+
+  UtpSocket& socket_;
+  sockaddr_storage peer_;
+  uint16_t recv_id_;
+  uint16_t send_id_;
+  State state_ = State::kSynSent;
+  std::shared_ptr<RingBuffer> in_;
+  Reactor::Handler* handler_ = nullptr;
+
+  // Next sequence number to send and last one received in order.
+  uint16_t seq_nr_ = 1;
+  uint16_t ack_nr_ = 0;
+  // Bytes taken by send() and not yet cut into packets, from unsent_head_.
+  std::string unsent_;
+  size_t unsent_head_ = 0;
+  // Sent packets not acked yet, in sequence order.
+  std::deque<Packet> in_flight_;
+  size_t bytes_in_flight_ = 0;
+
+  // Congestion window in bytes and the peer's receive window.
+  double max_window_;
+  size_t peer_window_;
+  bool slow_start_ = true;
+  // Highest sequence number sent when the window was last cut for a loss;
+  // further losses up to it belong to the same event.
+  uint16_t loss_seq_ = 0;
+  bool loss_seen_ = false;
+  std::chrono::microseconds rtt_{0};
+  std::chrono::microseconds rtt_var_{0};
+  std::chrono::microseconds rto_;
+  std::chrono::steady_clock::time_point rto_deadline_;
+  // Minimum one-way delay samples of the current and the previous minute;
+  // the smaller one is the base delay.
+  uint32_t delay_min_current_ = UINT32_MAX;
+  uint32_t delay_min_previous_ = UINT32_MAX;
+  std::chrono::steady_clock::time_point delay_bucket_start_;
+  // The peer's one-way delay as we see it, echoed in every packet.
+  uint32_t reply_micro_ = 0;
+
+  // Packets that arrived ahead of a gap, by sequence number.
+  std::map<uint16_t, Received> reorder_;
+  size_t reorder_bytes_ = 0;
+  size_t advertised_window_ = 0;
+  bool ack_due_ = false;
+
+  int connect_error_ = 0;
+  bool want_write_ = false;
+  // Events not reported to the handler yet.
+  bool connected_event_ = false;
+  bool writable_event_ = false;
+  size_t received_event_ = 0;
+  bool eof_event_ = false;
+  int error_event_ = 0;
+  bool notifying_ = false;
+};
+
+// The UDP socket that every uTP connection of a download shares, dual-stack
+// where IPv6 is available. Datagrams are read in batches with recvmmsg and
+// written in batches with sendmmsg; the acks for a batch of input go out
+// once at its end, one per connection. Handlers hear about events only
+// after a batch has been processed, so they may close streams freely.
+class UtpSocket : public Reactor::Handler {
+ public:
+  // Called with every connection a peer opens to us; it must attach() the
+  // stream and keep it, or drop it to refuse the connection.
+  using Acceptor = std::function<void(std::unique_ptr<UtpStream> stream)>;
+
+  // Binds to port on every address (0 picks one); throws
+  // std::runtime_error on failure.
+  explicit UtpSocket(uint16_t port = 0);
+  UtpSocket(const UtpSocket&) = delete;
+  UtpSocket& operator=(const UtpSocket&) = delete;
+  ~UtpSocket() override;
+
+  int fd() const { return fd_; }
+  void setAcceptor(Acceptor acceptor) { acceptor_ = std::move(acceptor); }
+
+  // Opens a connection to peer. Input goes to in; handler hears
+  // onWritable once it is connected or failed.
+  std::unique_ptr<UtpStream> connect(const sockaddr_storage& peer,
+                                     std::shared_ptr<RingBuffer> in,
+                                     Reactor::Handler* handler);
+
+  // Reads and handles every datagram waiting on the socket.
+  void onReadable() override;
+  void onWritable() override {}
+  void onReceived(ssize_t) override {}
+  // Retransmits on timeouts and sends window updates; call it regularly,
+  // at least every few tens of milliseconds while connections are open.
+  void tick();
+  // Sends the queued datagrams.
+  void flush();
+
+ private:
+  friend class UtpStream;
+
+  static constexpr size_t kBatch = 64;
+  static constexpr size_t kMaxDatagram = 2048;
+
+  void handleDatagram(const sockaddr_storage& from, const unsigned char* data,
+                      size_t size, std::chrono::steady_clock::time_point now);
+  // Queues one packet to peer: the header fields and, if any, a selective
+  // ack extension and a payload.
+  void queue(const sockaddr_storage& peer, uint8_t type,
+             uint16_t connection_id, uint32_t reply_micro, uint32_t window,
+             uint16_t seq_nr, uint16_t ack_nr, const unsigned char* sack,
+             size_t sack_size, const std::string& payload);
+  void sendReset(const sockaddr_storage& peer, uint16_t connection_id,
+                 uint16_t ack_nr);
+  void dispatch();
+  std::string key(const sockaddr_storage& peer, uint16_t recv_id) const;
+  // Peers are kept in their plain form; a dual-stack socket sees IPv4
+  // peers as v4-mapped IPv6 addresses.
+  sockaddr_storage toSocket(const sockaddr_storage& peer) const;
+  sockaddr_storage fromSocket(const sockaddr_storage& from) const;
+
+  int fd_ = -1;
+  int family_ = AF_INET6;
+  Acceptor acceptor_;
+  std::mt19937 random_{std::random_device{}()};
+  std::unordered_map<std::string, UtpStream*> streams_;
+  // Streams owing an ack once the current batch is handled, and streams
+  // with events for their handlers.
+  std::vector<UtpStream*> acks_;
+  std::vector<UtpStream*> notify_;
+  // Outgoing datagrams, sent by flush() or whenever kBatch are queued.
+  std::array<std::array<unsigned char, kMaxDatagram>, kBatch> out_{};
+  std::array<size_t, kBatch> out_size_{};
+  std::array<sockaddr_storage, kBatch> out_peer_{};
+  size_t out_count_ = 0;
+  std::array<std::array<unsigned char, kMaxDatagram>, kBatch> in_{};
+};